@@ -4,40 +4,47 @@ import os
 import sys
 import platform
 
-program = "stlviewer"
-
 system_name = platform.system()
 
-os.system("rm -f %s" % program)
-
 src_dir = "."
-modules = ["trackball.c", "stl.c", "stl_viewer.c"]
-files = map(lambda module: src_dir + "/" + module, modules)
-files_str = ' '.join(files)
+
+# program name -> (modules, libraries, frameworks)
+programs = [
+	("stlviewer", ["trackball.c", "stl.c", "stl_txt.c", "stl_normals.c", "stl_arena.c", "stl_lod.c", "stl_bvh.c", "stl_raster.c", "stl_trace.c", "stl_write.c", "stl_viewer.c"], ['glut', 'GLU', 'GL', 'EGL', 'm', 'pthread'], ['GLUT', 'OpenGL']),
+	("stlbench", ["stl.c", "stl_txt.c", "stl_normals.c", "stl_arena.c", "stl_lod.c", "stl_bvh.c", "stl_raster.c", "stl_trace.c", "stl_write.c", "stl_bench.c"], ['m', 'pthread'], []),
+	("stlinfo", ["stl.c", "stl_txt.c", "stl_normals.c", "stl_arena.c", "stl_lod.c", "stl_bvh.c", "stl_raster.c", "stl_trace.c", "stl_write.c", "stl_info.c"], ['m', 'pthread'], []),
+	("stlconvert", ["stl.c", "stl_txt.c", "stl_normals.c", "stl_arena.c", "stl_lod.c", "stl_bvh.c", "stl_raster.c", "stl_trace.c", "stl_write.c", "stl_convert.c"], ['m', 'pthread'], []),
+]
 
 includes = []
 includes = map(lambda include: "-I" + include, includes)
 include_str = ' '.join(includes)
 
-libraries = ['glut', 'GL', 'm']
-libraries = map(lambda library: "-l" + library, libraries)
-libraries_str = ' '.join(libraries)
-
 defines = ['_OPENGL_' , '_%s_' % system_name]
 defines = map(lambda define: "-D" + define, defines)
-defines_str = ' '.join(defines) 
+defines_str = ' '.join(defines)
+
+def compile_program(program, modules, libraries, frameworks):
+	os.system("rm -f %s" % program)
+
+	files = map(lambda module: src_dir + "/" + module, modules)
+	files_str = ' '.join(files)
+
+	libraries = map(lambda library: "-l" + library, libraries)
+	libraries_str = ' '.join(libraries)
+
+	frameworks = map(lambda framework: "-framework " + framework, frameworks)
+	framework_str = ' '.join(frameworks)
 
-if system_name == "Darwin":
-	frameworks = ['GLUT', 'OpenGL']
-        frameworks = map(lambda framework: "-framework " + framework, frameworks)
-	framework_str =  ' '.join(frameworks)
+	if system_name == "Linux":
+		compile_cmd = "gcc -Wall -o %s %s %s %s %s" % (program, files_str, include_str, defines_str, libraries_str)
+	elif system_name == "Darwin":
+		compile_cmd = "cc -g -Wall -Wno-deprecated -o %s %s %s %s" % (program, files_str, defines_str, framework_str)
 
-if system_name == "Linux":
-	compile_cmd = "gcc -Wall -o %s %s %s %s %s" % (program, files_str, include_str, defines_str, libraries_str)
-elif system_name == "Darwin":
-	compile_cmd = "cc -g -Wall -Wno-deprecated -o %s %s %s %s" % (program, files_str, defines_str, framework_str)
+	print(compile_cmd)
+	return os.system(compile_cmd)
 
+for program, modules, libraries, frameworks in programs:
+	compile_program(program, modules, libraries, frameworks)
 
-print compile_cmd
-output = os.system(compile_cmd)
 sys.exit(0)
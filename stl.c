@@ -34,10 +34,24 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
 
 #include "stl.h"
+#include "stl_txt.h"
+#include "stl_normals.h"
+#include "stl_lod.h"
+#include "stl_bvh.h"
+#include "stl_raster.h"
+#include "stl_parallel.h"
+#include "stl_trace.h"
 
 #define STL_MAGIC 0xdeadbeef
 #define STL_STR_SOLID_START "solid"
@@ -48,11 +62,44 @@
 #define STL_STR_LOOP_END "endloop"
 #define STL_STR_VERTEX "vertex"
 
-typedef enum {
-        STL_FILE_TYPE_INVALID,
-        STL_FILE_TYPE_TXT,
-        STL_FILE_TYPE_BIN
-} stl_file_type_t;
+#define STL_TXT_INITIAL_VERTICES 1024
+
+#define STL_BIN_HEADER_SIZE 80
+#define STL_BIN_FACET_CNT_OFFSET STL_BIN_HEADER_SIZE
+#define STL_BIN_FACETS_OFFSET (STL_BIN_HEADER_SIZE + sizeof(STLuint32))
+#define STL_TRIANGLE_VERTEX_CNT 3
+
+#define STL_MAX_THREADS 64
+
+/* Facets decoded before their normals are computed */
+#define STL_NORMALS_BLOCK 256
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* Smallest amount of input worth handing to a thread of its own */
+#ifndef STL_PARALLEL_MIN_SIZE
+#define STL_PARALLEL_MIN_SIZE (4 * 1024 * 1024)
+#endif
+
+/* Largest 16 bit quantized coordinate */
+#define STL_QUANT_MAX 65535
+
+/* Most levels of detail stl_build_lods builds */
+#define STL_MAX_LODS 16
+
+/* Working memory of the simplification per edge, sizes its thread count */
+#define STL_LOD_BYTES_PER_EDGE 64
+
+/* Work of building the hierarchy per facet and of tracing a ray, in bytes */
+#define STL_BVH_BYTES_PER_FACET 128
+#define STL_BVH_BYTES_PER_RAY 4096
+
+/* Work of rendering per facet and per pixel, in bytes */
+#define STL_RASTER_BYTES_PER_FACET 128
+#define STL_RASTER_BYTES_PER_PIXEL 16
+
+/* Number of bytes at the start of a file looked at to detect its type */
+#define STL_DETECT_WINDOW 512
 
 typedef enum stl_token {
         STL_TOKEN_INVALID,
@@ -65,17 +112,20 @@ typedef enum stl_token {
         STL_TOKEN_VERTEX
 } stl_token_t;
 
+#define STL_TOKEN_ENTRY(str, token) {str, sizeof(str) - 1, token}
+
 struct {
         const char *str;
+        size_t len;
         stl_token_t token;
 } stl_token_map[] = {
-        {STL_STR_SOLID_START, STL_TOKEN_SOLID_START},
-        {STL_STR_SOLID_END, STL_TOKEN_SOLID_END},
-        {STL_STR_FACET_START, STL_TOKEN_FACET_START},
-        {STL_STR_FACET_END, STL_TOKEN_FACET_END},
-        {STL_STR_LOOP_START, STL_TOKEN_LOOP_START},
-        {STL_STR_LOOP_END, STL_TOKEN_LOOP_END},
-        {STL_STR_VERTEX, STL_TOKEN_VERTEX},
+        STL_TOKEN_ENTRY(STL_STR_VERTEX, STL_TOKEN_VERTEX),
+        STL_TOKEN_ENTRY(STL_STR_SOLID_START, STL_TOKEN_SOLID_START),
+        STL_TOKEN_ENTRY(STL_STR_SOLID_END, STL_TOKEN_SOLID_END),
+        STL_TOKEN_ENTRY(STL_STR_FACET_START, STL_TOKEN_FACET_START),
+        STL_TOKEN_ENTRY(STL_STR_FACET_END, STL_TOKEN_FACET_END),
+        STL_TOKEN_ENTRY(STL_STR_LOOP_START, STL_TOKEN_LOOP_START),
+        STL_TOKEN_ENTRY(STL_STR_LOOP_END, STL_TOKEN_LOOP_END),
 };
 
 #define STL_TOTAL_TOKENS (sizeof(stl_token_map)/sizeof(stl_token_map[0]))
@@ -92,13 +142,13 @@ typedef enum stl_state {
 } stl_state_t;
 
 typedef struct {
-	STLFloat x;
-	STLFloat y;
-	STLFloat z;
-} vector_t;
-
-typedef vector_t vertex_t;
-typedef vector_t normal_t;
+        STLFloat min_x;
+        STLFloat max_x;
+        STLFloat min_y;
+        STLFloat max_y;
+        STLFloat min_z;
+        STLFloat max_z;
+} stl_bounds_t;
 
 struct stl_s {
         int magic;
@@ -110,35 +160,228 @@ struct stl_s {
         STLuint vertex_cnt;
 
         STLFloat *vertices;
-        STLFloat min_x;
-        STLFloat max_x;
-        STLFloat min_y;
-        STLFloat max_y;
-        STLFloat min_z;
-        STLFloat max_z;
-
+        size_t vertices_size;
+        STLFloat *unique_vertices;
+        STLuint unique_vertex_cnt;
+        STLuint32 *indices;
+        STLFloat weld_epsilon;
+        stl_lod_level_t *lods;
+        int lod_cnt;
+        stl_bvh_t *bvh;
+        stl_raster_t *raster;
+        STLuint16 *positions16;
+        STLFloat *face_normals;
+        STLFloat quant_offset[3];
+        STLFloat quant_scale[3];
+        int layout;
+        STLuint8 *map;
+        size_t map_size;
+        STLuint8 *cache_map;
+        size_t cache_map_size;
+        int cache_mode;
+        int cache_hit;
+        char *cache_dir;
+        size_t cache_max_size;
+        unsigned long long source_hash;
+        unsigned long long source_size;
+        int source_hashed;
+
+        stl_bounds_t bounds;
+
+        /* allocator counts into counters and forwards to user_allocator */
+        stl_allocator_t allocator;
+        stl_allocator_t user_allocator;
+        stl_stats_t counters;
+        stl_stats_t stats;
+        int thread_cnt;
         int lineno;
         int loaded;
 };
 
+static void *
+stl_default_alloc(void *ctx, size_t size)
+{
+        return malloc(size);
+}
+
+static void *
+stl_default_resize(void *ctx, void *ptr, size_t size)
+{
+        return realloc(ptr, size);
+}
+
+static void
+stl_default_release(void *ctx, void *ptr)
+{
+        free(ptr);
+}
+
+static const stl_allocator_t stl_default_allocator = {
+        stl_default_alloc,
+        stl_default_resize,
+        stl_default_release,
+        NULL
+};
+
+/* Count a system call of the load path, the value is that of call */
+#define STL_SYSCALL(counters, call) ((counters)->syscall_cnt++, (call))
+
+static void *
+stl_mem_alloc(const stl_allocator_t *allocator, size_t size)
+{
+        return allocator->alloc(allocator->ctx, size);
+}
+
+static void *
+stl_mem_resize(const stl_allocator_t *allocator, void *ptr, size_t size)
+{
+        return allocator->resize(allocator->ctx, ptr, size);
+}
+
+static void
+stl_mem_release(const stl_allocator_t *allocator, void *ptr)
+{
+        if (ptr) {
+                allocator->release(allocator->ctx, ptr);
+        }
+}
+
+/*
+ * The allocator of an object counts the allocations made through it, from
+ * any thread, before handing them to the allocator it was created with.
+ */
+static void
+stl_count_alloc(stl_t *stl, size_t size)
+{
+        __atomic_add_fetch(&stl->counters.alloc_cnt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stl->counters.alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+static void *
+stl_counted_alloc(void *ctx, size_t size)
+{
+        stl_t *stl = (stl_t *)ctx;
+
+        stl_count_alloc(stl, size);
+        return stl_mem_alloc(&stl->user_allocator, size);
+}
+
+static void *
+stl_counted_resize(void *ctx, void *ptr, size_t size)
+{
+        stl_t *stl = (stl_t *)ctx;
+
+        stl_count_alloc(stl, size);
+        return stl_mem_resize(&stl->user_allocator, ptr, size);
+}
+
+static void
+stl_counted_release(void *ctx, void *ptr)
+{
+        stl_t *stl = (stl_t *)ctx;
+
+        stl_mem_release(&stl->user_allocator, ptr);
+}
+
 stl_t *
-stl_alloc(void)
+stl_alloc_with(const stl_allocator_t *allocator)
 {
         stl_t *stl = NULL;
-        stl = (stl_t *)malloc(sizeof(*stl));
 
+        if (allocator == NULL) {
+                allocator = &stl_default_allocator;
+        }
+
+        stl = (stl_t *)stl_mem_alloc(allocator, sizeof(*stl));
         if (stl == NULL) {
                 return NULL;
         }
 
         memset(stl, 0, sizeof(*stl));
         stl->magic = STL_MAGIC;
+        stl->user_allocator = *allocator;
+        stl->allocator.alloc = stl_counted_alloc;
+        stl->allocator.resize = stl_counted_resize;
+        stl->allocator.release = stl_counted_release;
+        stl->allocator.ctx = stl;
+        stl->cache_mode = STL_CACHE_READ;
+
+        stl_trace_init();
+
         return stl;
 }
 
+stl_t *
+stl_alloc(void)
+{
+        return stl_alloc_with(NULL);
+}
+
+static void
+stl_release_lods(stl_t *stl)
+{
+        int i = 0;
+
+        for (i = 0; i < stl->lod_cnt; i++) {
+                stl_mem_release(&stl->allocator, stl->lods[i].indices);
+        }
+
+        stl_mem_release(&stl->allocator, stl->lods);
+        stl->lods = NULL;
+        stl->lod_cnt = 0;
+}
+
+/*
+ * The indexed mesh lives either in buffers of its own or in a mapped
+ * cache. The levels of detail index into it and go with it.
+ */
+static void
+stl_release_indexed(stl_t *stl)
+{
+        stl_release_lods(stl);
+
+        if (stl->cache_map) {
+                munmap(stl->cache_map, stl->cache_map_size);
+                stl->cache_map = NULL;
+                stl->cache_map_size = 0;
+        } else {
+                stl_mem_release(&stl->allocator, stl->unique_vertices);
+                stl_mem_release(&stl->allocator, stl->indices);
+        }
+
+        stl->unique_vertices = NULL;
+        stl->indices = NULL;
+        stl->unique_vertex_cnt = 0;
+}
+
+static void
+stl_release_bvh(stl_t *stl)
+{
+        stl_bvh_free(stl->bvh);
+        stl->bvh = NULL;
+}
+
+/* Release everything the object holds except for the vertex buffer */
+static void
+stl_release_buffers(stl_t *stl)
+{
+        stl_release_indexed(stl);
+        stl_release_bvh(stl);
+        stl_mem_release(&stl->allocator, stl->positions16);
+        stl_mem_release(&stl->allocator, stl->face_normals);
+
+        if (stl->map) {
+                munmap(stl->map, stl->map_size);
+                stl->map = NULL;
+                stl->map_size = 0;
+        }
+}
+
 void
 stl_free(stl_t *stl)
 {
+        stl_allocator_t allocator;
+
         if (stl) {
 
                 assert(stl->magic == STL_MAGIC);
@@ -147,24 +390,71 @@ stl_free(stl_t *stl)
                         return;
                 }
 
-                if (stl->vertices) {
-                        free(stl->vertices);
-                }
+                allocator = stl->user_allocator;
 
-                free(stl);
+                stl_release_buffers(stl);
+                stl_raster_free(stl->raster);
+                stl_mem_release(&allocator, stl->cache_dir);
+                stl_mem_release(&allocator, stl->vertices);
+                stl_mem_release(&allocator, stl);
         }
 }
 
+void
+stl_keep_bvh(stl_t *stl)
+{
+        stl_bvh_t *bvh = stl->bvh;
+
+        stl->bvh = NULL;
+        stl_reset(stl);
+        stl->bvh = bvh;
+
+        stl_raster_free(stl->raster);
+        stl_mem_release(&stl->allocator, stl->vertices);
+        stl->raster = NULL;
+        stl->vertices = NULL;
+        stl->vertices_size = 0;
+}
+
+void
+stl_reset(stl_t *stl)
+{
+        stl_t kept = *stl;
+
+        stl_release_buffers(stl);
+
+        memset(stl, 0, sizeof(*stl));
+        stl->magic = kept.magic;
+        stl->allocator = kept.allocator;
+        stl->user_allocator = kept.user_allocator;
+        stl->counters = kept.counters;
+        stl->stats = kept.stats;
+        stl->thread_cnt = kept.thread_cnt;
+        stl->layout = kept.layout;
+        stl->cache_mode = kept.cache_mode;
+        stl->cache_dir = kept.cache_dir;
+        stl->cache_max_size = kept.cache_max_size;
+        stl->vertices = kept.vertices;
+        stl->vertices_size = kept.vertices_size;
+        stl->raster = kept.raster;
+}
+
 
 static stl_token_t
-stl_str_token(const char* str)
+stl_str_token(const char* str, size_t len)
 {
         stl_token_t token = STL_TOKEN_INVALID;
         int i = 0;
 
         for (i = 0; i < STL_TOTAL_TOKENS; i++) {
 
-                if (strcasecmp(stl_token_map[i].str, str) == 0) {
+                /* Cheap length and first letter checks before comparing */
+                if (stl_token_map[i].len != len ||
+                    (str[0] | 0x20) != stl_token_map[i].str[0]) {
+                        continue;
+                }
+
+                if (strncasecmp(stl_token_map[i].str, str, len) == 0) {
                         token = stl_token_map[i].token;
                         break;
                 }
@@ -173,482 +463,3098 @@ stl_str_token(const char* str)
         return token;
 }
 
-static stl_error_t
-stl_parse_txt(stl_t *stl)
+static const STLuint8 *
+stl_bin_facet(stl_t *stl, STLuint idx)
 {
-        FILE *fp = fopen(stl->file, "r");
-        char *str_token = NULL;
-        stl_token_t token;
-        int vertex_cnt = 0;
-        int error = 1;
-        stl_error_t ret = STL_ERR_NONE;
+        return stl->map + STL_BIN_FACETS_OFFSET + (size_t)idx * STL_BIN_FACET_SIZE;
+}
 
-        if (fp == NULL) {
-                return STL_ERR_FOPEN;
+/* Add the time since start to a phase and trace it when tracing */
+static void
+stl_phase_end(stl_t *stl, const char *name, double *time, double start)
+{
+        double end = stl_clock();
+
+        *time += end - start;
+
+        if (stl_trace_file) {
+                stl_trace_event(name, stl->file, start, end);
         }
+}
 
-        char buffer[256];
+static void
+stl_unmap_file(stl_t *stl)
+{
+        if (stl->map) {
+                STL_SYSCALL(&stl->counters, munmap(stl->map, stl->map_size));
+                stl->map = NULL;
+                stl->map_size = 0;
+        }
+}
 
-        while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+static stl_error_t
+stl_map_file(stl_t *stl)
+{
+        stl_error_t err = STL_ERR_NONE;
+        stl_stats_t *counters = &stl->counters;
+        struct stat st;
+        void *map = NULL;
+        double start = stl_clock();
 
-                stl->lineno++;
-                str_token = strtok(buffer, " \r\n");
+        stl_unmap_file(stl);
 
-                /* Empty line */
-                if (str_token == NULL) {
-                        continue;
-                }
+        int fd = STL_SYSCALL(counters, open(stl->file, O_RDONLY));
+        if (fd == -1) {
+                return STL_ERR_FOPEN;
+        }
 
-                /* Check for invalid line format */
-                token = stl_str_token(str_token);
-                if (token == STL_TOKEN_INVALID) {
-                        STL_DBG("Error while processing token %s\n", str_token);
-                        goto err;
-                }
+        if (STL_SYSCALL(counters, fstat(fd, &st)) != 0) {
+                err = STL_ERR_FOPEN;
+                goto done;
+        }
 
+        if (st.st_size == 0) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
 
-                switch (token) {
+        map = STL_SYSCALL(counters, mmap(NULL, st.st_size, PROT_READ,
+                                         MAP_PRIVATE, fd, 0));
+        if (map == MAP_FAILED) {
+                err = STL_ERR_LOAD;
+                goto done;
+        }
 
-                        case STL_TOKEN_SOLID_START:
-                                stl->state = STL_STATE_SOLID_START;
-                                break;
+        STL_SYSCALL(counters, madvise(map, st.st_size, MADV_SEQUENTIAL));
 
-                        case STL_TOKEN_SOLID_END:
-                                error = 0;
-                                stl->state = STL_STATE_SOLID_END;
-                                break;
+        stl->map = (STLuint8 *)map;
+        stl->map_size = st.st_size;
+        counters->bytes_read += st.st_size;
 
-                        case STL_TOKEN_FACET_START:
+done:
+        STL_SYSCALL(counters, close(fd));
+        stl_phase_end(stl, "map", &counters->map_time, start);
+        return err;
+}
 
-                                if (stl->state != STL_STATE_SOLID_START &&
-                                    stl->state != STL_STATE_FACET_END) {
-                                        goto err;
-                                }
+/*
+ * Map a binary stl file into memory and read its facet count. The facet
+ * count declared in the header is checked against the size of the file
+ * so that nothing is allocated for a truncated or corrupt file.
+ */
+static stl_error_t
+stl_map_bin_file(stl_t *stl)
+{
+        stl_error_t err = STL_ERR_NONE;
 
-                                stl->state = STL_STATE_FACET_START;
-                                break;
+        if ((err = stl_map_file(stl)) != STL_ERR_NONE) {
+                return err;
+        }
 
-                        case STL_TOKEN_FACET_END:
-                                if (stl->state != STL_STATE_LOOP_END) {
-                                        goto err;
-                                }
+        if (stl->map_size < STL_BIN_FACETS_OFFSET) {
+                stl_unmap_file(stl);
+                return STL_ERR_FILE_FORMAT;
+        }
 
-                                stl->state = STL_STATE_FACET_END;
-                                stl->facet_cnt = stl->facet_cnt + 1;
-                                break;
+        memcpy(&stl->facet_cnt, stl->map + STL_BIN_FACET_CNT_OFFSET,
+               sizeof(stl->facet_cnt));
 
-                        case STL_TOKEN_LOOP_START:
+        if (STL_BIN_FACETS_OFFSET + (size_t)stl->facet_cnt * STL_BIN_FACET_SIZE >
+            stl->map_size) {
+                stl_unmap_file(stl);
+                return STL_ERR_FILE_FORMAT;
+        }
 
-                                if (stl->state != STL_STATE_FACET_START) {
-                                        goto err;
-                                }
+        return err;
+}
 
-                                stl->state = STL_STATE_LOOP_START;
-                                vertex_cnt = 0;
-                                break;
+static void
+stl_bounds_init(stl_bounds_t *bounds)
+{
+        bounds->min_x = bounds->min_y = bounds->min_z = FLT_MAX;
+        bounds->max_x = bounds->max_y = bounds->max_z = -FLT_MAX;
+}
 
-                        case STL_TOKEN_LOOP_END:
-                                if (stl->state != STL_STATE_VERTEX ||
-                                    vertex_cnt != 3) {
-                                        goto err;
-                                }
+static void
+stl_bounds_update(stl_bounds_t *bounds, const STLFloat *v)
+{
+        if (v[0] < bounds->min_x) bounds->min_x = v[0];
+        if (v[0] > bounds->max_x) bounds->max_x = v[0];
 
-                                stl->state = STL_STATE_LOOP_END;
-                                break;
+        if (v[1] < bounds->min_y) bounds->min_y = v[1];
+        if (v[1] > bounds->max_y) bounds->max_y = v[1];
 
-                        case STL_TOKEN_VERTEX:
-                                if (stl->state != STL_STATE_VERTEX &&
-                                    stl->state != STL_STATE_LOOP_START) {
-                                        goto err;
-                                }
+        if (v[2] < bounds->min_z) bounds->min_z = v[2];
+        if (v[2] > bounds->max_z) bounds->max_z = v[2];
+}
 
-                                stl->state = STL_STATE_VERTEX;
-                                stl->vertex_cnt = stl->vertex_cnt + 1;
-                                vertex_cnt += 1;
-                                break;
+static void
+stl_bounds_merge(stl_bounds_t *bounds, const stl_bounds_t *other)
+{
+        if (other->min_x < bounds->min_x) bounds->min_x = other->min_x;
+        if (other->max_x > bounds->max_x) bounds->max_x = other->max_x;
 
-                        default:
-                                goto err;
-                }
+        if (other->min_y < bounds->min_y) bounds->min_y = other->min_y;
+        if (other->max_y > bounds->max_y) bounds->max_y = other->max_y;
+
+        if (other->min_z < bounds->min_z) bounds->min_z = other->min_z;
+        if (other->max_z > bounds->max_z) bounds->max_z = other->max_z;
+}
 
+/*
+ * Number of threads to use for work_size bytes of input. Small inputs are
+ * not worth the cost of starting threads.
+ */
+static int
+stl_thread_cnt(stl_t *stl, size_t work_size)
+{
+        long cnt = stl->thread_cnt;
 
+        if (cnt <= 0) {
+                cnt = sysconf(_SC_NPROCESSORS_ONLN);
         }
 
-err:
-        ret = error ? STL_ERR_FILE_FORMAT : STL_ERR_NONE;
+        if ((size_t)cnt > work_size / STL_PARALLEL_MIN_SIZE) {
+                cnt = work_size / STL_PARALLEL_MIN_SIZE;
+        }
 
-        fclose(fp);
+        if (cnt > STL_MAX_THREADS) {
+                cnt = STL_MAX_THREADS;
+        }
 
-        return ret;
+        return cnt < 1 ? 1 : (int)cnt;
 }
 
-static void
-calculate_triangle_normal(vertex_t v1, vertex_t v2, vertex_t v3, normal_t *normal)
+/*
+ * Run worker on each of the cnt arguments in args, one thread per argument.
+ * The calling thread takes the first argument, and takes over any argument
+ * for which a thread could not be started.
+ */
+void
+stl_parallel(void *(*worker)(void *), void *args, size_t arg_size, int cnt)
 {
-	vector_t U;
-	vector_t V;
-        STLFloat length;
-
-	U.x = v2.x - v1.x;
-	U.y = v2.y - v1.y;
-	U.z = v2.z - v1.z;
-
-	V.x = v3.x - v1.x;
-	V.y = v3.y - v1.y;
-	V.z = v3.z - v1.z;
+        pthread_t threads[STL_MAX_THREADS];
+        int started[STL_MAX_THREADS];
+        int i = 0;
 
-	normal->x = U.y * V.z - U.z * V.y;
-	normal->y = U.z * V.x - U.x * V.z;
-	normal->z = U.x * V.y - U.y * V.x;
+        for (i = 1; i < cnt; i++) {
+                started[i] = pthread_create(&threads[i], NULL, worker,
+                                            (char *)args + i * arg_size) == 0;
+        }
 
-	length = normal->x * normal->x + normal->y * normal->y + normal->z * normal->z;
-	length = sqrt(length);
+        worker(args);
 
-	normal->x = normal->x / length;
-	normal->y = normal->y / length;
-	normal->z = normal->z / length;
+        for (i = 1; i < cnt; i++) {
+                if (started[i]) {
+                        pthread_join(threads[i], NULL);
+                } else {
+                        worker((char *)args + i * arg_size);
+                }
+        }
 }
 
-static void
-stl_fill_vertex_normals(stl_t *stl)
-{
-        STLuint vertex_cnt = stl->vertex_cnt;
-        STLuint triangle_cnt = vertex_cnt / 3;
-        STLuint i, idx = 0;
-        vertex_t *v1, *v2, *v3;
-        normal_t normal, *n1, *n2, *n3;
-        STLFloat *vertices = stl->vertices;
+/*
+ * A range of an ASCII stl file parsed by one thread. Every range but the
+ * first starts right after an "endfacet" line, so the parser state at its
+ * start is known without looking at the preceding ranges.
+ */
+typedef struct {
+        const char *start;
+        const char *end;
+        stl_state_t state;
 
-        for (i = 0; i < triangle_cnt; i++) {
+        const stl_allocator_t *allocator;
+        STLFloat *vertices;
+        STLuint capacity;
+        STLuint vertex_cnt;
+        STLuint32 facet_cnt;
+        stl_bounds_t bounds;
 
-                idx = i*18;
+        int loop_vertex_cnt;
+        int lineno;
+        int solid_end;
+        stl_error_t err;
+} stl_txt_chunk_t;
 
-                v1 = (vertex_t *)&vertices[idx + 0];
-                n1 = (normal_t *)&vertices[idx + 3];
+/*
+ * Make room for at least one more vertex in the vertex buffer. The buffer
+ * grows geometrically so that the number of reallocations stays logarithmic
+ * in the size of the file.
+ */
+static stl_error_t
+stl_reserve_vertex(stl_txt_chunk_t *chunk)
+{
+        STLFloat *vertices = NULL;
+        STLuint new_capacity = 0;
 
-                v2 = (vertex_t *)&vertices[idx + 6];
-                n2 = (normal_t *)&vertices[idx + 9];
+        if (chunk->vertex_cnt < chunk->capacity) {
+                return STL_ERR_NONE;
+        }
 
-                v3 = (vertex_t *)&vertices[idx + 12];
-                n3 = (normal_t *)&vertices[idx + 15];
+        new_capacity = chunk->capacity ? chunk->capacity * 2 :
+                                         STL_TXT_INITIAL_VERTICES;
+        vertices = (STLFloat *)stl_mem_resize(chunk->allocator, chunk->vertices,
+                                       6 * (size_t)new_capacity * sizeof(STLFloat));
+        if (vertices == NULL) {
+                return STL_ERR_MEM;
+        }
 
-                calculate_triangle_normal(*v1, *v2, *v3, &normal);
+        chunk->vertices = vertices;
+        chunk->capacity = new_capacity;
 
-                *n1 = normal;
-                *n2 = normal;
-                *n3 = normal;
-        }
+        return STL_ERR_NONE;
 }
 
+/*
+ * Validate the grammar of the line [str, eol) of an ASCII stl file and
+ * collect its vertex, if any.
+ */
 static stl_error_t
-stl_get_vertices(stl_t *stl)
-{
-        FILE *fp = fopen(stl->file, "r");
-        char *str_token = NULL;
-        char *vx = NULL;
-        char *vy = NULL;
-        char *vz = NULL;
-        STLFloat fvx, fvy, fvz;
+stl_parse_txt_line(stl_txt_chunk_t *chunk, const char *str, const char *eol)
+{
+        const char *word = NULL;
         stl_token_t token;
-        int vertex_idx = 0;
-        int error = 1;
-        stl_error_t ret = STL_ERR_NONE;
+        STLFloat *vertex = NULL;
 
-        if (fp == NULL) {
-                return STL_ERR_FOPEN;
-        }
+        word = stl_txt_skip_space(str, eol);
+        str = stl_txt_word_end(word, eol);
 
-        char buffer[256];
+        /* Empty line */
+        if (word == str) {
+                return STL_ERR_NONE;
+        }
 
-        stl->min_x = stl->min_y = stl->min_z = FLT_MAX;
-        stl->max_x = stl->max_y = stl->max_z = FLT_MIN;
+        /* Check for invalid line format */
+        token = stl_str_token(word, str - word);
+        if (token == STL_TOKEN_INVALID) {
+                STL_DBG("Error while processing token %.*s\n",
+                        (int)(str - word), word);
+                return STL_ERR_FILE_FORMAT;
+        }
 
-        while (fgets(buffer, sizeof(buffer), fp) != NULL) {
 
-                str_token = strtok(buffer, " \r\n");
+        switch (token) {
 
-                /* Empty line */
-                if (str_token == NULL) {
-                        continue;
-                }
+                case STL_TOKEN_SOLID_START:
+                        chunk->state = STL_STATE_SOLID_START;
+                        break;
 
-                /* Check for invalid line format */
-                token = stl_str_token(str_token);
-                if (token == STL_TOKEN_INVALID) {
-                        STL_DBG("Error while processing token %s\n", str_token);
-                        goto err;
-                }
+                case STL_TOKEN_SOLID_END:
+                        chunk->solid_end = 1;
+                        chunk->state = STL_STATE_SOLID_END;
+                        break;
 
-                if (token == STL_TOKEN_VERTEX) {
-                        vx = strtok(NULL, " ");
+                case STL_TOKEN_FACET_START:
 
-                        if (vx == NULL) {
-                                goto err;
+                        if (chunk->state != STL_STATE_SOLID_START &&
+                            chunk->state != STL_STATE_FACET_END) {
+                                return STL_ERR_FILE_FORMAT;
                         }
 
-                        fvx = strtof(vx, NULL);
-
-                        if (fvx < stl->min_x) {
-                                stl->min_x = fvx;
-                        }
+                        chunk->state = STL_STATE_FACET_START;
+                        break;
 
-                        if (fvx > stl->max_x) {
-                                stl->max_x = fvx;
+                case STL_TOKEN_FACET_END:
+                        if (chunk->state != STL_STATE_LOOP_END) {
+                                return STL_ERR_FILE_FORMAT;
                         }
 
-                        stl->vertices[vertex_idx++] = fvx;
+                        chunk->state = STL_STATE_FACET_END;
+                        chunk->facet_cnt = chunk->facet_cnt + 1;
+                        break;
 
-                        vy = strtok(NULL, " ");
+                case STL_TOKEN_LOOP_START:
 
-                        if (vy == NULL) {
-                                goto err;
+                        if (chunk->state != STL_STATE_FACET_START) {
+                                return STL_ERR_FILE_FORMAT;
                         }
 
-                        fvy = strtof(vy, NULL);
-
-                        if (fvy < stl->min_y) {
-                                stl->min_y = fvy;
-                        }
+                        chunk->state = STL_STATE_LOOP_START;
+                        chunk->loop_vertex_cnt = 0;
+                        break;
 
-                        if (fvy > stl->max_y) {
-                                stl->max_y = fvy;
+                case STL_TOKEN_LOOP_END:
+                        if (chunk->state != STL_STATE_VERTEX ||
+                            chunk->loop_vertex_cnt != 3) {
+                                return STL_ERR_FILE_FORMAT;
                         }
 
-                        stl->vertices[vertex_idx++] = fvy;
-
-                        vz = strtok(NULL, " ");
+                        chunk->state = STL_STATE_LOOP_END;
+                        break;
 
-                        if (vz == NULL) {
-                                goto err;
+                case STL_TOKEN_VERTEX:
+                        if (chunk->state != STL_STATE_VERTEX &&
+                            chunk->state != STL_STATE_LOOP_START) {
+                                return STL_ERR_FILE_FORMAT;
                         }
 
-                        fvz = strtof(vz, NULL);
-
-                        if (fvz < stl->min_z) {
-                                stl->min_z = fvz;
+                        if (stl_reserve_vertex(chunk) != STL_ERR_NONE) {
+                                return STL_ERR_MEM;
                         }
 
-                        if (fvz > stl->max_z) {
-                                stl->max_z = fvz;
+                        vertex = &chunk->vertices[6 * (size_t)chunk->vertex_cnt];
+                        if (stl_txt_float(&str, eol, &vertex[0]) ||
+                            stl_txt_float(&str, eol, &vertex[1]) ||
+                            stl_txt_float(&str, eol, &vertex[2])) {
+                                return STL_ERR_FILE_FORMAT;
                         }
 
-                       stl->vertices[vertex_idx++] = fvz;
-                       vertex_idx += 3;
-                }
-        }
-
-        error = 0;
+                        stl_bounds_update(&chunk->bounds, vertex);
 
-err:
-        ret = error ? STL_ERR_FILE_FORMAT : STL_ERR_NONE;
+                        chunk->state = STL_STATE_VERTEX;
+                        chunk->vertex_cnt = chunk->vertex_cnt + 1;
+                        chunk->loop_vertex_cnt += 1;
+                        break;
 
-        fclose(fp);
+                default:
+                        return STL_ERR_FILE_FORMAT;
+        }
+
+        return STL_ERR_NONE;
+}
+
+/*
+ * Validate the grammar of a range of an ASCII stl file and collect its
+ * vertices. On error chunk->lineno is the offending line relative to the
+ * start of the range.
+ */
+static void *
+stl_parse_txt_chunk(void *arg)
+{
+        stl_txt_chunk_t *chunk = (stl_txt_chunk_t *)arg;
+        const char *str = chunk->start;
+        const char *end = chunk->end;
+        const char *eol = NULL;
+        double start = stl_trace_file ? stl_clock() : 0;
+
+        stl_bounds_init(&chunk->bounds);
+
+        for (; str < end; str = (eol < end) ? eol + 1 : end) {
+
+                chunk->lineno++;
+                eol = stl_txt_eol(str, end);
+
+                chunk->err = stl_parse_txt_line(chunk, str, eol);
+                if (chunk->err != STL_ERR_NONE) {
+                        break;
+                }
+        }
+
+        if (stl_trace_file) {
+                stl_trace_event("parse range", NULL, start, stl_clock());
+        }
+
+        return NULL;
+}
+
+/* Is the line starting at str an "endfacet" line */
+static int
+stl_txt_is_facet_end(const char *str, const char *eol)
+{
+        const char *word = stl_txt_skip_space(str, eol);
+        const char *word_end = stl_txt_word_end(word, eol);
+
+        return stl_str_token(word, word_end - word) == STL_TOKEN_FACET_END;
+}
+
+/*
+ * Split [str, end) into at most chunk_cnt ranges of roughly equal size
+ * that each end right after an "endfacet" line (the last one ends at end).
+ * Returns the number of ranges.
+ */
+static int
+stl_txt_split(const char *str, const char *end, stl_txt_chunk_t *chunks,
+              int chunk_cnt)
+{
+        size_t chunk_size = (end - str) / chunk_cnt;
+        const char *split = NULL;
+        const char *eol = NULL;
+        int cnt = 0;
+
+        while (str < end) {
+                chunks[cnt].start = str;
+                chunks[cnt].state = cnt ? STL_STATE_FACET_END : STL_STATE_START;
+
+                if (cnt == chunk_cnt - 1 || (size_t)(end - str) <= chunk_size) {
+                        chunks[cnt++].end = end;
+                        break;
+                }
+
+                /* Move to the start of the line holding the split point */
+                split = str + chunk_size;
+                while (split > str && split[-1] != '\n') {
+                        split--;
+                }
+
+                for (; split < end; split = eol + 1) {
+                        eol = stl_txt_eol(split, end);
+                        if (eol == end) {
+                                split = end;
+                                break;
+                        }
+
+                        if (stl_txt_is_facet_end(split, eol)) {
+                                split = eol + 1;
+                                break;
+                        }
+                }
+
+                chunks[cnt++].end = split;
+                str = split;
+        }
+
+        return cnt;
+}
+
+/*
+ * Parse an ASCII stl file. Large files are split on facet boundaries and
+ * the ranges are parsed in parallel, the results are then stitched back
+ * together in file order.
+ */
+static stl_error_t
+stl_parse_txt(stl_t *stl)
+{
+        stl_txt_chunk_t chunks[STL_MAX_THREADS];
+        stl_txt_chunk_t *chunk = NULL;
+        STLFloat *vertices = NULL;
+        const char *str = NULL;
+        int chunk_cnt = 0;
+        int solid_end = 0;
+        int i = 0;
+        size_t offset = 0;
+        double start = 0;
+        stl_error_t ret = STL_ERR_NONE;
+
+        if ((ret = stl_map_file(stl)) != STL_ERR_NONE) {
+                return ret;
+        }
+
+        start = stl_clock();
+        str = (const char *)stl->map;
+
+        memset(chunks, 0, sizeof(chunks));
+        chunk_cnt = stl_thread_cnt(stl, stl->map_size);
+        chunk_cnt = stl_txt_split(str, str + stl->map_size, chunks, chunk_cnt);
+        stl->counters.thread_cnt = chunk_cnt;
+
+        for (i = 0; i < chunk_cnt; i++) {
+                chunks[i].allocator = &stl->allocator;
+        }
+
+        /* The first range starts out in the buffer kept by stl_reset */
+        chunks[0].vertices = stl->vertices;
+        chunks[0].capacity = stl->vertices_size / (6 * sizeof(STLFloat));
+        stl->vertices = NULL;
+        stl->vertices_size = 0;
+
+        stl_parallel(stl_parse_txt_chunk, chunks, sizeof(chunks[0]), chunk_cnt);
+
+        /* Merge the ranges, the first error in file order wins */
+        stl_bounds_init(&stl->bounds);
+
+        for (i = 0; i < chunk_cnt; i++) {
+                chunk = &chunks[i];
+
+                stl->lineno += chunk->lineno;
+                stl->state = chunk->state;
+                stl->facet_cnt += chunk->facet_cnt;
+                stl->vertex_cnt += chunk->vertex_cnt;
+                solid_end |= chunk->solid_end;
+
+                if (chunk->err != STL_ERR_NONE) {
+                        ret = chunk->err;
+                        break;
+                }
+
+                stl_bounds_merge(&stl->bounds, &chunk->bounds);
+        }
+
+        if (ret == STL_ERR_NONE && !solid_end) {
+                ret = STL_ERR_FILE_FORMAT;
+        }
+
+        if (ret != STL_ERR_NONE) {
+                goto done;
+        }
+
+        /* Reuse the buffer of the first range for the whole mesh */
+        if (stl->vertex_cnt > chunks[0].capacity) {
+                vertices = (STLFloat *)stl_mem_resize(&stl->allocator, chunks[0].vertices,
+                                6 * (size_t)stl->vertex_cnt * sizeof(STLFloat));
+                if (vertices == NULL) {
+                        ret = STL_ERR_MEM;
+                        goto done;
+                }
+
+                chunks[0].vertices = vertices;
+                chunks[0].capacity = stl->vertex_cnt;
+        }
+
+        offset = 6 * (size_t)chunks[0].vertex_cnt;
+        for (i = 1; i < chunk_cnt; i++) {
+                memcpy(chunks[0].vertices + offset, chunks[i].vertices,
+                       6 * (size_t)chunks[i].vertex_cnt * sizeof(STLFloat));
+                offset += 6 * (size_t)chunks[i].vertex_cnt;
+        }
+
+        stl->vertices = chunks[0].vertices;
+        stl->vertices_size = 6 * (size_t)chunks[0].capacity * sizeof(STLFloat);
+        chunks[0].vertices = NULL;
+
+done:
+        for (i = 0; i < chunk_cnt; i++) {
+                stl_mem_release(&stl->allocator, chunks[i].vertices);
+        }
+
+        stl_phase_end(stl, "parse", &stl->counters.parse_time, start);
+        stl_unmap_file(stl);
 
         return ret;
 }
 
+static void
+stl_fill_vertex_normals(stl_t *stl)
+{
+        stl_normals_interleaved(stl->vertices, stl->vertex_cnt / 3);
+}
+
+static int
+stl_has_solid_prefix(const STLuint8 *buf, size_t len)
+{
+        size_t prefix_len = strlen(STL_STR_SOLID_START);
+        size_t i = 0;
+
+        while (i < len && (buf[i] == ' ' || buf[i] == '\t' ||
+                           buf[i] == '\r' || buf[i] == '\n')) {
+                i++;
+        }
+
+        return len - i >= prefix_len &&
+               strncasecmp((const char *)buf + i, STL_STR_SOLID_START,
+                           prefix_len) == 0;
+}
+
+static int
+stl_find_str(const STLuint8 *buf, size_t len, const char *str)
+{
+        size_t str_len = strlen(str);
+        size_t i = 0;
+
+        for (i = 0; i + str_len <= len; i++) {
+                if (strncasecmp((const char *)buf + i, str, str_len) == 0) {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Work out the type of an stl file from its first STL_DETECT_WINDOW bytes
+ * and its size. A binary file is recognised by its facet count matching
+ * the file size, an ASCII file by the "solid" keyword followed by text.
+ * The system calls and the bytes read are counted in counters.
+ */
 static stl_file_type_t
-stl_get_filetype(char *filename)
+stl_detect(const char *filename, stl_confidence_t *confidence,
+           stl_stats_t *counters)
 {
 	stl_file_type_t type = STL_FILE_TYPE_INVALID;
+        stl_confidence_t level = STL_CONFIDENCE_NONE;
+        STLuint8 buf[STL_DETECT_WINDOW];
+        struct stat st;
+        ssize_t len = 0;
+        ssize_t i = 0;
+        STLuint32 facet_cnt = 0;
+        int size_match = 0;
+        int size_fits = 0;
+        int solid = 0;
+        int ascii = 1;
+
+	int fd = STL_SYSCALL(counters, open(filename, O_RDONLY));
+      	if (fd == -1) {
+		goto done;
+	}
+
+        if (STL_SYSCALL(counters, fstat(fd, &st)) != 0 ||
+            (len = STL_SYSCALL(counters, read(fd, buf, sizeof(buf)))) <= 0) {
+                STL_SYSCALL(counters, close(fd));
+                goto done;
+        }
+
+	STL_SYSCALL(counters, close(fd));
+        counters->bytes_read += len;
+
+        for (i = 0; i < len; i++) {
+                if (buf[i] > 127) {
+                        ascii = 0;
+                        break;
+                }
+        }
+
+        if (st.st_size >= STL_BIN_FACETS_OFFSET) {
+                memcpy(&facet_cnt, buf + STL_BIN_FACET_CNT_OFFSET,
+                       sizeof(facet_cnt));
+                size_match = STL_BIN_FACETS_OFFSET +
+                             (off_t)facet_cnt * STL_BIN_FACET_SIZE == st.st_size;
+                size_fits = STL_BIN_FACETS_OFFSET +
+                            (off_t)facet_cnt * STL_BIN_FACET_SIZE <= st.st_size;
+        }
+
+        solid = stl_has_solid_prefix(buf, len);
+
+        if (size_match) {
+                type = STL_FILE_TYPE_BIN;
+                level = (solid && ascii) ? STL_CONFIDENCE_MEDIUM :
+                                           STL_CONFIDENCE_HIGH;
+        } else if (solid && ascii) {
+                type = STL_FILE_TYPE_TXT;
+                level = (stl_find_str(buf, len, STL_STR_FACET_START) ||
+                         stl_find_str(buf, len, STL_STR_SOLID_END)) ?
+                        STL_CONFIDENCE_HIGH : STL_CONFIDENCE_MEDIUM;
+        } else if (!ascii && size_fits) {
+                /* Binary file with trailing data after the last facet */
+                type = STL_FILE_TYPE_BIN;
+                level = STL_CONFIDENCE_LOW;
+        } else if (ascii) {
+                type = STL_FILE_TYPE_TXT;
+                level = STL_CONFIDENCE_LOW;
+        } else {
+                /* Most likely a truncated binary file */
+                type = STL_FILE_TYPE_BIN;
+                level = STL_CONFIDENCE_LOW;
+        }
+
+done:
+        if (confidence) {
+                *confidence = level;
+        }
+
+	return type;
+}
+
+stl_file_type_t
+stl_filetype(char *filename, stl_confidence_t *confidence)
+{
+        stl_stats_t counters;
+
+        memset(&counters, 0, sizeof(counters));
+        return stl_detect(filename, confidence, &counters);
+}
+
+typedef struct {
+	STLFloat32 x;
+	STLFloat32 y;
+	STLFloat32 z;
+} stl_vector_t;
+
+/* A range of facets of a binary stl file decoded by one thread */
+typedef struct {
+        stl_t *stl;
+        STLuint first;
+        STLuint cnt;
+        stl_bounds_t bounds;
+} stl_bin_chunk_t;
+
+/*
+ * Decode a range of facets into the vertex buffer. The bounds and the
+ * face normals are computed in the same pass while the facet is hot.
+ */
+static void *
+stl_decode_bin_chunk(void *arg)
+{
+        stl_bin_chunk_t *chunk = (stl_bin_chunk_t *)arg;
+        stl_t *stl = chunk->stl;
+        STLuint triangle_idx = 0;
+        STLuint block_cnt = 0;
+        int idx = 0;
+        double start = stl_trace_file ? stl_clock() : 0;
+
+        stl_bounds_init(&chunk->bounds);
+
+	for (triangle_idx = chunk->first;
+             triangle_idx < chunk->first + chunk->cnt; triangle_idx++) {
+
+                /* Skip the normal vector, the normals are recalculated */
+                const STLuint8 *facet = stl_bin_facet(stl, triangle_idx) +
+                                        sizeof(stl_vector_t);
+                STLFloat *vertices = &stl->vertices[18 * (size_t)triangle_idx];
+
+		for (idx = 0; idx < STL_TRIANGLE_VERTEX_CNT; idx++) {
+                        memcpy(&vertices[6 * idx], facet + idx * sizeof(stl_vector_t),
+                               sizeof(stl_vector_t));
+                        stl_bounds_update(&chunk->bounds, &vertices[6 * idx]);
+		}
+
+                /* Compute the normals of each block while it is still cached */
+                block_cnt++;
+                if (block_cnt == STL_NORMALS_BLOCK ||
+                    triangle_idx + 1 == chunk->first + chunk->cnt) {
+                        stl_normals_interleaved(
+                                &stl->vertices[18 * (size_t)(triangle_idx + 1 - block_cnt)],
+                                block_cnt);
+                        block_cnt = 0;
+                }
+	}
+
+        if (stl_trace_file) {
+                stl_trace_event("decode range", stl->file, start, stl_clock());
+        }
+
+        return NULL;
+}
+
+static stl_error_t
+stl_load_bin_file(stl_t *stl)
+{
+	stl_error_t err = STL_ERR_NONE;
+        stl_bin_chunk_t chunks[STL_MAX_THREADS];
+        STLuint facets_per_chunk = 0;
+        int chunk_cnt = 0;
+        int i = 0;
+        double start = 0;
+
+        if ((err = stl_map_bin_file(stl)) != STL_ERR_NONE) {
+                return err;
+        }
+
+        start = stl_clock();
+
+	size_t expected_vertex_cnt = (size_t)stl->facet_cnt * 3;
+        size_t size = expected_vertex_cnt * 6 * sizeof(STLFloat);
+
+        /* Only replace the buffer kept by stl_reset if it is too small */
+        if (size > stl->vertices_size) {
+                stl_mem_release(&stl->allocator, stl->vertices);
+                stl->vertices = (STLFloat *)stl_mem_alloc(&stl->allocator, size);
+                stl->vertices_size = stl->vertices ? size : 0;
+        }
+
+	/* A file without facets is valid and needs no buffer */
+	if (stl->vertices == NULL && size > 0) {
+		err = STL_ERR_MEM;
+		goto done;
+	}
+
+        chunk_cnt = stl_thread_cnt(stl, (size_t)stl->facet_cnt * STL_BIN_FACET_SIZE);
+        stl->counters.thread_cnt = chunk_cnt;
+        facets_per_chunk = (stl->facet_cnt + chunk_cnt - 1) / chunk_cnt;
+
+        for (i = 0; i < chunk_cnt; i++) {
+                chunks[i].stl = stl;
+                chunks[i].first = i * facets_per_chunk;
+                chunks[i].cnt = (chunks[i].first < stl->facet_cnt) ?
+                        MIN(facets_per_chunk, stl->facet_cnt - chunks[i].first) : 0;
+        }
+
+        stl_parallel(stl_decode_bin_chunk, chunks, sizeof(chunks[0]), chunk_cnt);
+
+        stl_bounds_init(&stl->bounds);
+        for (i = 0; i < chunk_cnt; i++) {
+                stl_bounds_merge(&stl->bounds, &chunks[i].bounds);
+        }
+
+        stl->vertex_cnt = expected_vertex_cnt;
+	stl->loaded = 1;
+done:
+        stl_phase_end(stl, "decode", &stl->counters.parse_time, start);
+        stl_unmap_file(stl);
+ 	return err;
+}
+
+static stl_error_t
+stl_load_txt_file(stl_t *stl)
+{
+        stl_error_t err = STL_ERR_NONE;
+        STLFloat *vertices = NULL;
+        int kept = (stl->vertices != NULL);
+        double start = 0;
+
+        if ((err = stl_parse_txt(stl)) != STL_ERR_NONE) {
+                return err;
+        }
+
+        /*
+         * Give back the slack left over from growing the buffer, a buffer
+         * kept by stl_reset stays as large as it is for the next load.
+         */
+        if (!kept && stl->vertex_cnt > 0) {
+                vertices = (STLFloat *)stl_mem_resize(&stl->allocator, stl->vertices,
+                                6 * (size_t)stl->vertex_cnt * sizeof(STLFloat));
+                if (vertices != NULL) {
+                        stl->vertices = vertices;
+                        stl->vertices_size = 6 * (size_t)stl->vertex_cnt * sizeof(STLFloat);
+                }
+        }
+
+        start = stl_clock();
+        stl_fill_vertex_normals(stl);
+        stl_phase_end(stl, "normals", &stl->counters.normals_time, start);
+
+        stl->loaded = 1;
+
+	return err;
+}
+
+/* Convert a float to an IEEE 754 half, rounding to nearest even */
+static STLuint16
+stl_float_to_half(STLFloat value)
+{
+        STLuint32 bits = 0;
+        STLuint32 sign = 0;
+        STLuint32 mantissa = 0;
+        int exponent = 0;
+        STLuint32 half = 0;
+        STLuint32 round = 0;
+
+        memcpy(&bits, &value, sizeof(bits));
+        sign = (bits >> 16) & 0x8000;
+        exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+        mantissa = bits & 0x7fffff;
+
+        if (((bits >> 23) & 0xff) == 0xff) {
+                /* Infinity and NaN */
+                return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+        }
+
+        if (exponent >= 31) {
+                return sign | 0x7c00;
+        }
+
+        if (exponent <= 0) {
+                /* Subnormal half or zero */
+                if (exponent < -10) {
+                        return sign;
+                }
+
+                mantissa |= 0x800000;
+                round = 14 - exponent;
+                half = mantissa >> round;
+                if ((mantissa >> (round - 1)) & 1 &&
+                    ((mantissa & ((1u << (round - 1)) - 1)) || (half & 1))) {
+                        half++;
+                }
+
+                return sign | half;
+        }
+
+        half = ((STLuint32)exponent << 10) | (mantissa >> 13);
+        if ((mantissa & 0x1000) && ((mantissa & 0xfff) || (half & 1))) {
+                /* May carry into the exponent, up to infinity */
+                half++;
+        }
+
+        return sign | half;
+}
+
+static STLFloat
+stl_half_to_float(STLuint16 half)
+{
+        STLuint32 sign = (STLuint32)(half & 0x8000) << 16;
+        STLuint32 exponent = (half >> 10) & 0x1f;
+        STLuint32 mantissa = half & 0x3ff;
+        STLuint32 bits = 0;
+        STLFloat value;
+
+        if (exponent == 0) {
+                /* Zero or subnormal */
+                value = ldexpf((STLFloat)mantissa, -24);
+                return sign ? -value : value;
+        }
+
+        if (exponent == 31) {
+                bits = sign | 0x7f800000 | (mantissa << 13);
+        } else {
+                bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+        }
+
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+}
+
+static void
+stl_quantize_setup(stl_t *stl)
+{
+        STLFloat min[3] = {stl->bounds.min_x, stl->bounds.min_y, stl->bounds.min_z};
+        STLFloat max[3] = {stl->bounds.max_x, stl->bounds.max_y, stl->bounds.max_z};
+        int i = 0;
+
+        for (i = 0; i < 3; i++) {
+                stl->quant_offset[i] = min[i];
+                stl->quant_scale[i] = (max[i] > min[i]) ?
+                        (max[i] - min[i]) / STL_QUANT_MAX : 0;
+        }
+}
+
+static STLuint16
+stl_quantize(stl_t *stl, int axis, STLFloat value)
+{
+        STLFloat q = 0;
+
+        if (stl->quant_scale[axis] == 0) {
+                return 0;
+        }
+
+        q = (value - stl->quant_offset[axis]) / stl->quant_scale[axis] + 0.5f;
+        if (q < 0) {
+                return 0;
+        }
+
+        return q > STL_QUANT_MAX ? STL_QUANT_MAX : (STLuint16)q;
+}
+
+/* Fetch the position of a vertex whatever the layout it is stored in */
+static void
+stl_get_position(stl_t *stl, size_t idx, STLFloat position[3])
+{
+        size_t n = stl->vertex_cnt;
+        int i = 0;
+
+        switch (stl->layout & STL_LAYOUT_FORMAT_MASK) {
+        case STL_LAYOUT_POSITIONS:
+                memcpy(position, &stl->vertices[3 * idx], 3 * sizeof(STLFloat));
+                break;
+        case STL_LAYOUT_SOA:
+                position[0] = stl->vertices[idx];
+                position[1] = stl->vertices[n + idx];
+                position[2] = stl->vertices[2 * n + idx];
+                break;
+        case STL_LAYOUT_HALF:
+                for (i = 0; i < 3; i++) {
+                        position[i] = stl_half_to_float(stl->positions16[3 * idx + i]);
+                }
+                break;
+        case STL_LAYOUT_QUANTIZED:
+                for (i = 0; i < 3; i++) {
+                        position[i] = stl->quant_offset[i] +
+                                stl->positions16[3 * idx + i] * stl->quant_scale[i];
+                }
+                break;
+        default:
+                memcpy(position, &stl->vertices[6 * idx], 3 * sizeof(STLFloat));
+                break;
+        }
+}
+
+/*
+ * Convert the interleaved vertex buffer built by the loaders into the
+ * layout asked for with stl_set_layout.
+ */
+static stl_error_t
+stl_apply_layout(stl_t *stl)
+{
+        size_t n = stl->vertex_cnt;
+        size_t i = 0;
+        int axis = 0;
+        STLFloat *vertices = stl->vertices;
+        STLFloat *buffer = NULL;
+
+        if (stl->layout & STL_LAYOUT_FACE_NORMALS) {
+                stl->face_normals = (STLFloat *)stl_mem_alloc(&stl->allocator,
+                                3 * (size_t)stl->facet_cnt * sizeof(STLFloat));
+                if (stl->face_normals == NULL) {
+                        return STL_ERR_MEM;
+                }
+
+                for (i = 0; i < stl->facet_cnt; i++) {
+                        memcpy(&stl->face_normals[3 * i], &vertices[18 * i + 3],
+                               3 * sizeof(STLFloat));
+                }
+        }
+
+        switch (stl->layout & STL_LAYOUT_FORMAT_MASK) {
+        case STL_LAYOUT_POSITIONS:
+                /* Compact in place, the destination never overtakes the source */
+                for (i = 0; i < n; i++) {
+                        memmove(&vertices[3 * i], &vertices[6 * i],
+                                3 * sizeof(STLFloat));
+                }
+
+                /* Shrinking to nothing may free the buffer, keep it then */
+                buffer = n == 0 ? NULL :
+                         (STLFloat *)stl_mem_resize(&stl->allocator, vertices,
+                                                    3 * n * sizeof(STLFloat));
+                if (buffer != NULL) {
+                        stl->vertices = buffer;
+                        stl->vertices_size = 3 * n * sizeof(STLFloat);
+                }
+                break;
+
+        case STL_LAYOUT_SOA:
+                buffer = (STLFloat *)stl_mem_alloc(&stl->allocator,
+                                                   3 * n * sizeof(STLFloat));
+                if (buffer == NULL) {
+                        return STL_ERR_MEM;
+                }
+
+                for (i = 0; i < n; i++) {
+                        buffer[i] = vertices[6 * i];
+                        buffer[n + i] = vertices[6 * i + 1];
+                        buffer[2 * n + i] = vertices[6 * i + 2];
+                }
+
+                stl_mem_release(&stl->allocator, vertices);
+                stl->vertices = buffer;
+                stl->vertices_size = 3 * n * sizeof(STLFloat);
+                break;
+
+        case STL_LAYOUT_HALF:
+        case STL_LAYOUT_QUANTIZED:
+                stl->positions16 = (STLuint16 *)stl_mem_alloc(&stl->allocator,
+                                                3 * n * sizeof(STLuint16));
+                if (stl->positions16 == NULL) {
+                        return STL_ERR_MEM;
+                }
+
+                stl_quantize_setup(stl);
+
+                for (i = 0; i < n; i++) {
+                        for (axis = 0; axis < 3; axis++) {
+                                stl->positions16[3 * i + axis] =
+                                        (stl->layout & STL_LAYOUT_FORMAT_MASK) ==
+                                        STL_LAYOUT_HALF ?
+                                        stl_float_to_half(vertices[6 * i + axis]) :
+                                        stl_quantize(stl, axis, vertices[6 * i + axis]);
+                        }
+                }
+
+                stl_mem_release(&stl->allocator, vertices);
+                stl->vertices = NULL;
+                stl->vertices_size = 0;
+                break;
+
+        default:
+                break;
+        }
+
+        return STL_ERR_NONE;
+}
+
+/*
+ * Mesh cache. A cache file holds the welded mesh of an stl file so that
+ * loading it again needs no parsing:
+ *
+ *   header       stl_cache_header_t, 64 bytes
+ *   vertices     3 floats per unique vertex
+ *   indices      3 indices per facet
+ *   normals      3 floats per facet
+ *
+ * Every section starts on a 64 byte boundary. Numbers are stored in the
+ * byte order of the machine that wrote the file, a file from a machine
+ * of the other byte order fails the version check.
+ */
+#define STL_CACHE_MAGIC "STLCACHE"
+#define STL_CACHE_VERSION 1
+#define STL_CACHE_ALIGN 64
+#define STL_CACHE_SUFFIX ".stlc"
+
+#define STL_CACHE_ROUND(x) (((x) + STL_CACHE_ALIGN - 1) & ~(size_t)(STL_CACHE_ALIGN - 1))
+
+typedef struct {
+        char magic[8];
+        STLuint32 version;
+        STLuint32 header_size;
+        unsigned long long source_hash;
+        unsigned long long source_size;
+        STLuint32 facet_cnt;
+        STLuint32 unique_vertex_cnt;
+        stl_bounds_t bounds;
+} stl_cache_header_t;
+
+typedef char stl_cache_header_size_check[sizeof(stl_cache_header_t) ==
+                                         STL_CACHE_ALIGN ? 1 : -1];
+
+#define STL_HASH_PRIME1 0x9e3779b185ebca87ull
+#define STL_HASH_PRIME2 0xc2b2ae3d27d4eb4full
+
+static unsigned long long
+stl_hash_round(unsigned long long acc, unsigned long long word)
+{
+        acc += word * STL_HASH_PRIME2;
+        acc = (acc << 31) | (acc >> 33);
+        return acc * STL_HASH_PRIME1;
+}
+
+/*
+ * 64 bit hash of a buffer. Four independent lanes keep the multiplies
+ * off the critical path so that hashing runs at memory speed, far faster
+ * than parsing the same bytes.
+ */
+static unsigned long long
+stl_hash(const STLuint8 *data, size_t len)
+{
+        unsigned long long lanes[4] = {
+                STL_HASH_PRIME1 + STL_HASH_PRIME2, STL_HASH_PRIME2, 0,
+                -STL_HASH_PRIME1
+        };
+        unsigned long long word = 0;
+        unsigned long long hash = len;
+        size_t i = 0;
+        int lane = 0;
+
+        for (; i + 32 <= len; i += 32) {
+                for (lane = 0; lane < 4; lane++) {
+                        memcpy(&word, data + i + 8 * lane, sizeof(word));
+                        lanes[lane] = stl_hash_round(lanes[lane], word);
+                }
+        }
+
+        for (lane = 0; lane < 4; lane++) {
+                hash = stl_hash_round(hash, lanes[lane]);
+        }
+
+        for (; i < len; i++) {
+                hash = stl_hash_round(hash, data[i]);
+        }
+
+        hash ^= hash >> 33;
+        hash *= STL_HASH_PRIME2;
+        hash ^= hash >> 29;
+
+        return hash;
+}
+
+/*
+ * Hash the contents of stl->file, once per load. The file gets its own
+ * mapping, stl->map may hold the mesh of a mapped load.
+ */
+static stl_error_t
+stl_hash_source(stl_t *stl)
+{
+        stl_error_t err = STL_ERR_NONE;
+        stl_stats_t *counters = &stl->counters;
+        struct stat st;
+        void *map = NULL;
+
+        if (stl->source_hashed) {
+                return STL_ERR_NONE;
+        }
+
+        int fd = STL_SYSCALL(counters, open(stl->file, O_RDONLY));
+        if (fd == -1) {
+                return STL_ERR_FOPEN;
+        }
+
+        if (STL_SYSCALL(counters, fstat(fd, &st)) != 0) {
+                err = STL_ERR_FOPEN;
+                goto done;
+        }
+
+        if (st.st_size == 0) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
+
+        map = STL_SYSCALL(counters, mmap(NULL, st.st_size, PROT_READ,
+                                         MAP_PRIVATE, fd, 0));
+        if (map == MAP_FAILED) {
+                err = STL_ERR_LOAD;
+                goto done;
+        }
+
+        stl->source_hash = stl_hash((STLuint8 *)map, st.st_size);
+        stl->source_size = st.st_size;
+        stl->source_hashed = 1;
+        counters->bytes_read += st.st_size;
+
+        STL_SYSCALL(counters, munmap(map, st.st_size));
+
+done:
+        STL_SYSCALL(counters, close(fd));
+        return err;
+}
+
+/*
+ * The cache file of stl->file is either next to it or, with a cache
+ * directory, named after the hash of its contents.
+ */
+static int
+stl_cache_path(stl_t *stl, char *path, size_t len)
+{
+        if (stl->cache_dir == NULL) {
+                return snprintf(path, len, "%s%s", stl->file,
+                                STL_CACHE_SUFFIX) < (int)len;
+        }
+
+        if (stl_hash_source(stl) != STL_ERR_NONE) {
+                return 0;
+        }
+
+        return snprintf(path, len, "%s/%016llx%s", stl->cache_dir,
+                        stl->source_hash, STL_CACHE_SUFFIX) < (int)len;
+}
+
+static size_t
+stl_cache_size(STLuint32 facet_cnt, STLuint32 unique_vertex_cnt)
+{
+        return STL_CACHE_ALIGN +
+               STL_CACHE_ROUND(3 * (size_t)unique_vertex_cnt * sizeof(STLFloat)) +
+               2 * STL_CACHE_ROUND(3 * (size_t)facet_cnt * sizeof(STLFloat));
+}
+
+/*
+ * Load the mesh from the cache file of stl->file when there is one and
+ * it was made from a file with the same contents. The welded vertices and
+ * indices are used in place from the mapped cache, only the expanded
+ * vertex buffer is built.
+ */
+static stl_error_t
+stl_cache_load(stl_t *stl)
+{
+        stl_error_t err = STL_ERR_NONE;
+        stl_cache_header_t header;
+        char path[PATH_MAX];
+        struct stat st;
+        const STLuint32 *indices = NULL;
+        const STLFloat *unique = NULL;
+        const STLFloat *normals = NULL;
+        STLFloat *vertices = NULL;
+        STLuint8 *map = NULL;
+        size_t map_size = 0;
+        size_t i = 0;
+        size_t vertices_size = 0;
+        int idx = 0;
+        int fd = -1;
+        stl_stats_t *counters = &stl->counters;
+
+        if (!stl_cache_path(stl, path, sizeof(path)) ||
+            (fd = STL_SYSCALL(counters, open(path, O_RDONLY))) == -1) {
+                return STL_ERR_FOPEN;
+        }
+
+        if (STL_SYSCALL(counters, fstat(fd, &st)) != 0 ||
+            (size_t)st.st_size < sizeof(header) ||
+            STL_SYSCALL(counters, read(fd, &header, sizeof(header))) != sizeof(header) ||
+            memcmp(header.magic, STL_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != STL_CACHE_VERSION ||
+            header.header_size != sizeof(header) ||
+            (size_t)st.st_size != stl_cache_size(header.facet_cnt,
+                                                 header.unique_vertex_cnt)) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
+
+        if ((err = stl_hash_source(stl)) != STL_ERR_NONE) {
+                goto done;
+        }
+
+        if (stl->source_hash != header.source_hash ||
+            stl->source_size != header.source_size) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
+
+        map_size = st.st_size;
+        map = (STLuint8 *)STL_SYSCALL(counters, mmap(NULL, map_size, PROT_READ,
+                                                     MAP_PRIVATE, fd, 0));
+        if (map == MAP_FAILED) {
+                map = NULL;
+                err = STL_ERR_LOAD;
+                goto done;
+        }
+
+        counters->bytes_read += map_size;
+
+        unique = (const STLFloat *)(map + STL_CACHE_ALIGN);
+        indices = (const STLuint32 *)((const STLuint8 *)unique +
+                STL_CACHE_ROUND(3 * (size_t)header.unique_vertex_cnt * sizeof(STLFloat)));
+        normals = (const STLFloat *)((const STLuint8 *)indices +
+                STL_CACHE_ROUND(3 * (size_t)header.facet_cnt * sizeof(STLuint32)));
+
+        vertices_size = 18 * (size_t)header.facet_cnt * sizeof(STLFloat);
+        if (vertices_size > stl->vertices_size) {
+                vertices = (STLFloat *)stl_mem_alloc(&stl->allocator, vertices_size);
+                if (vertices == NULL) {
+                        err = STL_ERR_MEM;
+                        goto done;
+                }
+        } else {
+                vertices = stl->vertices;
+                vertices_size = stl->vertices_size;
+        }
+
+        for (i = 0; i < header.facet_cnt; i++) {
+                for (idx = 0; idx < STL_TRIANGLE_VERTEX_CNT; idx++) {
+                        STLuint32 index = indices[3 * i + idx];
+
+                        if (index >= header.unique_vertex_cnt) {
+                                err = STL_ERR_FILE_FORMAT;
+                                goto done;
+                        }
+
+                        memcpy(&vertices[18 * i + 6 * idx], &unique[3 * (size_t)index],
+                               3 * sizeof(STLFloat));
+                        memcpy(&vertices[18 * i + 6 * idx + 3], &normals[3 * i],
+                               3 * sizeof(STLFloat));
+                }
+        }
+
+        if (vertices != stl->vertices) {
+                stl_mem_release(&stl->allocator, stl->vertices);
+        }
+
+        stl_release_indexed(stl);
+
+        stl->vertices = vertices;
+        stl->vertices_size = vertices_size;
+        stl->unique_vertices = (STLFloat *)unique;
+        stl->unique_vertex_cnt = header.unique_vertex_cnt;
+        stl->weld_epsilon = 0;
+        stl->indices = (STLuint32 *)indices;
+        stl->cache_map = map;
+        stl->cache_map_size = map_size;
+        stl->facet_cnt = header.facet_cnt;
+        stl->vertex_cnt = header.facet_cnt * STL_TRIANGLE_VERTEX_CNT;
+        stl->bounds = header.bounds;
+        stl->cache_hit = 1;
+        stl->loaded = 1;
+
+        /* Mark the entry as recently used for the eviction of the directory */
+        if (stl->cache_dir) {
+                STL_SYSCALL(counters, futimens(fd, NULL));
+        }
+
+        vertices = NULL;
+        map = NULL;
+
+done:
+        if (vertices != stl->vertices) {
+                stl_mem_release(&stl->allocator, vertices);
+        }
+
+        if (map) {
+                STL_SYSCALL(counters, munmap(map, map_size));
+        }
+
+        STL_SYSCALL(counters, close(fd));
+
+        return err;
+}
+
+static int
+stl_write_all(stl_t *stl, int fd, const void *buf, size_t len)
+{
+        const char *str = (const char *)buf;
+        ssize_t bytes = 0;
+
+        for (; len > 0; len -= bytes, str += bytes) {
+                if ((bytes = STL_SYSCALL(&stl->counters, write(fd, str, len))) <= 0) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/* Pad a section of len bytes with zeros up to the next section */
+static int
+stl_write_padding(stl_t *stl, int fd, size_t len)
+{
+        static const char zeros[STL_CACHE_ALIGN];
+
+        return stl_write_all(stl, fd, zeros, STL_CACHE_ROUND(len) - len);
+}
+
+static int
+stl_write_section(stl_t *stl, int fd, const void *data, size_t len)
+{
+        if (stl_write_all(stl, fd, data, len) != 0) {
+                return -1;
+        }
+
+        return stl_write_padding(stl, fd, len);
+}
+
+/* Temporary files older than this are left over from a crashed writer */
+#define STL_CACHE_STALE_TIME 3600
+
+typedef struct {
+        char name[NAME_MAX + 1];
+        time_t mtime;
+        off_t size;
+} stl_cache_entry_t;
+
+static int
+stl_cache_entry_cmp(const void *a, const void *b)
+{
+        const stl_cache_entry_t *x = (const stl_cache_entry_t *)a;
+        const stl_cache_entry_t *y = (const stl_cache_entry_t *)b;
+
+        return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/*
+ * Remove the least recently used entries of the cache directory until it
+ * holds at most cache_max_size bytes, never the entry just written (keep).
+ * Loads touch the entries they use, so modification times order the
+ * entries by last use. An entry removed while another process has it
+ * mapped stays readable by that process.
+ */
+static void
+stl_cache_evict(stl_t *stl, const char *keep)
+{
+        stl_cache_entry_t *entries = NULL;
+        stl_cache_entry_t *grown = NULL;
+        size_t entry_cnt = 0;
+        size_t capacity = 0;
+        size_t total = 0;
+        size_t i = 0;
+        size_t len = 0;
+        struct dirent *dirent = NULL;
+        struct stat st;
+        char path[PATH_MAX];
+        DIR *dir = NULL;
+
+        if ((dir = opendir(stl->cache_dir)) == NULL) {
+                return;
+        }
+
+        while ((dirent = readdir(dir)) != NULL) {
+                len = strlen(dirent->d_name);
+
+                if (snprintf(path, sizeof(path), "%s/%s", stl->cache_dir,
+                             dirent->d_name) >= (int)sizeof(path) ||
+                    stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+                        continue;
+                }
+
+                if (strstr(dirent->d_name, STL_CACHE_SUFFIX ".") != NULL) {
+                        if (st.st_mtime + STL_CACHE_STALE_TIME < time(NULL)) {
+                                unlink(path);
+                        }
+                        continue;
+                }
+
+                if (len <= strlen(STL_CACHE_SUFFIX) ||
+                    strcmp(dirent->d_name + len - strlen(STL_CACHE_SUFFIX),
+                           STL_CACHE_SUFFIX) != 0) {
+                        continue;
+                }
+
+                total += st.st_size;
+
+                if (strcmp(dirent->d_name, keep) == 0) {
+                        continue;
+                }
+
+                if (entry_cnt == capacity) {
+                        capacity = capacity ? 2 * capacity : 64;
+                        grown = (stl_cache_entry_t *)stl_mem_resize(&stl->allocator,
+                                        entries, capacity * sizeof(*entries));
+                        if (grown == NULL) {
+                                goto done;
+                        }
+                        entries = grown;
+                }
+
+                memcpy(entries[entry_cnt].name, dirent->d_name, len + 1);
+                entries[entry_cnt].mtime = st.st_mtime;
+                entries[entry_cnt].size = st.st_size;
+                entry_cnt++;
+        }
+
+        if (entry_cnt > 1) {
+                qsort(entries, entry_cnt, sizeof(*entries), stl_cache_entry_cmp);
+        }
+
+        for (i = 0; i < entry_cnt && total > stl->cache_max_size; i++) {
+                snprintf(path, sizeof(path), "%s/%s", stl->cache_dir,
+                         entries[i].name);
+                if (unlink(path) == 0) {
+                        total -= entries[i].size;
+                }
+        }
+
+done:
+        stl_mem_release(&stl->allocator, entries);
+        closedir(dir);
+}
+
+/*
+ * Cache files are written under a temporary name and renamed into place,
+ * so that a concurrent load never sees a partial file.
+ */
+static int
+stl_cache_create(stl_t *stl, const char *path, char *tmp_path, size_t len)
+{
+        int fd = -1;
+
+        /* A name of its own, any thread of any process may write the same entry */
+        if (snprintf(tmp_path, len, "%s.XXXXXX", path) >= (int)len) {
+                return -1;
+        }
+
+        fd = STL_SYSCALL(&stl->counters, mkstemp(tmp_path));
+        if (fd != -1) {
+                fchmod(fd, 0644);
+        }
+
+        return fd;
+}
+
+/* Move a cache file written without error into place, drop it otherwise */
+static stl_error_t
+stl_cache_commit(stl_t *stl, int fd, const char *tmp_path, const char *path,
+                 stl_error_t err)
+{
+        if (STL_SYSCALL(&stl->counters, close(fd)) != 0 && err == STL_ERR_NONE) {
+                err = STL_ERR_LOAD;
+        }
+
+        if (err == STL_ERR_NONE &&
+            STL_SYSCALL(&stl->counters, rename(tmp_path, path)) != 0) {
+                err = STL_ERR_FOPEN;
+        }
+
+        if (err != STL_ERR_NONE) {
+                STL_SYSCALL(&stl->counters, unlink(tmp_path));
+        }
+
+        if (err == STL_ERR_NONE && stl->cache_dir && stl->cache_max_size) {
+                stl_cache_evict(stl, path + strlen(stl->cache_dir) + 1);
+        }
+
+        return err;
+}
+
+/*
+ * Write the cache file of a freshly loaded, still interleaved mesh. The
+ * file only appears once it is complete.
+ */
+static stl_error_t
+stl_cache_store(stl_t *stl)
+{
+        stl_error_t err = STL_ERR_NONE;
+        stl_cache_header_t header;
+        char path[PATH_MAX];
+        char tmp_path[PATH_MAX];
+        STLFloat normals[3 * STL_NORMALS_BLOCK];
+        size_t len = 0;
+        STLuint i = 0;
+        STLuint cnt = 0;
+        int fd = -1;
+
+        if (!stl_cache_path(stl, path, sizeof(path))) {
+                return STL_ERR_FOPEN;
+        }
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, STL_CACHE_MAGIC, sizeof(header.magic));
+        header.version = STL_CACHE_VERSION;
+        header.header_size = sizeof(header);
+        header.facet_cnt = stl->facet_cnt;
+        header.bounds = stl->bounds;
+
+        if ((err = stl_hash_source(stl)) != STL_ERR_NONE) {
+                return err;
+        }
+
+        header.source_hash = stl->source_hash;
+        header.source_size = stl->source_size;
+
+        if (stl->indices == NULL && (err = stl_weld(stl, 0)) != STL_ERR_NONE) {
+                return err;
+        }
+
+        header.unique_vertex_cnt = stl->unique_vertex_cnt;
+
+        if ((fd = stl_cache_create(stl, path, tmp_path, sizeof(tmp_path))) == -1) {
+                return STL_ERR_FOPEN;
+        }
+
+        if (stl_write_all(stl, fd, &header, sizeof(header)) != 0 ||
+            stl_write_section(stl, fd, stl->unique_vertices,
+                              3 * (size_t)stl->unique_vertex_cnt * sizeof(STLFloat)) != 0 ||
+            stl_write_section(stl, fd, stl->indices,
+                              3 * (size_t)stl->facet_cnt * sizeof(STLuint32)) != 0) {
+                err = STL_ERR_LOAD;
+                goto done;
+        }
+
+        for (i = 0; i < stl->facet_cnt; i += cnt) {
+                cnt = MIN(stl->facet_cnt - i, STL_NORMALS_BLOCK);
+                for (len = 0; len < cnt; len++) {
+                        memcpy(&normals[3 * len], &stl->vertices[18 * ((size_t)i + len) + 3],
+                               3 * sizeof(STLFloat));
+                }
+
+                if (stl_write_all(stl, fd, normals, 3 * cnt * sizeof(STLFloat)) != 0) {
+                        err = STL_ERR_LOAD;
+                        goto done;
+                }
+        }
+
+        if (stl_write_padding(stl, fd, 3 * (size_t)stl->facet_cnt * sizeof(STLFloat)) != 0) {
+                err = STL_ERR_LOAD;
+        }
+
+done:
+        return stl_cache_commit(stl, fd, tmp_path, path, err);
+}
+
+/*
+ * The counters only ever grow, the statistics of a load are what they
+ * grew by during it. Until the load ends stl->stats holds the counters
+ * at its start.
+ */
+static double
+stl_stats_begin(stl_t *stl)
+{
+        stl->counters.thread_cnt = 1;
+        stl->stats = stl->counters;
+
+        return stl_clock();
+}
+
+#define STL_STATS_DELTA(stats, counters, field) \
+        ((stats)->field = (counters)->field - (stats)->field)
+
+static void
+stl_stats_end(stl_t *stl, double start)
+{
+        stl_stats_t *stats = &stl->stats;
+        const stl_stats_t *counters = &stl->counters;
+        struct rusage usage;
+        double end = stl_clock();
+
+        STL_STATS_DELTA(stats, counters, detect_time);
+        STL_STATS_DELTA(stats, counters, cache_read_time);
+        STL_STATS_DELTA(stats, counters, map_time);
+        STL_STATS_DELTA(stats, counters, parse_time);
+        STL_STATS_DELTA(stats, counters, normals_time);
+        STL_STATS_DELTA(stats, counters, layout_time);
+        STL_STATS_DELTA(stats, counters, cache_write_time);
+        STL_STATS_DELTA(stats, counters, bytes_read);
+        STL_STATS_DELTA(stats, counters, syscall_cnt);
+        STL_STATS_DELTA(stats, counters, alloc_cnt);
+        STL_STATS_DELTA(stats, counters, alloc_bytes);
+        stats->total_time = end - start;
+        stats->thread_cnt = counters->thread_cnt;
+        stats->peak_rss = 0;
+
+        /* ru_maxrss is in kilobytes except on Darwin */
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef _Darwin_
+                stats->peak_rss = usage.ru_maxrss;
+#else
+                stats->peak_rss = (size_t)usage.ru_maxrss * 1024;
+#endif
+        }
+
+        if (stl_trace_file) {
+                stl_trace_event("load", stl->file, start, end);
+        }
+}
+
+/* The cache is written from the interleaved buffer, failing to write it is harmless */
+static void
+stl_cache_write(stl_t *stl)
+{
+        int layout = stl->layout;
+        double start = 0;
+
+        if (stl->cache_mode & STL_CACHE_WRITE) {
+                start = stl_clock();
+                stl->layout = STL_LAYOUT_INTERLEAVED;
+                stl_cache_store(stl);
+                stl->layout = layout;
+                stl_phase_end(stl, "cache write", &stl->counters.cache_write_time, start);
+        }
+}
+
+/* Parse the stl file itself, and cache the result when asked to */
+static stl_error_t
+stl_load_source(stl_t *stl, stl_file_type_t type)
+{
+        stl_error_t err = STL_ERR_NONE;
+
+	switch (type) {
+	case STL_FILE_TYPE_TXT:
+		err = stl_load_txt_file(stl);
+		break;
+	case STL_FILE_TYPE_BIN:
+		err = stl_load_bin_file(stl);
+		break;
+	default:
+		err = STL_ERR_FILE_FORMAT;
+	}
+
+        if (err == STL_ERR_NONE) {
+                stl_cache_write(stl);
+        }
+
+        return err;
+}
+
+stl_error_t
+stl_load(stl_t *stl, char *filename)
+{
+        stl_error_t err = STL_ERR_NONE;
+	stl_file_type_t type = STL_FILE_TYPE_INVALID;
+        double start = 0;
+        double phase = 0;
+
+        /* Nothing built from a previous file may stay with the new one */
+        stl_reset(stl);
+        start = stl_stats_begin(stl);
+        stl->file = filename;
+
+        phase = stl_clock();
+	type = stl_detect(filename, NULL, &stl->counters);
+        stl->type = type;
+        stl_phase_end(stl, "detect", &stl->counters.detect_time, phase);
+
+        if (type != STL_FILE_TYPE_INVALID && (stl->cache_mode & STL_CACHE_READ)) {
+                phase = stl_clock();
+                stl_cache_load(stl);
+                stl_phase_end(stl, "cache read", &stl->counters.cache_read_time, phase);
+        }
+
+        if (stl->cache_hit) {
+                err = STL_ERR_NONE;
+        } else if (stl->cache_mode & STL_CACHE_ONLY) {
+                err = STL_ERR_NOT_LOADED;
+        } else {
+                err = stl_load_source(stl, type);
+        }
+
+        if (err == STL_ERR_NONE) {
+                phase = stl_clock();
+                err = stl_apply_layout(stl);
+                stl_phase_end(stl, "layout", &stl->counters.layout_time, phase);
+        }
+
+        stl_stats_end(stl, start);
+        return err;
+}
+
+stl_error_t
+stl_load_facets(stl_t *stl, char *filename, const STLFloat *vertices,
+                STLuint facet_cnt)
+{
+        stl_error_t err = STL_ERR_NONE;
+        size_t size = 18 * (size_t)facet_cnt * sizeof(STLFloat);
+        STLuint i = 0;
+        double start = 0;
+        double phase = 0;
+
+        stl_reset(stl);
+        start = stl_stats_begin(stl);
+        stl->file = filename;
+
+        phase = stl_clock();
+        stl->type = stl_detect(filename, NULL, &stl->counters);
+        stl_phase_end(stl, "detect", &stl->counters.detect_time, phase);
+
+        /* Only replace the buffer kept by stl_reset if it is too small */
+        if (size > stl->vertices_size) {
+                stl_mem_release(&stl->allocator, stl->vertices);
+                stl->vertices = (STLFloat *)stl_mem_alloc(&stl->allocator, size);
+                stl->vertices_size = stl->vertices ? size : 0;
+        }
+
+        if (stl->vertices == NULL && size > 0) {
+                err = STL_ERR_MEM;
+                goto done;
+        }
+
+        phase = stl_clock();
+        memcpy(stl->vertices, vertices, size);
+        stl_bounds_init(&stl->bounds);
+
+        for (i = 0; i < facet_cnt * STL_TRIANGLE_VERTEX_CNT; i++) {
+                stl_bounds_update(&stl->bounds, &stl->vertices[6 * (size_t)i]);
+        }
+
+        stl->facet_cnt = facet_cnt;
+        stl->vertex_cnt = facet_cnt * STL_TRIANGLE_VERTEX_CNT;
+        stl->loaded = 1;
+        stl_phase_end(stl, "copy", &stl->counters.parse_time, phase);
+
+        stl_cache_write(stl);
+
+        phase = stl_clock();
+        err = stl_apply_layout(stl);
+        stl_phase_end(stl, "layout", &stl->counters.layout_time, phase);
+
+done:
+        stl_stats_end(stl, start);
+        return err;
+}
+
+stl_error_t
+stl_load_mapped(stl_t *stl, char *filename)
+{
+        stl_error_t err = STL_ERR_NONE;
+        STLuint i = 0;
+        int idx = 0;
+        STLFloat vertex[3];
+        double start = 0;
+        double phase = 0;
+
+        stl_reset(stl);
+        start = stl_stats_begin(stl);
+        phase = stl_clock();
+        stl->file = filename;
+
+        if (stl_detect(filename, NULL, &stl->counters) != STL_FILE_TYPE_BIN) {
+                return stl_load(stl, filename);
+        }
+
+        stl_phase_end(stl, "detect", &stl->counters.detect_time, phase);
+
+        if ((err = stl_map_bin_file(stl)) != STL_ERR_NONE) {
+                goto done;
+        }
+
+        phase = stl_clock();
+        stl_bounds_init(&stl->bounds);
+
+        for (i = 0; i < stl->facet_cnt; i++) {
+                const STLuint8 *facet = stl_bin_facet(stl, i) + sizeof(stl_vector_t);
+
+                for (idx = 0; idx < STL_TRIANGLE_VERTEX_CNT; idx++) {
+                        memcpy(vertex, facet + idx * sizeof(stl_vector_t),
+                               sizeof(vertex));
+                        stl_bounds_update(&stl->bounds, vertex);
+                }
+        }
+
+        stl->vertex_cnt = stl->facet_cnt * STL_TRIANGLE_VERTEX_CNT;
+        stl->loaded = 1;
+        stl_phase_end(stl, "bounds", &stl->counters.parse_time, phase);
+
+done:
+        stl_stats_end(stl, start);
+        return err;
+}
+
+/* Read buffer of a stream, also the longest line an ASCII stream accepts */
+#define STL_STREAM_BUFFER_SIZE (256 * 1024)
+
+struct stl_stream_s {
+        char *file;
+        stl_file_type_t type;
+        int fd;
+        STLuint32 facet_cnt;
+        char *buffer;
+        STLFloat *vertices;
+        int lineno;
+};
+
+stl_stream_t *
+stl_stream_open(char *filename, stl_error_t *err)
+{
+        stl_stream_t *stream = NULL;
+        struct stat st;
+        STLuint8 header[STL_BIN_FACETS_OFFSET];
+
+        *err = STL_ERR_NONE;
+
+        stream = (stl_stream_t *)malloc(sizeof(*stream));
+        if (stream == NULL) {
+                *err = STL_ERR_MEM;
+                return NULL;
+        }
+
+        memset(stream, 0, sizeof(*stream));
+        stream->fd = -1;
+        stream->file = filename;
+        stream->type = stl_filetype(filename, NULL);
+        stream->buffer = (char *)malloc(STL_STREAM_BUFFER_SIZE);
+
+        if (stream->buffer == NULL) {
+                *err = STL_ERR_MEM;
+                goto err;
+        }
+
+        if (stream->type == STL_FILE_TYPE_INVALID) {
+                *err = STL_ERR_FILE_FORMAT;
+                goto err;
+        }
+
+        stream->fd = open(filename, O_RDONLY);
+        if (stream->fd == -1) {
+                *err = STL_ERR_FOPEN;
+                goto err;
+        }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        if (stream->type == STL_FILE_TYPE_BIN) {
+                /* Same checks as the loader, before anything is read */
+                if (fstat(stream->fd, &st) != 0 ||
+                    st.st_size < STL_BIN_FACETS_OFFSET ||
+                    read(stream->fd, header, sizeof(header)) != sizeof(header)) {
+                        *err = STL_ERR_FILE_FORMAT;
+                        goto err;
+                }
+
+                memcpy(&stream->facet_cnt, header + STL_BIN_FACET_CNT_OFFSET,
+                       sizeof(stream->facet_cnt));
+
+                if (STL_BIN_FACETS_OFFSET +
+                    (off_t)stream->facet_cnt * STL_BIN_FACET_SIZE > st.st_size) {
+                        *err = STL_ERR_FILE_FORMAT;
+                        goto err;
+                }
+        }
+
+        return stream;
+
+err:
+        stl_stream_close(stream);
+        return NULL;
+}
+
+void
+stl_stream_close(stl_stream_t *stream)
+{
+        if (stream) {
+                if (stream->fd != -1) {
+                        close(stream->fd);
+                }
+
+                free(stream->buffer);
+                free(stream->vertices);
+                free(stream);
+        }
+}
+
+static stl_error_t
+stl_stream_read_bin(stl_stream_t *stream, STLuint batch_size,
+                    stl_stream_cb_t cb, void *arg)
+{
+        STLuint remaining = stream->facet_cnt;
+        STLuint filled = 0;
+        STLuint cnt = 0;
+        STLuint i = 0;
+        size_t len = 0;
+        ssize_t bytes = 0;
+        int idx = 0;
+
+        while (remaining > 0) {
+                cnt = MIN(remaining, MIN(batch_size - filled,
+                          STL_STREAM_BUFFER_SIZE / STL_BIN_FACET_SIZE));
+
+                for (len = 0; len < cnt * STL_BIN_FACET_SIZE; len += bytes) {
+                        bytes = read(stream->fd, stream->buffer + len,
+                                     cnt * STL_BIN_FACET_SIZE - len);
+                        if (bytes <= 0) {
+                                return STL_ERR_FILE_FORMAT;
+                        }
+                }
+
+                for (i = 0; i < cnt; i++) {
+                        /* Skip the normal vector, the normals are recalculated */
+                        const char *facet = stream->buffer + i * STL_BIN_FACET_SIZE +
+                                            sizeof(stl_vector_t);
+                        STLFloat *vertices = &stream->vertices[18 * (size_t)(filled + i)];
+
+                        for (idx = 0; idx < STL_TRIANGLE_VERTEX_CNT; idx++) {
+                                memcpy(&vertices[6 * idx],
+                                       facet + idx * sizeof(stl_vector_t),
+                                       sizeof(stl_vector_t));
+                        }
+                }
+
+                filled += cnt;
+                remaining -= cnt;
+
+                if (filled == batch_size || remaining == 0) {
+                        stl_normals_interleaved(stream->vertices, filled);
+
+                        if (cb(arg, stream->vertices, filled) != 0) {
+                                return STL_ERR_ABORTED;
+                        }
+
+                        filled = 0;
+                }
+        }
+
+        return STL_ERR_NONE;
+}
+
+static stl_error_t
+stl_stream_flush_txt(stl_txt_chunk_t *chunk, stl_stream_cb_t cb, void *arg)
+{
+        STLuint cnt = chunk->vertex_cnt / STL_TRIANGLE_VERTEX_CNT;
+
+        if (cnt == 0) {
+                return STL_ERR_NONE;
+        }
+
+        stl_normals_interleaved(chunk->vertices, cnt);
+        chunk->vertex_cnt = 0;
+
+        return cb(arg, chunk->vertices, cnt) ? STL_ERR_ABORTED : STL_ERR_NONE;
+}
+
+static stl_error_t
+stl_stream_read_txt(stl_stream_t *stream, STLuint batch_size,
+                    stl_stream_cb_t cb, void *arg)
+{
+        stl_txt_chunk_t chunk;
+        stl_error_t err = STL_ERR_NONE;
+        size_t len = 0;
+        ssize_t bytes = 0;
+        const char *str = NULL;
+        const char *end = NULL;
+        const char *eol = NULL;
+        int eof = 0;
+
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.allocator = &stl_default_allocator;
+        chunk.vertices = stream->vertices;
+        chunk.capacity = STL_TRIANGLE_VERTEX_CNT * batch_size;
+        stl_bounds_init(&chunk.bounds);
+
+        while (!eof) {
+                bytes = read(stream->fd, stream->buffer + len,
+                             STL_STREAM_BUFFER_SIZE - len);
+                if (bytes < 0) {
+                        err = STL_ERR_LOAD;
+                        goto done;
+                }
+
+                eof = (bytes == 0);
+                len += bytes;
+                str = stream->buffer;
+                end = stream->buffer + len;
+
+                while (str < end) {
+                        eol = stl_txt_eol(str, end);
+
+                        /* Wait for the rest of the line */
+                        if (eol == end && !eof) {
+                                break;
+                        }
+
+                        stream->lineno++;
+                        if ((err = stl_parse_txt_line(&chunk, str, eol)) != STL_ERR_NONE) {
+                                goto done;
+                        }
+
+                        str = (eol < end) ? eol + 1 : end;
+
+                        if (chunk.state == STL_STATE_FACET_END &&
+                            chunk.vertex_cnt >= STL_TRIANGLE_VERTEX_CNT * batch_size &&
+                            (err = stl_stream_flush_txt(&chunk, cb, arg)) != STL_ERR_NONE) {
+                                goto done;
+                        }
+                }
+
+                if (str == stream->buffer && len == STL_STREAM_BUFFER_SIZE) {
+                        /* A line that does not fit in the buffer */
+                        stream->lineno++;
+                        err = STL_ERR_FILE_FORMAT;
+                        goto done;
+                }
+
+                len = end - str;
+                memmove(stream->buffer, str, len);
+        }
+
+        if (!chunk.solid_end) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
+
+        /* Complete facets only, a file ending in a facet was caught above */
+        err = stl_stream_flush_txt(&chunk, cb, arg);
+
+done:
+        stream->vertices = chunk.vertices;
+        stream->facet_cnt = chunk.facet_cnt;
+
+        return err;
+}
+
+stl_error_t
+stl_stream_read(stl_stream_t *stream, STLuint batch_size,
+                stl_stream_cb_t cb, void *arg)
+{
+        if (batch_size == 0) {
+                return STL_ERR_INVALID;
+        }
+
+        free(stream->vertices);
+        stream->vertices = (STLFloat *)malloc(18 * (size_t)batch_size * sizeof(STLFloat));
+        if (stream->vertices == NULL) {
+                return STL_ERR_MEM;
+        }
+
+        if (stream->type == STL_FILE_TYPE_BIN) {
+                return stl_stream_read_bin(stream, batch_size, cb, arg);
+        }
+
+        return stl_stream_read_txt(stream, batch_size, cb, arg);
+}
+
+STLuint
+stl_stream_facet_cnt(stl_stream_t *stream)
+{
+        return stream->facet_cnt;
+}
+
+stl_file_type_t
+stl_stream_type(stl_stream_t *stream)
+{
+        return stream->type;
+}
+
+int
+stl_stream_lineno(stl_stream_t *stream)
+{
+        return stream->lineno;
+}
+
+const void *
+stl_facet_record(stl_t *stl, STLuint idx)
+{
+        if (stl->map == NULL || idx >= stl->facet_cnt) {
+                return NULL;
+        }
+
+        return stl_bin_facet(stl, idx);
+}
+
+stl_error_t
+stl_facet_vertices(stl_t *stl, STLuint idx, STLFloat vertices[9])
+{
+        int i = 0;
+
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        if (idx >= stl->facet_cnt) {
+                return STL_ERR_INVALID;
+        }
+
+        if (stl->map) {
+                memcpy(vertices, stl_bin_facet(stl, idx) + sizeof(stl_vector_t),
+                       STL_TRIANGLE_VERTEX_CNT * sizeof(stl_vector_t));
+                return STL_ERR_NONE;
+        }
+
+        for (i = 0; i < STL_TRIANGLE_VERTEX_CNT; i++) {
+                stl_get_position(stl, 3 * (size_t)idx + i, &vertices[3 * i]);
+        }
+
+        return STL_ERR_NONE;
+}
+
+stl_error_t
+stl_facet_normal(stl_t *stl, STLuint idx, STLFloat normal[3])
+{
+        STLFloat vertices[9];
+        stl_error_t err = STL_ERR_NONE;
+
+        if (stl->loaded && idx < stl->facet_cnt && stl->map == NULL) {
+                if (stl->face_normals) {
+                        memcpy(normal, &stl->face_normals[3 * (size_t)idx],
+                               sizeof(stl_vector_t));
+                        return STL_ERR_NONE;
+                }
+
+                if ((stl->layout & STL_LAYOUT_FORMAT_MASK) ==
+                    STL_LAYOUT_INTERLEAVED) {
+                        memcpy(normal, &stl->vertices[18 * (size_t)idx + 3],
+                               sizeof(stl_vector_t));
+                        return STL_ERR_NONE;
+                }
+        }
+
+        if ((err = stl_facet_vertices(stl, idx, vertices)) != STL_ERR_NONE) {
+                return err;
+        }
+
+        stl_normal(&vertices[0], &vertices[3], &vertices[6], normal);
+
+        return STL_ERR_NONE;
+}
+
+/* Facets gathered per call to the writer when saving other layouts */
+#define STL_SAVE_BLOCK 256
+
+stl_error_t
+stl_save(stl_t *stl, const char *filename, stl_file_type_t type)
+{
+        stl_writer_t *writer = NULL;
+        stl_error_t err = STL_ERR_NONE;
+        STLFloat block[18 * STL_SAVE_BLOCK];
+        STLFloat vertices[9];
+        STLuint i = 0, j = 0;
+        STLuint cnt = 0;
+        int idx = 0;
+
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        if ((writer = stl_writer_open(filename, type, &err)) == NULL) {
+                return err;
+        }
+
+        /* The interleaved buffer is already laid out the way the writer takes it */
+        if (stl->map == NULL &&
+            (stl->layout & STL_LAYOUT_FORMAT_MASK) == STL_LAYOUT_INTERLEAVED) {
+                stl_writer_write(writer, stl->vertices, stl->facet_cnt);
+                return stl_writer_close(writer);
+        }
+
+        for (i = 0; i < stl->facet_cnt && err == STL_ERR_NONE; i += cnt) {
+                cnt = MIN(stl->facet_cnt - i, STL_SAVE_BLOCK);
+
+                for (j = 0; j < cnt; j++) {
+                        STLFloat *facet = &block[18 * j];
+
+                        stl_facet_vertices(stl, i + j, vertices);
+                        stl_facet_normal(stl, i + j, &facet[3]);
+                        for (idx = 0; idx < STL_TRIANGLE_VERTEX_CNT; idx++) {
+                                memcpy(&facet[6 * idx], &vertices[3 * idx],
+                                       3 * sizeof(STLFloat));
+                        }
+                }
+
+                err = stl_writer_write(writer, block, cnt);
+        }
+
+        return stl_writer_close(writer);
+}
+
+/* Marks a free slot of the welding hash table */
+#define STL_WELD_EMPTY 0xffffffffu
+
+#define STL_WELD_INITIAL_VERTICES 1024
+
+/* Neighbouring floats this many cells of epsilon out are far more than epsilon apart */
+#define STL_WELD_MAX_CELL 1e12
+
+typedef struct {
+        const stl_allocator_t *allocator;
+        STLFloat epsilon;
+        STLuint32 *slots;
+        STLuint32 mask;
+        STLFloat *vertices;
+        STLuint vertex_cnt;
+        STLuint capacity;
+} stl_weld_table_t;
+
+static STLuint32
+stl_weld_mix(STLuint32 a, STLuint32 b, STLuint32 c)
+{
+        STLuint32 h = a * 0x9e3779b1u;
+
+        h = (h ^ (h >> 15)) + b * 0x85ebca77u;
+        h = (h ^ (h >> 13)) + c * 0xc2b2ae3du;
+        h ^= h >> 16;
+
+        return h;
+}
+
+static STLuint32
+stl_weld_float_bits(STLFloat value)
+{
+        STLuint32 bits = 0;
+
+        /* -0.0 and 0.0 are the same position */
+        if (value == 0.0f) {
+                return 0;
+        }
+
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+}
+
+/*
+ * Find the grid cell of a vertex. Returns 0 when a coordinate is not
+ * finite or lies so many cells out that the floats around it are further
+ * apart than epsilon. Such a vertex only welds to identical ones and is
+ * hashed by its bits.
+ */
+static int
+stl_weld_cell(const stl_weld_table_t *table, const STLFloat *v, long long cell[3])
+{
+        double q = 0;
+        int i = 0;
+
+        for (i = 0; i < 3; i++) {
+                q = floor(v[i] / table->epsilon);
+                if (!(fabs(q) < STL_WELD_MAX_CELL)) {
+                        return 0;
+                }
+                cell[i] = (long long)q;
+        }
+
+        return 1;
+}
+
+static STLuint32
+stl_weld_hash(const stl_weld_table_t *table, const STLFloat *v)
+{
+        long long cell[3];
+
+        if (table->epsilon == 0.0f || !stl_weld_cell(table, v, cell)) {
+                return stl_weld_mix(stl_weld_float_bits(v[0]),
+                                    stl_weld_float_bits(v[1]),
+                                    stl_weld_float_bits(v[2]));
+        }
+
+        return stl_weld_mix((STLuint32)cell[0], (STLuint32)cell[1],
+                            (STLuint32)cell[2]);
+}
+
+static void
+stl_weld_insert(stl_weld_table_t *table, STLuint32 hash, STLuint32 index)
+{
+        STLuint32 slot = hash & table->mask;
+
+        while (table->slots[slot] != STL_WELD_EMPTY) {
+                slot = (slot + 1) & table->mask;
+        }
+
+        table->slots[slot] = index;
+}
+
+/* Double the number of slots once the table is half full */
+static stl_error_t
+stl_weld_grow(stl_weld_table_t *table)
+{
+        STLuint32 *old_slots = table->slots;
+        STLuint32 old_size = table->mask + 1;
+        STLuint32 size = old_size;
+        STLuint32 i = 0;
+
+        if (old_slots && table->vertex_cnt < old_size / 2) {
+                return STL_ERR_NONE;
+        }
+
+        if (old_slots) {
+                size = old_size * 2;
+        }
+
+        table->slots = (STLuint32 *)stl_mem_alloc(table->allocator,
+                                                  size * sizeof(STLuint32));
+        if (table->slots == NULL) {
+                table->slots = old_slots;
+                return STL_ERR_MEM;
+        }
+
+        memset(table->slots, 0xff, size * sizeof(STLuint32));
+        table->mask = size - 1;
+
+        if (old_slots) {
+                for (i = 0; i < table->vertex_cnt; i++) {
+                        stl_weld_insert(table,
+                                stl_weld_hash(table, &table->vertices[3 * i]), i);
+                }
+                stl_mem_release(table->allocator, old_slots);
+        }
+
+        return STL_ERR_NONE;
+}
+
+static int
+stl_weld_match(const stl_weld_table_t *table, STLuint32 index, const STLFloat *v)
+{
+        const STLFloat *u = &table->vertices[3 * index];
+
+        /* Identical also covers infinite coordinates, whose difference is NaN */
+        if (u[0] == v[0] && u[1] == v[1] && u[2] == v[2]) {
+                return 1;
+        }
+
+        return table->epsilon != 0.0f &&
+               fabsf(u[0] - v[0]) <= table->epsilon &&
+               fabsf(u[1] - v[1]) <= table->epsilon &&
+               fabsf(u[2] - v[2]) <= table->epsilon;
+}
+
+static STLuint32
+stl_weld_find_hash(const stl_weld_table_t *table, STLuint32 hash, const STLFloat *v)
+{
+        STLuint32 slot = hash & table->mask;
+
+        for (; table->slots[slot] != STL_WELD_EMPTY; slot = (slot + 1) & table->mask) {
+                if (stl_weld_match(table, table->slots[slot], v)) {
+                        return table->slots[slot];
+                }
+        }
+
+        return STL_WELD_EMPTY;
+}
+
+/*
+ * Look up a vertex. With an epsilon the vertex may have been welded to a
+ * vertex in any of the neighbouring cells.
+ */
+static STLuint32
+stl_weld_find(const stl_weld_table_t *table, const STLFloat *v)
+{
+        long long cell[3];
+        STLuint32 index = STL_WELD_EMPTY;
+        int dx, dy, dz;
+
+        if (table->epsilon == 0.0f || !stl_weld_cell(table, v, cell)) {
+                return stl_weld_find_hash(table, stl_weld_hash(table, v), v);
+        }
+
+        for (dx = -1; dx <= 1; dx++) {
+                for (dy = -1; dy <= 1; dy++) {
+                        for (dz = -1; dz <= 1; dz++) {
+                                index = stl_weld_find_hash(table,
+                                        stl_weld_mix((STLuint32)(cell[0] + dx),
+                                                     (STLuint32)(cell[1] + dy),
+                                                     (STLuint32)(cell[2] + dz)), v);
+                                if (index != STL_WELD_EMPTY) {
+                                        return index;
+                                }
+                        }
+                }
+        }
+
+        return STL_WELD_EMPTY;
+}
+
+static stl_error_t
+stl_weld_add(stl_weld_table_t *table, const STLFloat *v, STLuint32 *index)
+{
+        STLFloat *vertices = NULL;
+        stl_error_t err = STL_ERR_NONE;
+
+        if ((*index = stl_weld_find(table, v)) != STL_WELD_EMPTY) {
+                return STL_ERR_NONE;
+        }
+
+        if (table->vertex_cnt == table->capacity) {
+                table->capacity = table->capacity ? table->capacity * 2 :
+                                                    STL_WELD_INITIAL_VERTICES;
+                vertices = (STLFloat *)stl_mem_resize(table->allocator, table->vertices,
+                                3 * (size_t)table->capacity * sizeof(STLFloat));
+                if (vertices == NULL) {
+                        return STL_ERR_MEM;
+                }
+                table->vertices = vertices;
+        }
+
+        memcpy(&table->vertices[3 * (size_t)table->vertex_cnt], v,
+               3 * sizeof(STLFloat));
+        *index = table->vertex_cnt++;
+
+        if ((err = stl_weld_grow(table)) != STL_ERR_NONE) {
+                return err;
+        }
+
+        stl_weld_insert(table, stl_weld_hash(table, v), *index);
+
+        return STL_ERR_NONE;
+}
+
+stl_error_t
+stl_weld(stl_t *stl, STLFloat epsilon)
+{
+        stl_weld_table_t table;
+        stl_error_t err = STL_ERR_NONE;
+        STLFloat vertices[9];
+        STLuint32 *indices = NULL;
+        STLFloat *unique = NULL;
+        STLuint i = 0;
+        int idx = 0;
+
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        if (epsilon < 0) {
+                return STL_ERR_INVALID;
+        }
+
+        memset(&table, 0, sizeof(table));
+        table.allocator = &stl->allocator;
+        table.epsilon = epsilon;
+
+        /* Closed meshes have about half as many vertices as facets */
+        table.mask = STL_WELD_INITIAL_VERTICES - 1;
+        while (table.mask + 1 < stl->facet_cnt && table.mask < 0x7fffffffu) {
+                table.mask = table.mask * 2 + 1;
+        }
+
+        table.slots = (STLuint32 *)stl_mem_alloc(&stl->allocator,
+                                        (table.mask + 1) * sizeof(STLuint32));
+        indices = (STLuint32 *)stl_mem_alloc(&stl->allocator,
+                                        3 * (size_t)stl->facet_cnt * sizeof(STLuint32));
+        if (table.slots == NULL || indices == NULL) {
+                err = STL_ERR_MEM;
+                goto done;
+        }
+
+        memset(table.slots, 0xff, (table.mask + 1) * sizeof(STLuint32));
+
+        for (i = 0; i < stl->facet_cnt; i++) {
+                stl_facet_vertices(stl, i, vertices);
+
+                for (idx = 0; idx < STL_TRIANGLE_VERTEX_CNT; idx++) {
+                        err = stl_weld_add(&table, &vertices[3 * idx],
+                                           &indices[3 * (size_t)i + idx]);
+                        if (err != STL_ERR_NONE) {
+                                goto done;
+                        }
+                }
+        }
+
+        /* Give back the slack left over from growing the buffer */
+        unique = (STLFloat *)stl_mem_resize(&stl->allocator, table.vertices,
+                        3 * (size_t)table.vertex_cnt * sizeof(STLFloat));
+        if (unique != NULL) {
+                table.vertices = unique;
+        }
+
+        stl_release_indexed(stl);
+        stl->unique_vertices = table.vertices;
+        stl->unique_vertex_cnt = table.vertex_cnt;
+        stl->weld_epsilon = epsilon;
+        stl->indices = indices;
+        table.vertices = NULL;
+        indices = NULL;
+
+done:
+        stl_mem_release(&stl->allocator, table.slots);
+        stl_mem_release(&stl->allocator, table.vertices);
+        stl_mem_release(&stl->allocator, indices);
+
+        return err;
+}
+
+STLuint
+stl_unique_vertex_cnt(stl_t *stl)
+{
+        return stl->unique_vertex_cnt;
+}
+
+stl_error_t
+stl_unique_vertices(stl_t *stl, STLFloat **points)
+{
+        if (stl->indices == NULL) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        *points = stl->unique_vertices;
+
+        return STL_ERR_NONE;
+}
+
+stl_error_t
+stl_indices(stl_t *stl, STLuint32 **indices)
+{
+        if (stl->indices == NULL) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        *indices = stl->indices;
+
+        return STL_ERR_NONE;
+}
+
+/*
+ * Cache file of the levels of detail, next to the cache file of the mesh:
+ *
+ *   header       stl_lod_cache_header_t, 64 bytes
+ *   levels       ratio and facet count of every level
+ *   indices      3 indices per facet, one section per level
+ *
+ * The indices refer to the vertices of the mesh welded with weld_epsilon.
+ */
+#define STL_LOD_CACHE_MAGIC "STLLODS\0"
+#define STL_LOD_CACHE_VERSION 1
+#define STL_LOD_CACHE_SUFFIX ".lod"
+
+typedef struct {
+        char magic[8];
+        STLuint32 version;
+        STLuint32 header_size;
+        unsigned long long source_hash;
+        unsigned long long source_size;
+        STLuint32 unique_vertex_cnt;
+        STLuint32 level_cnt;
+        STLFloat weld_epsilon;
+        STLuint32 reserved[5];
+} stl_lod_cache_header_t;
+
+typedef struct {
+        STLFloat ratio;
+        STLuint32 facet_cnt;
+} stl_lod_cache_level_t;
+
+typedef char stl_lod_cache_header_size_check[sizeof(stl_lod_cache_header_t) ==
+                                             STL_CACHE_ALIGN ? 1 : -1];
+
+static int
+stl_lod_cache_path(stl_t *stl, char *path, size_t len)
+{
+        size_t suffix_len = strlen(STL_CACHE_SUFFIX);
+        size_t path_len = 0;
+
+        if (!stl_cache_path(stl, path, len)) {
+                return 0;
+        }
+
+        /* X.stlc becomes X.lod.stlc, so that eviction sees it as an entry */
+        path_len = strlen(path) - suffix_len;
+        return snprintf(path + path_len, len - path_len, "%s%s",
+                        STL_LOD_CACHE_SUFFIX, STL_CACHE_SUFFIX) < (int)(len - path_len);
+}
+
+static stl_error_t
+stl_lod_cache_load(stl_t *stl, const STLFloat *ratios, int level_cnt)
+{
+        stl_error_t err = STL_ERR_NONE;
+        stl_lod_cache_header_t header;
+        stl_lod_cache_level_t entries[STL_MAX_LODS];
+        stl_lod_level_t *levels = NULL;
+        char path[PATH_MAX];
+        struct stat st;
+        size_t size = 0;
+        size_t len = 0;
+        size_t i = 0;
+        int level = 0;
+        int fd = -1;
+
+        if (!stl_lod_cache_path(stl, path, sizeof(path)) ||
+            (fd = open(path, O_RDONLY)) == -1) {
+                return STL_ERR_FOPEN;
+        }
+
+        if (fstat(fd, &st) != 0 ||
+            read(fd, &header, sizeof(header)) != sizeof(header) ||
+            memcmp(header.magic, STL_LOD_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != STL_LOD_CACHE_VERSION ||
+            header.header_size != sizeof(header) ||
+            header.level_cnt != (STLuint32)level_cnt ||
+            header.unique_vertex_cnt != stl->unique_vertex_cnt ||
+            header.weld_epsilon != stl->weld_epsilon ||
+            (err = stl_hash_source(stl)) != STL_ERR_NONE ||
+            header.source_hash != stl->source_hash ||
+            header.source_size != stl->source_size) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
+
+        len = level_cnt * sizeof(entries[0]);
+        if (read(fd, entries, len) != (ssize_t)len ||
+            lseek(fd, STL_CACHE_ROUND(sizeof(header) + len), SEEK_SET) == -1) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
+
+        size = STL_CACHE_ROUND(sizeof(header) + len);
+        for (level = 0; level < level_cnt; level++) {
+                if (entries[level].ratio != ratios[level] ||
+                    entries[level].facet_cnt > stl->facet_cnt) {
+                        err = STL_ERR_FILE_FORMAT;
+                        goto done;
+                }
+                size += STL_CACHE_ROUND(3 * (size_t)entries[level].facet_cnt *
+                                        sizeof(STLuint32));
+        }
 
-	int fd = open(filename, O_RDONLY);
-      	if (fd == -1) {
-		return STL_FILE_TYPE_INVALID;
-	}
+        if ((size_t)st.st_size != size) {
+                err = STL_ERR_FILE_FORMAT;
+                goto done;
+        }
 
-	STLuint8 c;
-	int bytes_read = -1;
-	while ((bytes_read = read(fd, &c, sizeof(c))) != 0 && c <= 127) {
-	}
+        levels = (stl_lod_level_t *)stl_mem_alloc(&stl->allocator,
+                                                  level_cnt * sizeof(*levels));
+        if (levels == NULL) {
+                err = STL_ERR_MEM;
+                goto done;
+        }
+        memset(levels, 0, level_cnt * sizeof(*levels));
+
+        for (level = 0; level < level_cnt; level++) {
+                len = 3 * (size_t)entries[level].facet_cnt * sizeof(STLuint32);
+                levels[level].ratio = entries[level].ratio;
+                levels[level].facet_cnt = entries[level].facet_cnt;
+                levels[level].indices = (STLuint32 *)stl_mem_alloc(&stl->allocator,
+                                                                   len + 1);
+                if (levels[level].indices == NULL) {
+                        err = STL_ERR_MEM;
+                        goto done;
+                }
 
-	type = (bytes_read == 0) ? STL_FILE_TYPE_TXT : STL_FILE_TYPE_BIN;
+                if (read(fd, levels[level].indices, len) != (ssize_t)len ||
+                    lseek(fd, STL_CACHE_ROUND(len) - len, SEEK_CUR) == -1) {
+                        err = STL_ERR_FILE_FORMAT;
+                        goto done;
+                }
 
-	close(fd);
+                for (i = 0; i < 3 * (size_t)entries[level].facet_cnt; i++) {
+                        if (levels[level].indices[i] >= stl->unique_vertex_cnt) {
+                                err = STL_ERR_FILE_FORMAT;
+                                goto done;
+                        }
+                }
+        }
 
-	return type;
+        stl_release_lods(stl);
+        stl->lods = levels;
+        stl->lod_cnt = level_cnt;
+        levels = NULL;
 
-}
+        if (stl->cache_dir) {
+                futimens(fd, NULL);
+        }
 
-typedef struct {
-	STLFloat32 x;
-	STLFloat32 y;
-	STLFloat32 z;
-} stl_vector_t;
+done:
+        if (levels) {
+                for (level = 0; level < level_cnt; level++) {
+                        stl_mem_release(&stl->allocator, levels[level].indices);
+                }
+                stl_mem_release(&stl->allocator, levels);
+        }
 
-#define STL_BIN_HEADER_SIZE 80
-#define STL_TRIANGLE_VERTEX_CNT 3
+        close(fd);
+
+        return err;
+}
 
 static stl_error_t
-stl_load_bin_file(stl_t *stl)
+stl_lod_cache_store(stl_t *stl)
 {
-	stl_error_t err = STL_ERR_NONE;
+        stl_error_t err = STL_ERR_NONE;
+        stl_lod_cache_header_t header;
+        stl_lod_cache_level_t entries[STL_MAX_LODS];
+        char path[PATH_MAX];
+        char tmp_path[PATH_MAX];
+        int level = 0;
+        int fd = -1;
+
+        if (!stl_lod_cache_path(stl, path, sizeof(path)) ||
+            stl_hash_source(stl) != STL_ERR_NONE) {
+                return STL_ERR_FOPEN;
+        }
 
-	FILE *fp = fopen(stl->file, "r");
-        if (fp == NULL) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, STL_LOD_CACHE_MAGIC, sizeof(header.magic));
+        header.version = STL_LOD_CACHE_VERSION;
+        header.header_size = sizeof(header);
+        header.source_hash = stl->source_hash;
+        header.source_size = stl->source_size;
+        header.unique_vertex_cnt = stl->unique_vertex_cnt;
+        header.level_cnt = stl->lod_cnt;
+        header.weld_epsilon = stl->weld_epsilon;
+
+        memset(entries, 0, sizeof(entries));
+        for (level = 0; level < stl->lod_cnt; level++) {
+                entries[level].ratio = stl->lods[level].ratio;
+                entries[level].facet_cnt = stl->lods[level].facet_cnt;
+        }
+
+        if ((fd = stl_cache_create(stl, path, tmp_path, sizeof(tmp_path))) == -1) {
                 return STL_ERR_FOPEN;
         }
 
-	/* skip the stl file header */
-	if (fseek(fp, STL_BIN_HEADER_SIZE, SEEK_CUR) != 0) {
-		err = STL_ERR_FILE_FORMAT;
-		goto done;
-	}
+        if (stl_write_all(stl, fd, &header, sizeof(header)) != 0 ||
+            stl_write_section(stl, fd, entries, stl->lod_cnt * sizeof(entries[0])) != 0) {
+                err = STL_ERR_LOAD;
+        }
 
-	/* Read the the facet count */
-	if (fread(&stl->facet_cnt, sizeof(stl->facet_cnt), 1, fp) != 1) {
-		err = STL_ERR_FILE_FORMAT;
-		goto done;
-	}
+        for (level = 0; level < stl->lod_cnt && err == STL_ERR_NONE; level++) {
+                if (stl_write_section(stl, fd, stl->lods[level].indices,
+                                      3 * (size_t)stl->lods[level].facet_cnt *
+                                      sizeof(STLuint32)) != 0) {
+                        err = STL_ERR_LOAD;
+                }
+        }
 
-	int expected_vertex_cnt = stl->facet_cnt*3;
+        return stl_cache_commit(stl, fd, tmp_path, path, err);
+}
 
-        stl->vertices = (STLFloat *)malloc(expected_vertex_cnt * 6 * sizeof(STLFloat));
-	if (stl->vertices == NULL) {
-		err = STL_ERR_MEM;
-		goto done;
-	}
+stl_error_t
+stl_build_lods(stl_t *stl, const STLFloat *ratios, int level_cnt)
+{
+        stl_error_t err = STL_ERR_NONE;
+        stl_lod_level_t *levels = NULL;
+        int level = 0;
 
-	stl_vector_t vec;
-        int vertex_idx = 0;
-      	int triangle_idx = 0;
-	STLuint8 abc[2];
-	stl->min_x = stl->min_y = stl->min_z = FLT_MAX;
-	stl->max_x = stl->max_y = stl->max_z = FLT_MIN;
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
+        }
 
-	for (triangle_idx = 0; triangle_idx < stl->facet_cnt; triangle_idx++) {
+        if (level_cnt < 1 || level_cnt > STL_MAX_LODS) {
+                return STL_ERR_INVALID;
+        }
 
-		/* Read the normal vector */
-		if (fread(&vec, sizeof(vec), 1, fp) != 1) {
-			err = STL_ERR_FILE_FORMAT;
-			goto done;
-		}
+        for (level = 0; level < level_cnt; level++) {
+                if (!(ratios[level] > 0 && ratios[level] <= 1) ||
+                    (level > 0 && ratios[level] >= ratios[level - 1])) {
+                        return STL_ERR_INVALID;
+                }
+        }
 
-		int idx = 0;
-		for (idx = 0; idx < STL_TRIANGLE_VERTEX_CNT; idx++) {
+        if (stl->indices == NULL && (err = stl_weld(stl, 0)) != STL_ERR_NONE) {
+                return err;
+        }
+
+        if ((stl->cache_mode & STL_CACHE_READ) &&
+            stl_lod_cache_load(stl, ratios, level_cnt) == STL_ERR_NONE) {
+                return STL_ERR_NONE;
+        }
+
+        levels = (stl_lod_level_t *)stl_mem_alloc(&stl->allocator,
+                                                  level_cnt * sizeof(*levels));
+        if (levels == NULL) {
+                return STL_ERR_MEM;
+        }
 
-			/* Read the vertex vector */
-			if (fread(&vec, sizeof(vec), 1, fp) != 1) {
-				err = STL_ERR_FILE_FORMAT;
-				goto done;
-			}
+        memset(levels, 0, level_cnt * sizeof(*levels));
+        for (level = 0; level < level_cnt; level++) {
+                levels[level].ratio = ratios[level];
+        }
 
-			stl->vertex_cnt++;
-			stl->vertices[vertex_idx++] = vec.x;
-			stl->vertices[vertex_idx++] = vec.y;
-			stl->vertices[vertex_idx++] = vec.z;
+        err = stl_lod_simplify(stl->unique_vertices, stl->unique_vertex_cnt,
+                               stl->indices, stl->facet_cnt, levels, level_cnt,
+                               stl_thread_cnt(stl, 3 * (size_t)stl->facet_cnt *
+                                              STL_LOD_BYTES_PER_EDGE),
+                               &stl->allocator);
+        if (err != STL_ERR_NONE) {
+                stl_mem_release(&stl->allocator, levels);
+                return err;
+        }
 
-                        vertex_idx += 3;
+        stl_release_lods(stl);
+        stl->lods = levels;
+        stl->lod_cnt = level_cnt;
 
-			if (vec.x < stl->min_x) stl->min_x = vec.x;
-			if (vec.x > stl->max_x) stl->max_x = vec.x;
+        /* The levels are there either way, a cache that can't be written is harmless */
+        if (stl->cache_mode & STL_CACHE_WRITE) {
+                stl_lod_cache_store(stl);
+        }
 
-			if (vec.y < stl->min_y) stl->min_y = vec.y;
-			if (vec.y > stl->max_y) stl->max_y = vec.y;
+        return STL_ERR_NONE;
+}
 
-			if (vec.z < stl->min_z) stl->min_z = vec.z;
-			if (vec.z > stl->max_z) stl->max_z = vec.z;
-		}
+int
+stl_lod_cnt(stl_t *stl)
+{
+        return stl->lod_cnt;
+}
 
-		/* Read the Attribute Byte Count */
-		if (fread(&abc, sizeof(abc), 1, fp) != 1) {
-			err = STL_ERR_FILE_FORMAT;
-			goto done;
-		}
-	}
+stl_error_t
+stl_lod_indices(stl_t *stl, int level, STLuint32 **indices, STLuint *facet_cnt)
+{
+        if (level < 0 || level >= stl->lod_cnt) {
+                return STL_ERR_INVALID;
+        }
 
-        stl_fill_vertex_normals(stl);
+        *indices = stl->lods[level].indices;
+        *facet_cnt = stl->lods[level].facet_cnt;
 
-	stl->loaded = 1;
-done:
-	fclose(fp);
- 	return err;
+        return STL_ERR_NONE;
 }
 
-static stl_error_t
-stl_load_txt_file(stl_t *stl)
+stl_error_t
+stl_lod_vertices(stl_t *stl, int level, STLFloat *vertices)
 {
-        stl_error_t err = STL_ERR_NONE;
+        const STLuint32 *indices = NULL;
+        STLuint facet_cnt = 0;
+        size_t i = 0;
 
-        if ((err = stl_parse_txt(stl)) != STL_ERR_NONE) {
-                return err;
+        if (level < 0 || level >= stl->lod_cnt) {
+                return STL_ERR_INVALID;
         }
 
-        stl->vertices = (STLFloat *)malloc(6 * stl->vertex_cnt * sizeof(STLFloat));
+        indices = stl->lods[level].indices;
+        facet_cnt = stl->lods[level].facet_cnt;
 
-        if (stl->vertices == NULL) {
-                return STL_ERR_MEM;
+        for (i = 0; i < 3 * (size_t)facet_cnt; i++) {
+                memcpy(&vertices[6 * i], &stl->unique_vertices[3 * (size_t)indices[i]],
+                       3 * sizeof(STLFloat));
         }
 
-        if ((err = stl_get_vertices(stl)) != STL_ERR_NONE) {
-                return err;
+        stl_normals_interleaved(vertices, facet_cnt);
+
+        return STL_ERR_NONE;
+}
+
+stl_error_t
+stl_build_bvh(stl_t *stl)
+{
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
         }
 
-        stl_fill_vertex_normals(stl);
+        if (stl->bvh) {
+                return STL_ERR_NONE;
+        }
 
-        stl->loaded = 1;
+        return stl_bvh_build(stl, stl_thread_cnt(stl, (size_t)stl->facet_cnt *
+                                                 STL_BVH_BYTES_PER_FACET),
+                             &stl->allocator, &stl->bvh);
+}
 
-	return err;
+int
+stl_intersect_ray(stl_t *stl, const STLFloat origin[3], const STLFloat dir[3],
+                  STLFloat max_t, stl_hit_t *hit)
+{
+        if (stl->bvh == NULL) {
+                hit->facet = STL_NO_FACET;
+                return 0;
+        }
+
+        return stl_bvh_ray(stl->bvh, origin, dir, max_t, hit);
 }
 
-stl_error_t
-stl_load(stl_t *stl, char *filename)
+/* Rays traced by one thread */
+typedef struct {
+        const stl_bvh_t *bvh;
+        const STLFloat *origins;
+        const STLFloat *dirs;
+        stl_hit_t *hits;
+        STLFloat max_t;
+        STLuint first;
+        STLuint cnt;
+        STLuint hit_cnt;
+} stl_ray_job_t;
+
+static void *
+stl_ray_worker(void *arg)
 {
-        stl_error_t err = STL_ERR_NONE;
-	stl_file_type_t type = STL_FILE_TYPE_INVALID;
-        stl->file = filename;
+        stl_ray_job_t *job = (stl_ray_job_t *)arg;
+        STLuint i = 0;
 
-	type = stl_get_filetype(filename);
+        for (i = job->first; i < job->first + job->cnt; i++) {
+                job->hit_cnt += stl_bvh_ray(job->bvh, &job->origins[3 * (size_t)i],
+                                            &job->dirs[3 * (size_t)i], job->max_t,
+                                            &job->hits[i]);
+        }
 
-	switch (type) {
-	case STL_FILE_TYPE_TXT:
-		err = stl_load_txt_file(stl);
-		break;
-	case STL_FILE_TYPE_BIN:
-		err = stl_load_bin_file(stl);
-		break;
-	default:
-		err = STL_ERR_FILE_FORMAT;
-	}
+        return NULL;
+}
 
-        return err;
+STLuint
+stl_intersect_rays(stl_t *stl, const STLFloat *origins, const STLFloat *dirs,
+                   STLuint ray_cnt, STLFloat max_t, stl_hit_t *hits)
+{
+        stl_ray_job_t jobs[STL_MAX_THREADS];
+        STLuint per_job = 0, hit_cnt = 0, i = 0;
+        int thread_cnt = 0, t = 0;
+
+        if (stl->bvh == NULL) {
+                for (i = 0; i < ray_cnt; i++) {
+                        hits[i].facet = STL_NO_FACET;
+                }
+                return 0;
+        }
+
+        thread_cnt = stl_thread_cnt(stl, (size_t)ray_cnt * STL_BVH_BYTES_PER_RAY);
+        per_job = (ray_cnt + thread_cnt - 1) / thread_cnt;
+
+        for (t = 0; t < thread_cnt; t++) {
+                jobs[t].bvh = stl->bvh;
+                jobs[t].origins = origins;
+                jobs[t].dirs = dirs;
+                jobs[t].hits = hits;
+                jobs[t].max_t = max_t;
+                jobs[t].first = MIN(ray_cnt, t * per_job);
+                jobs[t].cnt = MIN(ray_cnt - jobs[t].first, per_job);
+                jobs[t].hit_cnt = 0;
+        }
+
+        stl_parallel(stl_ray_worker, jobs, sizeof(jobs[0]), thread_cnt);
+
+        for (t = 0; t < thread_cnt; t++) {
+                hit_cnt += jobs[t].hit_cnt;
+        }
+
+        return hit_cnt;
+}
+
+STLFloat
+stl_closest_point(stl_t *stl, const STLFloat point[3], STLFloat closest[3],
+                  STLuint *facet)
+{
+        if (stl->bvh == NULL) {
+                return -1;
+        }
+
+        return stl_bvh_closest_point(stl->bvh, point, closest, facet);
+}
+
+int
+stl_point_inside(stl_t *stl, const STLFloat point[3])
+{
+        return stl->bvh ? stl_bvh_inside(stl->bvh, point) : 0;
+}
+
+STLuint
+stl_overlap_box(stl_t *stl, const STLFloat min[3], const STLFloat max[3],
+                STLuint *facets, STLuint max_cnt)
+{
+        return stl->bvh ? stl_bvh_overlap(stl->bvh, min, max, facets, max_cnt) : 0;
 }
 
+stl_error_t
+stl_render(stl_t *stl, const stl_view_t *view, int width, int height,
+           STLuint8 *pixels)
+{
+        size_t work_size = 0;
+
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        work_size = (size_t)stl->facet_cnt * STL_RASTER_BYTES_PER_FACET +
+                    (size_t)width * height * STL_RASTER_BYTES_PER_PIXEL;
+
+        return stl_raster_draw(stl, view, width, height, pixels,
+                               stl_thread_cnt(stl, work_size), &stl->allocator,
+                               &stl->raster);
+}
 
 STLFloat
 stl_min_x(stl_t *stl)
 {
-        return stl->min_x;
+        return stl->bounds.min_x;
 }
 
 STLFloat
 stl_max_x(stl_t *stl)
 {
-        return stl->max_x;
+        return stl->bounds.max_x;
 }
 
 STLFloat
 stl_min_y(stl_t *stl)
 {
-        return stl->min_y;
+        return stl->bounds.min_y;
 }
 
 STLFloat
 stl_max_y(stl_t *stl)
 {
-        return stl->max_y;
+        return stl->bounds.max_y;
 }
 
 STLFloat
 stl_min_z(stl_t *stl)
 {
-        return stl->min_z;
+        return stl->bounds.min_z;
 }
 
 STLFloat
 stl_max_z(stl_t *stl)
 {
-        return stl->max_z;
+        return stl->bounds.max_z;
+}
+
+void
+stl_set_thread_cnt(stl_t *stl, int thread_cnt)
+{
+        stl->thread_cnt = thread_cnt;
 }
 
 STLuint
@@ -671,11 +3577,155 @@ stl_vertices(stl_t *stl, STLFloat **points)
                 return STL_ERR_NOT_LOADED;
         }
 
+        /* Mapped files are only accessible facet by facet */
+        if (stl->map != NULL ||
+            (stl->layout & STL_LAYOUT_FORMAT_MASK) != STL_LAYOUT_INTERLEAVED) {
+                return STL_ERR_INVALID;
+        }
+
         *points = stl->vertices;
 
         return STL_ERR_NONE;
 }
 
+void
+stl_set_cache(stl_t *stl, int mode)
+{
+        stl->cache_mode = mode;
+}
+
+stl_error_t
+stl_set_cache_dir(stl_t *stl, const char *dir, size_t max_size)
+{
+        char *copy = NULL;
+
+        if (dir) {
+                if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+                        return STL_ERR_FOPEN;
+                }
+
+                copy = (char *)stl_mem_alloc(&stl->allocator, strlen(dir) + 1);
+                if (copy == NULL) {
+                        return STL_ERR_MEM;
+                }
+                strcpy(copy, dir);
+        }
+
+        stl_mem_release(&stl->allocator, stl->cache_dir);
+        stl->cache_dir = copy;
+        stl->cache_max_size = max_size;
+
+        return STL_ERR_NONE;
+}
+
+int
+stl_cache_hit(stl_t *stl)
+{
+        return stl->cache_hit;
+}
+
+void
+stl_stats(stl_t *stl, stl_stats_t *stats)
+{
+        *stats = stl->stats;
+}
+
+stl_error_t
+stl_set_layout(stl_t *stl, int layout)
+{
+        if ((layout & STL_LAYOUT_FORMAT_MASK) > STL_LAYOUT_QUANTIZED ||
+            (layout & ~(STL_LAYOUT_FORMAT_MASK | STL_LAYOUT_FACE_NORMALS))) {
+                return STL_ERR_INVALID;
+        }
+
+        stl->layout = layout;
+
+        return STL_ERR_NONE;
+}
+
+static stl_error_t
+stl_layout_check(stl_t *stl, int format)
+{
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        if (stl->map != NULL || (stl->layout & STL_LAYOUT_FORMAT_MASK) != format) {
+                return STL_ERR_INVALID;
+        }
+
+        return STL_ERR_NONE;
+}
+
+stl_error_t
+stl_positions(stl_t *stl, STLFloat **points)
+{
+        stl_error_t err = stl_layout_check(stl, STL_LAYOUT_POSITIONS);
+
+        if (err == STL_ERR_NONE) {
+                *points = stl->vertices;
+        }
+
+        return err;
+}
+
+stl_error_t
+stl_positions_soa(stl_t *stl, STLFloat **x, STLFloat **y, STLFloat **z)
+{
+        stl_error_t err = stl_layout_check(stl, STL_LAYOUT_SOA);
+
+        if (err == STL_ERR_NONE) {
+                *x = stl->vertices;
+                *y = stl->vertices + stl->vertex_cnt;
+                *z = stl->vertices + 2 * (size_t)stl->vertex_cnt;
+        }
+
+        return err;
+}
+
+stl_error_t
+stl_positions_half(stl_t *stl, STLuint16 **points)
+{
+        stl_error_t err = stl_layout_check(stl, STL_LAYOUT_HALF);
+
+        if (err == STL_ERR_NONE) {
+                *points = stl->positions16;
+        }
+
+        return err;
+}
+
+stl_error_t
+stl_positions_quantized(stl_t *stl, STLuint16 **points,
+                        STLFloat offset[3], STLFloat scale[3])
+{
+        stl_error_t err = stl_layout_check(stl, STL_LAYOUT_QUANTIZED);
+
+        if (err == STL_ERR_NONE) {
+                *points = stl->positions16;
+                memcpy(offset, stl->quant_offset, sizeof(stl->quant_offset));
+                memcpy(scale, stl->quant_scale, sizeof(stl->quant_scale));
+        }
+
+        return err;
+}
+
+stl_error_t
+stl_face_normals(stl_t *stl, STLFloat **normals)
+{
+        if (stl->loaded == 0) {
+                return STL_ERR_NOT_LOADED;
+        }
+
+        if (stl->face_normals == NULL) {
+                return STL_ERR_INVALID;
+        }
+
+        *normals = stl->face_normals;
+
+        return STL_ERR_NONE;
+}
+
 int
 stl_error_lineno(stl_t *stl)
 {
@@ -28,16 +28,23 @@
 #ifndef _STL_H_
 #define _STL_H_
 
-#define STL_DBG printf
+#include <stddef.h>
+
+#define STL_DBG(...) fprintf(stderr, __VA_ARGS__)
 
 typedef float STLFloat;
 typedef float STLFloat32;
 
 typedef unsigned char STLuint8;
+typedef unsigned short STLuint16;
 typedef unsigned int STLuint32;
 typedef unsigned int STLuint;
 
 typedef struct stl_s stl_t;
+typedef struct stl_stream_s stl_stream_t;
+
+/* Size of a facet record in a binary stl file */
+#define STL_BIN_FACET_SIZE 50
 
 typedef enum {
         STL_ERR_NONE,
@@ -46,13 +53,129 @@ typedef enum {
         STL_ERR_FILE_FORMAT,
         STL_ERR_MEM,
         STL_ERR_NOT_LOADED,
-        STL_ERR_INVALID
+        STL_ERR_INVALID,
+        STL_ERR_ABORTED
 } stl_error_t;
 
+typedef enum {
+        STL_FILE_TYPE_INVALID,
+        STL_FILE_TYPE_TXT,
+        STL_FILE_TYPE_BIN
+} stl_file_type_t;
+
+typedef enum {
+        STL_CONFIDENCE_NONE,
+        STL_CONFIDENCE_LOW,
+        STL_CONFIDENCE_MEDIUM,
+        STL_CONFIDENCE_HIGH
+} stl_confidence_t;
+
+/*
+ * Detect the type of an stl file without loading it. Only the header of
+ * the file is read. confidence may be NULL.
+ */
+stl_file_type_t stl_filetype(char *filename, stl_confidence_t *confidence);
+
+/*
+ * Vertex layouts, chosen with stl_set_layout before loading.
+ *
+ * STL_LAYOUT_INTERLEAVED  x y z nx ny nz per vertex (stl_vertices)
+ * STL_LAYOUT_POSITIONS    x y z per vertex (stl_positions)
+ * STL_LAYOUT_SOA          separate x, y and z arrays (stl_positions_soa)
+ * STL_LAYOUT_HALF         x y z per vertex as IEEE half floats
+ *                         (stl_positions_half)
+ * STL_LAYOUT_QUANTIZED    x y z per vertex as 16 bit integers, position is
+ *                         offset + q * scale (stl_positions_quantized)
+ *
+ * Any of them can be or'ed with STL_LAYOUT_FACE_NORMALS to also keep one
+ * normal per facet (stl_face_normals).
+ */
+typedef enum {
+        STL_LAYOUT_INTERLEAVED,
+        STL_LAYOUT_POSITIONS,
+        STL_LAYOUT_SOA,
+        STL_LAYOUT_HALF,
+        STL_LAYOUT_QUANTIZED
+} stl_layout_t;
+
+#define STL_LAYOUT_FORMAT_MASK 0xff
+#define STL_LAYOUT_FACE_NORMALS 0x100
+
+/*
+ * Memory for an stl object and all of its buffers comes from an allocator,
+ * malloc unless one is given to stl_alloc_with. resize and release behave
+ * like realloc and free. The callbacks are called from the loader threads,
+ * so they must be thread safe.
+ */
+typedef struct {
+        void *(*alloc)(void *ctx, size_t size);
+        void *(*resize)(void *ctx, void *ptr, size_t size);
+        void (*release)(void *ctx, void *ptr);
+        void *ctx;
+} stl_allocator_t;
+
 stl_t* stl_alloc(void);
+stl_t* stl_alloc_with(const stl_allocator_t *allocator);
 stl_error_t stl_load(stl_t *, char *);
+stl_error_t stl_load_mapped(stl_t *, char *);
 void stl_free(stl_t *);
 
+/*
+ * Drop the loaded mesh along with everything built from it, keeping the
+ * settings of the object. The vertex buffer is kept and reused by the
+ * next load when it is large enough. Every load starts with it.
+ */
+void stl_reset(stl_t *);
+
+/*
+ * Arena allocator. Allocations are carved out of large blocks and only
+ * given back all at once by stl_arena_reset, after which the arena is
+ * coalesced into a single block big enough for everything it held. Loading
+ * similar files between resets then needs no further system allocations.
+ */
+typedef struct stl_arena_s stl_arena_t;
+
+stl_arena_t *stl_arena_create(size_t block_size);
+void stl_arena_allocator(stl_arena_t *, stl_allocator_t *allocator);
+void stl_arena_reset(stl_arena_t *);
+void stl_arena_destroy(stl_arena_t *);
+
+/* Number of blocks the arena has taken from malloc since it was created */
+unsigned long stl_arena_block_cnt(stl_arena_t *);
+
+/*
+ * Number of threads used to load large files, 0 (the default) uses one
+ * thread per online processor.
+ */
+void stl_set_thread_cnt(stl_t *, int thread_cnt);
+stl_error_t stl_set_layout(stl_t *, int layout);
+
+/*
+ * Mesh cache. With STL_CACHE_WRITE a successful stl_load also writes the
+ * welded mesh to <file>.stlc, with STL_CACHE_READ (the default) stl_load
+ * uses that cache instead of parsing when it was made from a file with
+ * the same contents. A mesh loaded from the cache comes with the indexed
+ * mesh of stl_weld(stl, 0) already built. stl_cache_hit tells whether
+ * the last load came from the cache.
+ */
+#define STL_CACHE_READ 0x1
+#define STL_CACHE_WRITE 0x2
+/* Fail with STL_ERR_NOT_LOADED instead of parsing when the cache misses */
+#define STL_CACHE_ONLY 0x4
+
+void stl_set_cache(stl_t *, int mode);
+
+/*
+ * Keep the cache files in dir, created if needed, instead of next to the
+ * stl files. Entries are named after the hash of the file contents, so
+ * copies of a file under other paths share one entry. When max_size is
+ * not 0 the least recently used entries are removed once the directory
+ * grows past max_size bytes. Any number of processes may share dir. A
+ * NULL dir goes back to cache files next to the stl files.
+ */
+stl_error_t stl_set_cache_dir(stl_t *, const char *dir, size_t max_size);
+int stl_cache_hit(stl_t *);
+
 STLFloat stl_max_x(stl_t *);
 STLFloat stl_min_x(stl_t *);
 STLFloat stl_max_y(stl_t *);
@@ -64,6 +187,204 @@ STLuint stl_facet_cnt(stl_t *);
 STLuint stl_vertex_cnt(stl_t *);
 
 stl_error_t stl_vertices(stl_t *, STLFloat **points);
+stl_error_t stl_positions(stl_t *, STLFloat **points);
+stl_error_t stl_positions_soa(stl_t *, STLFloat **x, STLFloat **y, STLFloat **z);
+stl_error_t stl_positions_half(stl_t *, STLuint16 **points);
+stl_error_t stl_positions_quantized(stl_t *, STLuint16 **points,
+                                    STLFloat offset[3], STLFloat scale[3]);
+stl_error_t stl_face_normals(stl_t *, STLFloat **normals);
+
+/*
+ * Facet level access. For binary files loaded with stl_load_mapped the
+ * facets are read in place from the mapped file, stl_facet_record returns
+ * the raw STL_BIN_FACET_SIZE byte record (NULL for files that are not
+ * mapped).
+ */
+const void *stl_facet_record(stl_t *, STLuint idx);
+stl_error_t stl_facet_vertices(stl_t *, STLuint idx, STLFloat vertices[9]);
+stl_error_t stl_facet_normal(stl_t *, STLuint idx, STLFloat normal[3]);
+
+/*
+ * Build an indexed copy of the mesh by welding vertices closer than
+ * epsilon on every axis, an epsilon of 0 only welds identical vertices.
+ * stl_unique_vertices then holds 3 floats per welded vertex and
+ * stl_indices 3 indices into it per facet.
+ */
+stl_error_t stl_weld(stl_t *, STLFloat epsilon);
+STLuint stl_unique_vertex_cnt(stl_t *);
+stl_error_t stl_unique_vertices(stl_t *, STLFloat **points);
+stl_error_t stl_indices(stl_t *, STLuint32 **indices);
+
+/*
+ * Levels of detail. stl_build_lods simplifies the indexed mesh (built
+ * with stl_weld(stl, 0) first when there is none) with quadric error
+ * metrics into level_cnt levels, level i keeping about ratios[i] of the
+ * facets. The ratios must be decreasing and at most 1. The levels index
+ * into stl_unique_vertices and are dropped by the next stl_weld. With the
+ * mesh cache enabled they are cached next to the mesh.
+ *
+ * stl_lod_vertices expands a level into the layout of stl_vertices, the
+ * buffer must hold 18 floats per facet of the level.
+ */
+stl_error_t stl_build_lods(stl_t *, const STLFloat *ratios, int level_cnt);
+int stl_lod_cnt(stl_t *);
+stl_error_t stl_lod_indices(stl_t *, int level, STLuint32 **indices,
+                            STLuint *facet_cnt);
+stl_error_t stl_lod_vertices(stl_t *, int level, STLFloat *vertices);
+
+/*
+ * Spatial queries. stl_build_bvh builds a bounding volume hierarchy over
+ * the facets, kept until the next load. The queries below need it and
+ * find nothing without it. They only read the object, so any number of
+ * threads may query it at once.
+ *
+ * stl_intersect_ray finds the closest facet hit by the ray in [0, max_t),
+ * dir need not be normalized and t is in units of dir. The hit point is
+ * v0 + u * (v1 - v0) + v * (v2 - v0) of the facet. stl_intersect_rays
+ * does ray_cnt rays (3 floats each in origins and dirs) across threads
+ * and returns the number of hits, facet is STL_NO_FACET for a miss.
+ *
+ * stl_closest_point returns the distance from point to the surface, -1
+ * for an empty mesh, closest and facet may be NULL. stl_point_inside
+ * tells whether point is inside the closed surface. stl_overlap_box
+ * stores up to max_cnt facets that intersect the box in facets and
+ * returns how many there are in total.
+ *
+ * stl_keep_bvh releases the mesh and everything else built from it,
+ * keeping only the hierarchy, which holds a copy of the facets of its
+ * own. The queries keep working, everything else finds nothing loaded.
+ */
+#define STL_NO_FACET ((STLuint)-1)
+
+typedef struct {
+        STLFloat t;
+        STLFloat u;
+        STLFloat v;
+        STLuint facet;
+} stl_hit_t;
+
+stl_error_t stl_build_bvh(stl_t *);
+int stl_intersect_ray(stl_t *, const STLFloat origin[3], const STLFloat dir[3],
+                      STLFloat max_t, stl_hit_t *hit);
+STLuint stl_intersect_rays(stl_t *, const STLFloat *origins, const STLFloat *dirs,
+                           STLuint ray_cnt, STLFloat max_t, stl_hit_t *hits);
+STLFloat stl_closest_point(stl_t *, const STLFloat point[3], STLFloat closest[3],
+                           STLuint *facet);
+int stl_point_inside(stl_t *, const STLFloat point[3]);
+STLuint stl_overlap_box(stl_t *, const STLFloat min[3], const STLFloat max[3],
+                        STLuint *facets, STLuint max_cnt);
+void stl_keep_bvh(stl_t *);
+
+/*
+ * Software rendering, without OpenGL. stl_render draws the mesh into
+ * pixels, width * height RGB bytes with the rows from the bottom up as
+ * glReadPixels returns them. The view is what the viewer sets up in
+ * OpenGL: modelview as glMultMatrixf takes it (a rotation, uniform scale
+ * and translation), the box of glOrtho and glViewport, the color of
+ * glColor and glClearColor, and its two lights, one at the eye and one
+ * shining along light in eye coordinates. Shading is STL_SHADE_FLAT or
+ * STL_SHADE_SMOOTH as with glShadeModel, and the image is the same for
+ * any number of threads. Buffers are kept in the object for the next
+ * render, one render at a time per object.
+ */
+#define STL_SHADE_FLAT 0
+#define STL_SHADE_SMOOTH 1
+
+typedef struct {
+        STLFloat modelview[16];
+        STLFloat ortho[6];
+        int viewport[4];
+        STLFloat light[3];
+        STLFloat color[3];
+        STLFloat background[3];
+        int shading;
+} stl_view_t;
+
+stl_error_t stl_render(stl_t *, const stl_view_t *view, int width, int height,
+                       STLuint8 *pixels);
 
 int stl_error_lineno(stl_t *);
+
+/*
+ * Statistics of the last stl_load or stl_load_mapped. Times are wall
+ * clock seconds. Mapping the file is its own phase, parsing does not
+ * include it. Binary files get their normals while being decoded, so
+ * only ASCII files have a normals phase. Bytes read counts what was read
+ * or mapped of the stl and cache files, system calls those made to open,
+ * map, read and write them, allocations those made from the allocator
+ * of the object by the load and its threads. peak_rss is the peak
+ * resident memory of the process in bytes so far.
+ *
+ * With the STL_TRACE environment variable naming a file when the first
+ * object is allocated, every load also writes its phases and the ranges
+ * parsed by each thread there as Chrome trace events (chrome://tracing
+ * or Perfetto). Without it nothing is traced.
+ */
+typedef struct {
+        double total_time;
+        double detect_time;
+        double cache_read_time;
+        double map_time;
+        double parse_time;
+        double normals_time;
+        double layout_time;
+        double cache_write_time;
+        unsigned long long bytes_read;
+        unsigned long long syscall_cnt;
+        unsigned long long alloc_cnt;
+        unsigned long long alloc_bytes;
+        size_t peak_rss;
+        int thread_cnt;
+} stl_stats_t;
+
+void stl_stats(stl_t *, stl_stats_t *stats);
+
+/*
+ * Streaming access for single pass processing of files too large to load.
+ * stl_stream_read hands the facets to cb in batches of up to batch_size
+ * facets, laid out like stl_vertices, with the normals filled in. The
+ * buffer is reused for the next batch. A non-zero return from cb stops the
+ * read with STL_ERR_ABORTED. Memory use only depends on batch_size.
+ */
+typedef int (*stl_stream_cb_t)(void *arg, const STLFloat *vertices,
+                               STLuint facet_cnt);
+
+stl_stream_t *stl_stream_open(char *filename, stl_error_t *err);
+stl_error_t stl_stream_read(stl_stream_t *, STLuint batch_size,
+                            stl_stream_cb_t cb, void *arg);
+STLuint stl_stream_facet_cnt(stl_stream_t *);
+stl_file_type_t stl_stream_type(stl_stream_t *);
+int stl_stream_lineno(stl_stream_t *);
+void stl_stream_close(stl_stream_t *);
+
+/*
+ * Load facets read from filename some other way, such as the batches of a
+ * stream collected into one buffer, without parsing the file again. The
+ * facets are copied and the object then holds them as if stl_load had
+ * parsed them, the cache included.
+ */
+stl_error_t stl_load_facets(stl_t *, char *filename, const STLFloat *vertices,
+                            STLuint facet_cnt);
+
+/*
+ * Writing stl files, STL_FILE_TYPE_TXT for ASCII and STL_FILE_TYPE_BIN
+ * for binary. stl_save writes the loaded mesh in whatever layout it was
+ * loaded. A writer takes batches of facets laid out like stl_vertices,
+ * the normal of a facet being that of its first vertex, so the batches
+ * of stl_stream_read can be written as they come to convert a file in
+ * constant memory. The file is written under a temporary name next to
+ * it, so it may also be the one being read or mapped. stl_writer_close
+ * fills in the facet count of a binary file and, when nothing failed,
+ * renames it into place, it returns the first error of the writer.
+ * stl_writer_abort drops what was written and leaves the file alone.
+ */
+typedef struct stl_writer_s stl_writer_t;
+
+stl_error_t stl_save(stl_t *, const char *filename, stl_file_type_t type);
+stl_writer_t *stl_writer_open(const char *filename, stl_file_type_t type,
+                              stl_error_t *err);
+stl_error_t stl_writer_write(stl_writer_t *, const STLFloat *vertices,
+                             STLuint facet_cnt);
+stl_error_t stl_writer_close(stl_writer_t *);
+void stl_writer_abort(stl_writer_t *);
 #endif
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stl.h"
+
+/* Alignment of every allocation, enough for any vector load */
+#define STL_ARENA_ALIGN 16
+#define STL_ARENA_ROUND(x) (((x) + STL_ARENA_ALIGN - 1) & ~(size_t)(STL_ARENA_ALIGN - 1))
+
+/* Each allocation is preceded by a header holding its size */
+#define STL_ARENA_HEADER STL_ARENA_ROUND(sizeof(size_t))
+
+typedef struct stl_arena_block_s {
+        struct stl_arena_block_s *next;
+        size_t size;
+        size_t used;
+        /* Offset of the most recent allocation, the only one that can move */
+        size_t last;
+} stl_arena_block_t;
+
+#define STL_ARENA_BLOCK_HEADER STL_ARENA_ROUND(sizeof(stl_arena_block_t))
+
+struct stl_arena_s {
+        pthread_mutex_t lock;
+        /* The block allocations are made from comes first */
+        stl_arena_block_t *blocks;
+        size_t block_size;
+        unsigned long block_cnt;
+};
+
+static stl_arena_block_t *
+stl_arena_add_block(stl_arena_t *arena, size_t size)
+{
+        stl_arena_block_t *block = NULL;
+
+        block = (stl_arena_block_t *)malloc(STL_ARENA_BLOCK_HEADER + size);
+        if (block == NULL) {
+                return NULL;
+        }
+
+        arena->block_cnt++;
+        block->next = arena->blocks;
+        block->size = size;
+        block->used = 0;
+        block->last = (size_t)-1;
+        arena->blocks = block;
+
+        return block;
+}
+
+static char *
+stl_arena_data(stl_arena_block_t *block)
+{
+        return (char *)block + STL_ARENA_BLOCK_HEADER;
+}
+
+static size_t *
+stl_arena_size(void *ptr)
+{
+        return (size_t *)((char *)ptr - STL_ARENA_HEADER);
+}
+
+static int
+stl_arena_is_last(stl_arena_t *arena, void *ptr)
+{
+        stl_arena_block_t *block = arena->blocks;
+
+        return block && block->last != (size_t)-1 &&
+               (char *)ptr == stl_arena_data(block) + block->last + STL_ARENA_HEADER;
+}
+
+static void *
+stl_arena_alloc_locked(stl_arena_t *arena, size_t size)
+{
+        stl_arena_block_t *block = arena->blocks;
+        size_t need = STL_ARENA_HEADER + STL_ARENA_ROUND(size);
+        char *ptr = NULL;
+
+        if (block == NULL || block->size - block->used < need) {
+                block = stl_arena_add_block(arena, need > arena->block_size ?
+                                                   need : arena->block_size);
+                if (block == NULL) {
+                        return NULL;
+                }
+        }
+
+        ptr = stl_arena_data(block) + block->used;
+        block->last = block->used;
+        block->used += need;
+
+        *(size_t *)ptr = size;
+        return ptr + STL_ARENA_HEADER;
+}
+
+static void *
+stl_arena_alloc(void *ctx, size_t size)
+{
+        stl_arena_t *arena = (stl_arena_t *)ctx;
+        void *ptr = NULL;
+
+        pthread_mutex_lock(&arena->lock);
+        ptr = stl_arena_alloc_locked(arena, size);
+        pthread_mutex_unlock(&arena->lock);
+
+        return ptr;
+}
+
+/*
+ * The most recent allocation grows and shrinks in place as long as its
+ * block has room, which covers the loader growing its vertex buffer.
+ * Anything else is copied to a new allocation.
+ */
+static void *
+stl_arena_resize(void *ctx, void *ptr, size_t size)
+{
+        stl_arena_t *arena = (stl_arena_t *)ctx;
+        stl_arena_block_t *block = NULL;
+        size_t old_size = 0;
+        void *new_ptr = NULL;
+
+        if (ptr == NULL) {
+                return stl_arena_alloc(ctx, size);
+        }
+
+        pthread_mutex_lock(&arena->lock);
+
+        block = arena->blocks;
+        old_size = *stl_arena_size(ptr);
+
+        if (stl_arena_is_last(arena, ptr) &&
+            block->last + STL_ARENA_HEADER + STL_ARENA_ROUND(size) <= block->size) {
+                block->used = block->last + STL_ARENA_HEADER + STL_ARENA_ROUND(size);
+                *stl_arena_size(ptr) = size;
+                new_ptr = ptr;
+        } else if (size <= old_size) {
+                *stl_arena_size(ptr) = size;
+                new_ptr = ptr;
+        } else if ((new_ptr = stl_arena_alloc_locked(arena, size)) != NULL) {
+                memcpy(new_ptr, ptr, old_size);
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+
+        return new_ptr;
+}
+
+/* Only the most recent allocation is given back before a reset */
+static void
+stl_arena_release(void *ctx, void *ptr)
+{
+        stl_arena_t *arena = (stl_arena_t *)ctx;
+
+        if (ptr == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock(&arena->lock);
+
+        if (stl_arena_is_last(arena, ptr)) {
+                arena->blocks->used = arena->blocks->last;
+                arena->blocks->last = (size_t)-1;
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+}
+
+stl_arena_t *
+stl_arena_create(size_t block_size)
+{
+        stl_arena_t *arena = NULL;
+
+        arena = (stl_arena_t *)malloc(sizeof(*arena));
+        if (arena == NULL) {
+                return NULL;
+        }
+
+        memset(arena, 0, sizeof(*arena));
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->block_size = STL_ARENA_ROUND(block_size);
+
+        if (block_size && stl_arena_add_block(arena, arena->block_size) == NULL) {
+                stl_arena_destroy(arena);
+                return NULL;
+        }
+
+        return arena;
+}
+
+void
+stl_arena_allocator(stl_arena_t *arena, stl_allocator_t *allocator)
+{
+        allocator->alloc = stl_arena_alloc;
+        allocator->resize = stl_arena_resize;
+        allocator->release = stl_arena_release;
+        allocator->ctx = arena;
+}
+
+static void
+stl_arena_free_blocks(stl_arena_t *arena)
+{
+        stl_arena_block_t *block = arena->blocks;
+        stl_arena_block_t *next = NULL;
+
+        for (; block; block = next) {
+                next = block->next;
+                free(block);
+        }
+
+        arena->blocks = NULL;
+}
+
+void
+stl_arena_reset(stl_arena_t *arena)
+{
+        stl_arena_block_t *block = NULL;
+        size_t total = 0;
+
+        pthread_mutex_lock(&arena->lock);
+
+        if (arena->blocks && arena->blocks->next) {
+                for (block = arena->blocks; block; block = block->next) {
+                        total += block->size;
+                }
+
+                /* One block for everything the last round needed */
+                stl_arena_free_blocks(arena);
+                if (stl_arena_add_block(arena, total) == NULL) {
+                        stl_arena_add_block(arena, arena->block_size);
+                }
+        }
+
+        if (arena->blocks) {
+                arena->blocks->used = 0;
+                arena->blocks->last = (size_t)-1;
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+}
+
+unsigned long
+stl_arena_block_cnt(stl_arena_t *arena)
+{
+        unsigned long cnt = 0;
+
+        pthread_mutex_lock(&arena->lock);
+        cnt = arena->block_cnt;
+        pthread_mutex_unlock(&arena->lock);
+
+        return cnt;
+}
+
+void
+stl_arena_destroy(stl_arena_t *arena)
+{
+        if (arena) {
+                stl_arena_free_blocks(arena);
+                pthread_mutex_destroy(&arena->lock);
+                free(arena);
+        }
+}
@@ -0,0 +1,928 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmarks. Generates a corpus of stl files, ASCII and binary, of a few
+ * shapes: a smooth sphere, a noisy scan of one and a CAD like part made
+ * of large flat patches. Each file (and any file given on the command
+ * line) is then run through file type detection, stl_load, the normal
+ * kernel, a bounds pass over the vertices and a software render, and the
+ * best of a few runs is reported. For ASCII files the number tokenizer is
+ * also timed and checked against strtof. Files without facets are also
+ * checked to load.
+ *
+ * Every object is allocated from one arena, reset between files, so the
+ * report shows the allocations of the first and of the repeated loads of
+ * a file and how many blocks the arena still had to take from malloc.
+ *
+ * With -o the results are also written as JSON, to compare versions.
+ * With -d the corpus is written to a directory and kept.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "stl.h"
+#include "stl_txt.h"
+#include "stl_normals.h"
+
+#define BENCH_DEFAULT_FACETS 1000000
+#define BENCH_DEFAULT_RUNS 3
+#define BENCH_DIR "/tmp"
+#define BENCH_DETECT_CALLS 1000
+#define BENCH_RENDER_SIZE 512
+#define BENCH_ARENA_BLOCK (1024 * 1024)
+
+typedef enum {
+        BENCH_SPHERE,
+        BENCH_SCAN,
+        BENCH_CAD,
+        BENCH_SHAPES
+} bench_shape_t;
+
+static const char *bench_shape_names[BENCH_SHAPES] = {"sphere", "scan", "cad"};
+
+/* Facets go to an ASCII or a binary file, the count is patched in at the end */
+typedef struct {
+        FILE *fp;
+        int binary;
+        STLuint32 facet_cnt;
+} bench_writer_t;
+
+/* Best times in seconds of each benchmark on one file, -1 when not run */
+typedef struct {
+        const char *name;
+        const char *file;
+        const char *type;
+        size_t size;
+        STLuint facet_cnt;
+        double detect;
+        double load;
+        double normals;
+        double bounds;
+        double render;
+        double tokenizer;
+        double strtof;
+        size_t mismatches;
+        stl_stats_t stats;
+        /* Allocations of the first load, most of any later load */
+        unsigned long long first_alloc_cnt;
+        unsigned long long alloc_cnt;
+        unsigned long arena_block_cnt;
+        int ok;
+} bench_result_t;
+
+static double
+bench_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A deterministic value in [-1, 1] for the grid point i, j */
+static double
+bench_noise(int i, int j)
+{
+        unsigned int h = (unsigned int)i * 73856093u ^ (unsigned int)j * 19349663u;
+
+        h ^= h >> 13;
+        h *= 0x5bd1e995u;
+        h ^= h >> 15;
+
+        return (h & 0xffff) / 32767.5 - 1;
+}
+
+static void
+sphere_point(int i, int j, int rings, int segments, double noise, float p[3])
+{
+        double theta = M_PI * i / rings;
+        double phi = 2 * M_PI * j / segments;
+        double r = 100.0;
+
+        /* The poles and the seam stay closed */
+        if (noise > 0 && i > 0 && i < rings) {
+                r *= 1 + noise * bench_noise(i, j % segments);
+        }
+
+        p[0] = r * sin(theta) * cos(phi);
+        p[1] = r * sin(theta) * sin(phi);
+        p[2] = r * cos(theta);
+}
+
+static int
+writer_open(bench_writer_t *w, const char *filename, int binary, const char *name)
+{
+        char header[80];
+
+        w->fp = fopen(filename, "wb");
+        w->binary = binary;
+        w->facet_cnt = 0;
+        if (w->fp == NULL) {
+                return -1;
+        }
+
+        if (binary) {
+                memset(header, 0, sizeof(header));
+                snprintf(header, sizeof(header), "stl_bench %s", name);
+                fwrite(header, 1, sizeof(header), w->fp);
+                fwrite(&w->facet_cnt, sizeof(w->facet_cnt), 1, w->fp);
+        } else {
+                fprintf(w->fp, "solid %s\n", name);
+        }
+
+        return 0;
+}
+
+static void
+write_facet(bench_writer_t *w, float a[3], float b[3], float c[3])
+{
+        float record[12] = {0};
+        STLuint16 attributes = 0;
+
+        w->facet_cnt++;
+
+        if (w->binary) {
+                memcpy(&record[3], a, 3 * sizeof(float));
+                memcpy(&record[6], b, 3 * sizeof(float));
+                memcpy(&record[9], c, 3 * sizeof(float));
+                fwrite(record, sizeof(record), 1, w->fp);
+                fwrite(&attributes, sizeof(attributes), 1, w->fp);
+                return;
+        }
+
+        fprintf(w->fp, "  facet normal 0.000000E+00 0.000000E+00 0.000000E+00\n");
+        fprintf(w->fp, "    outer loop\n");
+        fprintf(w->fp, "      vertex %E %E %E\n", a[0], a[1], a[2]);
+        fprintf(w->fp, "      vertex %E %E %E\n", b[0], b[1], b[2]);
+        fprintf(w->fp, "      vertex %E %E %E\n", c[0], c[1], c[2]);
+        fprintf(w->fp, "    endloop\n");
+        fprintf(w->fp, "  endfacet\n");
+}
+
+static int
+writer_close(bench_writer_t *w, const char *name)
+{
+        int err = 0;
+
+        if (w->binary) {
+                err = fseek(w->fp, 80, SEEK_SET) != 0 ||
+                      fwrite(&w->facet_cnt, sizeof(w->facet_cnt), 1, w->fp) != 1;
+        } else {
+                fprintf(w->fp, "endsolid %s\n", name);
+        }
+
+        err |= ferror(w->fp);
+        err |= fclose(w->fp) != 0;
+
+        return err ? -1 : 0;
+}
+
+/* A sphere of roughly facet_cnt facets, its radius varied by noise */
+static void
+generate_sphere(bench_writer_t *w, int facet_cnt, double noise)
+{
+        int segments = (int)sqrt(facet_cnt);
+        int rings = facet_cnt / (2 * segments);
+        int i, j;
+        float p00[3], p01[3], p10[3], p11[3];
+
+        for (i = 0; i < rings; i++) {
+                for (j = 0; j < segments; j++) {
+                        sphere_point(i, j, rings, segments, noise, p00);
+                        sphere_point(i, j + 1, rings, segments, noise, p01);
+                        sphere_point(i + 1, j, rings, segments, noise, p10);
+                        sphere_point(i + 1, j + 1, rings, segments, noise, p11);
+                        write_facet(w, p00, p10, p11);
+                        write_facet(w, p00, p11, p01);
+                }
+        }
+}
+
+/*
+ * A plate with a grid of square pockets, as CAD exports tessellate it:
+ * long thin triangles over large flat faces, on round coordinates.
+ */
+static void
+generate_cad(bench_writer_t *w, int facet_cnt)
+{
+        /* Each pocket takes 20 facets (floor, 4 walls, 4 rim strips) */
+        int cells = (int)sqrt(facet_cnt / 20.0);
+        float size = 10, depth = 5;
+        float a[3], b[3], c[3], d[3];
+        int i, j, k;
+
+        if (cells < 1) {
+                cells = 1;
+        }
+
+        for (i = 0; i < cells; i++) {
+                for (j = 0; j < cells; j++) {
+                        float x0 = i * size, y0 = j * size;
+                        float x1 = x0 + size, y1 = y0 + size;
+                        float px0 = x0 + 2, py0 = y0 + 2, px1 = x1 - 2, py1 = y1 - 2;
+                        float rim[4][4] = {
+                                {x0, y0, x1, py0}, {x0, py1, x1, y1},
+                                {x0, py0, px0, py1}, {px1, py0, x1, py1},
+                        };
+                        float wall[4][4] = {
+                                {px0, py0, px1, py0}, {px1, py0, px1, py1},
+                                {px1, py1, px0, py1}, {px0, py1, px0, py0},
+                        };
+
+                        /* Top face around the pocket */
+                        for (k = 0; k < 4; k++) {
+                                a[0] = rim[k][0]; a[1] = rim[k][1]; a[2] = 0;
+                                b[0] = rim[k][2]; b[1] = rim[k][1]; b[2] = 0;
+                                c[0] = rim[k][2]; c[1] = rim[k][3]; c[2] = 0;
+                                d[0] = rim[k][0]; d[1] = rim[k][3]; d[2] = 0;
+                                write_facet(w, a, b, c);
+                                write_facet(w, a, c, d);
+                        }
+
+                        /* Walls and floor of the pocket */
+                        for (k = 0; k < 4; k++) {
+                                a[0] = wall[k][0]; a[1] = wall[k][1]; a[2] = 0;
+                                b[0] = wall[k][2]; b[1] = wall[k][3]; b[2] = 0;
+                                c[0] = wall[k][2]; c[1] = wall[k][3]; c[2] = -depth;
+                                d[0] = wall[k][0]; d[1] = wall[k][1]; d[2] = -depth;
+                                write_facet(w, a, c, b);
+                                write_facet(w, a, d, c);
+                        }
+
+                        a[0] = px0; a[1] = py0; a[2] = -depth;
+                        b[0] = px1; b[1] = py0; b[2] = -depth;
+                        c[0] = px1; c[1] = py1; c[2] = -depth;
+                        d[0] = px0; d[1] = py1; d[2] = -depth;
+                        write_facet(w, a, b, c);
+                        write_facet(w, a, c, d);
+
+                        /* Bottom of the plate */
+                        a[0] = x0; a[1] = y0; a[2] = -2 * depth;
+                        b[0] = x1; b[1] = y0; b[2] = -2 * depth;
+                        c[0] = x1; c[1] = y1; c[2] = -2 * depth;
+                        d[0] = x0; d[1] = y1; d[2] = -2 * depth;
+                        write_facet(w, a, c, b);
+                        write_facet(w, a, d, c);
+                }
+        }
+}
+
+static int
+generate(const char *filename, bench_shape_t shape, int binary, int facet_cnt)
+{
+        bench_writer_t w;
+
+        if (writer_open(&w, filename, binary, bench_shape_names[shape]) != 0) {
+                return -1;
+        }
+
+        switch (shape) {
+        case BENCH_SPHERE:
+                generate_sphere(&w, facet_cnt, 0);
+                break;
+        case BENCH_SCAN:
+                generate_sphere(&w, facet_cnt, 0.02);
+                break;
+        default:
+                generate_cad(&w, facet_cnt);
+                break;
+        }
+
+        return writer_close(&w, bench_shape_names[shape]);
+}
+
+/* Files without facets are valid, check that both loaders accept them */
+static int
+bench_empty(FILE *fp, const char *dir, int keep)
+{
+        bench_writer_t w;
+        char file[4096];
+        stl_error_t err, mapped_err;
+        stl_t *stl = NULL;
+        int binary = 0, ret = 0;
+
+        for (binary = 0; binary < 2; binary++) {
+                snprintf(file, sizeof(file), "%s/%sempty_%s.stl", dir,
+                         keep ? "" : "stl_bench_", binary ? "binary" : "ascii");
+
+                if (writer_open(&w, file, binary, "empty") != 0 ||
+                    writer_close(&w, "empty") != 0) {
+                        fprintf(stderr, "Unable to generate %s\n", file);
+                        exit(1);
+                }
+
+                stl = stl_alloc();
+                if (stl == NULL) {
+                        fprintf(stderr, "Unable to allocate memory for the stl object\n");
+                        exit(1);
+                }
+
+                stl_set_cache(stl, 0);
+                err = stl_load(stl, file);
+                stl_reset(stl);
+                mapped_err = stl_load_mapped(stl, file);
+
+                fprintf(fp, "empty_%s: %s\n", binary ? "binary" : "ascii",
+                        err == STL_ERR_NONE && mapped_err == STL_ERR_NONE &&
+                        stl_facet_cnt(stl) == 0 ? "ok" : "not loaded");
+                if (err != STL_ERR_NONE || mapped_err != STL_ERR_NONE) {
+                        ret = -1;
+                }
+
+                stl_free(stl);
+                if (!keep) {
+                        remove(file);
+                }
+        }
+
+        return ret;
+}
+
+static int
+is_number_start(char c)
+{
+        return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.';
+}
+
+static char *
+read_file(const char *filename, size_t *len)
+{
+        struct stat st;
+        char *buffer = NULL;
+        FILE *fp = fopen(filename, "r");
+
+        if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+                goto err;
+        }
+
+        buffer = (char *)malloc(st.st_size + 1);
+        if (buffer == NULL ||
+            fread(buffer, 1, st.st_size, fp) != (size_t)st.st_size) {
+                goto err;
+        }
+
+        buffer[st.st_size] = '\0';
+        *len = st.st_size;
+        fclose(fp);
+        return buffer;
+
+err:
+        free(buffer);
+        if (fp) {
+                fclose(fp);
+        }
+        return NULL;
+}
+
+/*
+ * Convert every number in buffer with stl_txt_float (or strtof) and store
+ * the results in values. Returns the number of values converted.
+ */
+static size_t
+tokenize(const char *buffer, size_t len, float *values, int use_strtof)
+{
+        const char *str = buffer;
+        const char *end = buffer + len;
+        const char *eol = NULL;
+        const char *word = NULL;
+        size_t cnt = 0;
+
+        for (; str < end; str = (eol < end) ? eol + 1 : end) {
+                eol = stl_txt_eol(str, end);
+
+                for (word = stl_txt_skip_space(str, eol); word < eol;
+                     word = stl_txt_skip_space(str, eol)) {
+                        str = stl_txt_word_end(word, eol);
+
+                        if (!is_number_start(*word)) {
+                                continue;
+                        }
+
+                        if (use_strtof) {
+                                values[cnt++] = strtof(word, NULL);
+                        } else if (stl_txt_float(&word, eol, &values[cnt]) == 0) {
+                                cnt++;
+                        }
+                }
+        }
+
+        return cnt;
+}
+
+static int
+bench_tokenizer(bench_result_t *result)
+{
+        size_t len = 0, cnt = 0, ref_cnt = 0, i = 0, mismatches = 0;
+        double start;
+        float *values, *ref_values;
+        char *buffer = read_file(result->file, &len);
+
+        if (buffer == NULL) {
+                fprintf(stderr, "Unable to read %s\n", result->file);
+                return -1;
+        }
+
+        /* A number takes at least two bytes including its delimiter */
+        values = (float *)malloc((len / 2 + 1) * sizeof(float));
+        ref_values = (float *)malloc((len / 2 + 1) * sizeof(float));
+        if (values == NULL || ref_values == NULL) {
+                fprintf(stderr, "Unable to allocate memory for %s\n", result->file);
+                exit(1);
+        }
+
+        start = bench_now();
+        cnt = tokenize(buffer, len, values, 0);
+        result->tokenizer = bench_now() - start;
+
+        start = bench_now();
+        ref_cnt = tokenize(buffer, len, ref_values, 1);
+        result->strtof = bench_now() - start;
+
+        for (i = 0; i < cnt && i < ref_cnt; i++) {
+                if (memcmp(&values[i], &ref_values[i], sizeof(float)) != 0) {
+                        mismatches++;
+                }
+        }
+        result->mismatches = mismatches + (cnt != ref_cnt);
+
+        free(values);
+        free(ref_values);
+        free(buffer);
+
+        return result->mismatches ? -1 : 0;
+}
+
+/* Keep the best time of the runs in *best, tell whether elapsed is it */
+static int
+bench_best(double *best, double elapsed)
+{
+        if (*best < 0 || elapsed < *best) {
+                *best = elapsed;
+                return 1;
+        }
+
+        return 0;
+}
+
+/* Bounds of the vertices, checked against the ones found while loading */
+static int
+bench_bounds(stl_t *stl, const STLFloat *vertices)
+{
+        STLFloat min[3], max[3];
+        STLuint i = 0, vertex_cnt = stl_vertex_cnt(stl);
+        int k = 0;
+
+        if (vertex_cnt == 0) {
+                return 0;
+        }
+
+        for (k = 0; k < 3; k++) {
+                min[k] = max[k] = vertices[k];
+        }
+
+        for (i = 0; i < vertex_cnt; i++) {
+                for (k = 0; k < 3; k++) {
+                        if (vertices[6 * i + k] < min[k]) min[k] = vertices[6 * i + k];
+                        if (vertices[6 * i + k] > max[k]) max[k] = vertices[6 * i + k];
+                }
+        }
+
+        return min[0] == stl_min_x(stl) && max[0] == stl_max_x(stl) &&
+               min[1] == stl_min_y(stl) && max[1] == stl_max_y(stl) &&
+               min[2] == stl_min_z(stl) && max[2] == stl_max_z(stl) ? 0 : -1;
+}
+
+/* Looking at the model from the front, as the viewer first shows it */
+static void
+bench_view(stl_t *stl, stl_view_t *view)
+{
+        STLFloat size = fmaxf(fmaxf(stl_max_x(stl) - stl_min_x(stl),
+                                    stl_max_y(stl) - stl_min_y(stl)),
+                              stl_max_z(stl) - stl_min_z(stl));
+        int i = 0;
+
+        memset(view, 0, sizeof(*view));
+        for (i = 0; i < 4; i++) {
+                view->modelview[5 * i] = 1;
+        }
+
+        view->ortho[0] = stl_min_x(stl) - 0.1 * size;
+        view->ortho[1] = stl_max_x(stl) + 0.1 * size;
+        view->ortho[2] = stl_min_y(stl) - 0.1 * size;
+        view->ortho[3] = stl_max_y(stl) + 0.1 * size;
+        view->ortho[4] = -stl_max_z(stl) - size;
+        view->ortho[5] = -stl_min_z(stl) + size;
+        view->viewport[2] = BENCH_RENDER_SIZE;
+        view->viewport[3] = BENCH_RENDER_SIZE;
+
+        for (i = 0; i < 3; i++) {
+                view->light[i] = 1;
+                view->color[i] = 120.0 / 255.0;
+                view->background[i] = 1;
+        }
+        view->shading = STL_SHADE_SMOOTH;
+}
+
+static int
+bench_file(bench_result_t *result, int runs, int thread_cnt, stl_arena_t *arena)
+{
+        stl_allocator_t allocator;
+        stl_stats_t stats;
+        unsigned long block_cnt = 0;
+        struct stat st;
+        stl_file_type_t type = STL_FILE_TYPE_INVALID;
+        stl_view_t view;
+        STLFloat *vertices = NULL;
+        STLuint8 *pixels = NULL;
+        double start;
+        stl_error_t err;
+        stl_t *stl;
+        int i;
+
+        result->detect = result->load = result->normals = -1;
+        result->bounds = result->render = result->tokenizer = result->strtof = -1;
+        result->ok = 0;
+
+        if (stat(result->file, &st) != 0) {
+                fprintf(stderr, "Unable to open %s\n", result->file);
+                return -1;
+        }
+        result->size = st.st_size;
+
+        start = bench_now();
+        for (i = 0; i < BENCH_DETECT_CALLS; i++) {
+                type = stl_filetype((char *)result->file, NULL);
+        }
+        result->detect = (bench_now() - start) / BENCH_DETECT_CALLS;
+        result->type = type == STL_FILE_TYPE_BIN ? "binary" :
+                       type == STL_FILE_TYPE_TXT ? "ascii" : "invalid";
+
+        /* Whatever the last file needed is one block again */
+        stl_arena_reset(arena);
+        block_cnt = stl_arena_block_cnt(arena);
+        stl_arena_allocator(arena, &allocator);
+
+        stl = stl_alloc_with(&allocator);
+        pixels = (STLuint8 *)malloc(3 * BENCH_RENDER_SIZE * BENCH_RENDER_SIZE);
+        if (stl == NULL || pixels == NULL) {
+                fprintf(stderr, "Unable to allocate memory for the stl object\n");
+                exit(1);
+        }
+
+        stl_set_thread_cnt(stl, thread_cnt);
+        stl_set_cache(stl, 0);
+
+        for (i = 0; i < runs; i++) {
+                stl_reset(stl);
+
+                start = bench_now();
+                err = stl_load(stl, (char *)result->file);
+                stl_stats(stl, &stats);
+                if (bench_best(&result->load, bench_now() - start)) {
+                        result->stats = stats;
+                }
+
+                if (i == 0) {
+                        result->first_alloc_cnt = stats.alloc_cnt;
+                } else if (stats.alloc_cnt > result->alloc_cnt) {
+                        result->alloc_cnt = stats.alloc_cnt;
+                }
+
+                if (err != STL_ERR_NONE) {
+                        fprintf(stderr, "Problem loading %s, check lineno %d\n",
+                                result->file, stl_error_lineno(stl));
+                        goto done;
+                }
+        }
+
+        result->facet_cnt = stl_facet_cnt(stl);
+        result->arena_block_cnt = stl_arena_block_cnt(arena) - block_cnt;
+        if (stl_vertices(stl, &vertices) != STL_ERR_NONE) {
+                goto done;
+        }
+
+        for (i = 0; i < runs; i++) {
+                start = bench_now();
+                stl_normals_interleaved(vertices, result->facet_cnt);
+                bench_best(&result->normals, bench_now() - start);
+
+                start = bench_now();
+                err = bench_bounds(stl, vertices);
+                bench_best(&result->bounds, bench_now() - start);
+                if (err != 0) {
+                        fprintf(stderr, "%s: bounds differ from the loaded ones\n",
+                                result->file);
+                        goto done;
+                }
+
+                bench_view(stl, &view);
+                start = bench_now();
+                err = stl_render(stl, &view, BENCH_RENDER_SIZE, BENCH_RENDER_SIZE, pixels);
+                bench_best(&result->render, bench_now() - start);
+                if (err != STL_ERR_NONE) {
+                        fprintf(stderr, "Unable to render %s\n", result->file);
+                        goto done;
+                }
+        }
+
+        result->ok = type != STL_FILE_TYPE_TXT || bench_tokenizer(result) == 0;
+
+done:
+        stl_free(stl);
+        free(pixels);
+
+        return result->ok ? 0 : -1;
+}
+
+static void
+print_result(FILE *fp, const bench_result_t *r)
+{
+        if (r->load < 0 || r->facet_cnt == 0) {
+                fprintf(fp, "%s: %s, not loaded\n", r->name, r->type ? r->type : "invalid");
+                return;
+        }
+
+        fprintf(fp, "%s: %s, %u facets, %.1f MB\n", r->name, r->type, r->facet_cnt,
+                r->size / 1e6);
+        fprintf(fp, "  detect %.1f us, load %.3f s (%.1f MB/s, %.2f Mfacets/s)\n",
+                r->detect * 1e6, r->load, r->size / 1e6 / r->load,
+                r->facet_cnt / 1e6 / r->load);
+        fprintf(fp, "  map %.1f ms, parse %.1f ms, normals %.1f ms, threads %d, "
+                "%llu syscalls, %llu allocations, peak rss %.1f MB\n",
+                r->stats.map_time * 1e3, r->stats.parse_time * 1e3,
+                r->stats.normals_time * 1e3, r->stats.thread_cnt,
+                r->stats.syscall_cnt, r->stats.alloc_cnt, r->stats.peak_rss / 1e6);
+        fprintf(fp, "  allocations first load %llu, later loads %llu, arena blocks %lu\n",
+                r->first_alloc_cnt, r->alloc_cnt, r->arena_block_cnt);
+        if (r->normals >= 0) {
+                fprintf(fp, "  normals %.1f ms, bounds %.1f ms, render %dx%d %.1f ms\n",
+                        r->normals * 1e3, r->bounds * 1e3, BENCH_RENDER_SIZE,
+                        BENCH_RENDER_SIZE, r->render * 1e3);
+        }
+        if (r->tokenizer >= 0) {
+                fprintf(fp, "  stl_txt_float %.1f MB/s, strtof %.1f MB/s, %zu mismatches\n",
+                        r->size / 1e6 / r->tokenizer, r->size / 1e6 / r->strtof,
+                        r->mismatches);
+        }
+}
+
+/* A time, null when the benchmark did not run */
+static void
+json_time(FILE *fp, const char *key, double seconds)
+{
+        if (seconds < 0) {
+                fprintf(fp, ", \"%s\": null", key);
+        } else {
+                fprintf(fp, ", \"%s\": %.9f", key, seconds);
+        }
+}
+
+static int
+write_json(const char *filename, const bench_result_t *results, int cnt,
+           int facet_cnt, int runs, int thread_cnt)
+{
+        FILE *fp = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+        int i = 0, err = 0;
+
+        if (fp == NULL) {
+                fprintf(stderr, "Unable to write %s\n", filename);
+                return -1;
+        }
+
+        fprintf(fp, "{\n  \"time\": %ld,\n  \"facets\": %d,\n  \"runs\": %d,\n"
+                "  \"threads\": %d,\n  \"online_cpus\": %ld,\n  \"normals_kernel\": \"%s\",\n"
+                "  \"render_size\": %d,\n  \"results\": [\n", (long)time(NULL), facet_cnt,
+                runs, thread_cnt, sysconf(_SC_NPROCESSORS_ONLN), stl_normals_kernel(),
+                BENCH_RENDER_SIZE);
+
+        for (i = 0; i < cnt; i++) {
+                const bench_result_t *r = &results[i];
+                const char *c = NULL;
+
+                fprintf(fp, "    {\"name\": \"");
+                for (c = r->name; *c; c++) {
+                        fprintf(fp, (*c == '"' || *c == '\\') ? "\\%c" : "%c", *c);
+                }
+                fprintf(fp, "\", \"type\": \"%s\", \"ok\": %s, \"bytes\": %zu, "
+                        "\"facets\": %u", r->type ? r->type : "invalid",
+                        r->ok ? "true" : "false", r->size, r->facet_cnt);
+                json_time(fp, "detect_s", r->detect);
+                json_time(fp, "load_s", r->load);
+                if (r->load >= 0) {
+                        fprintf(fp, ", \"load_stats\": {\"map_s\": %.9f, "
+                                "\"parse_s\": %.9f, \"normals_s\": %.9f, "
+                                "\"threads\": %d, \"bytes_read\": %llu, "
+                                "\"syscalls\": %llu, \"allocations\": %llu, "
+                                "\"alloc_bytes\": %llu, \"peak_rss\": %zu}",
+                                r->stats.map_time, r->stats.parse_time,
+                                r->stats.normals_time, r->stats.thread_cnt,
+                                r->stats.bytes_read, r->stats.syscall_cnt,
+                                r->stats.alloc_cnt, r->stats.alloc_bytes,
+                                r->stats.peak_rss);
+                        fprintf(fp, ", \"first_allocations\": %llu, \"allocations\": %llu, "
+                                "\"arena_blocks\": %lu", r->first_alloc_cnt,
+                                r->alloc_cnt, r->arena_block_cnt);
+                }
+                json_time(fp, "normals_s", r->normals);
+                json_time(fp, "bounds_s", r->bounds);
+                json_time(fp, "render_s", r->render);
+                json_time(fp, "tokenizer_s", r->tokenizer);
+                json_time(fp, "strtof_s", r->strtof);
+                if (r->tokenizer >= 0) {
+                        fprintf(fp, ", \"mismatches\": %zu", r->mismatches);
+                }
+                fprintf(fp, "}%s\n", i + 1 < cnt ? "," : "");
+        }
+
+        fprintf(fp, "  ]\n}\n");
+
+        err = ferror(fp);
+        if (fp != stdout) {
+                err |= fclose(fp);
+        }
+
+        return err ? -1 : 0;
+}
+
+static void
+usage(char *program)
+{
+        fprintf(stderr, "%s [-n facet count] [-r runs] [-t threads] [-s shape,...] "
+                "[-f ascii|binary] [-o json file] [-d corpus dir] [stl file ...]\n",
+                program);
+        fprintf(stderr, "shapes: sphere, scan, cad\n");
+        exit(1);
+}
+
+/* Comma separated shape names to a mask of shapes */
+static int
+parse_shapes(char *list)
+{
+        char *name = NULL, *save = NULL;
+        int mask = 0, i = 0;
+
+        for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+                for (i = 0; i < BENCH_SHAPES && strcmp(name, bench_shape_names[i]) != 0; i++);
+
+                if (i == BENCH_SHAPES) {
+                        return 0;
+                }
+                mask |= 1 << i;
+        }
+
+        return mask;
+}
+
+int
+main(int argc, char **argv)
+{
+        bench_result_t *results = NULL;
+        stl_arena_t *arena = NULL;
+        char *json = NULL, *dir = NULL;
+        FILE *out = stdout;
+        char *names = NULL, *files = NULL;
+        int facet_cnt = BENCH_DEFAULT_FACETS;
+        int runs = BENCH_DEFAULT_RUNS;
+        int thread_cnt = 0;
+        int shapes = (1 << BENCH_SHAPES) - 1;
+        int formats = 3;
+        int cnt = 0, shape = 0, binary = 0;
+        int i, opt, ret = 0;
+
+        while ((opt = getopt(argc, argv, "n:r:t:s:f:o:d:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        facet_cnt = atoi(optarg);
+                        break;
+                case 'r':
+                        runs = atoi(optarg);
+                        break;
+                case 't':
+                        thread_cnt = atoi(optarg);
+                        break;
+                case 's':
+                        shapes = parse_shapes(optarg);
+                        break;
+                case 'f':
+                        formats = strcmp(optarg, "ascii") == 0 ? 1 :
+                                  strcmp(optarg, "binary") == 0 ? 2 : 0;
+                        break;
+                case 'o':
+                        json = optarg;
+                        break;
+                case 'd':
+                        dir = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (facet_cnt <= 0 || runs <= 0 || shapes == 0 || formats == 0) {
+                usage(argv[0]);
+        }
+
+        /* JSON on the standard output leaves the report to the error output */
+        if (json && strcmp(json, "-") == 0) {
+                out = stderr;
+        }
+
+        if (dir && mkdir(dir, 0777) != 0 && access(dir, W_OK) != 0) {
+                fprintf(stderr, "Unable to create %s\n", dir);
+                exit(1);
+        }
+
+        /* Names and paths of the generated files */
+        results = (bench_result_t *)calloc(2 * BENCH_SHAPES + argc, sizeof(*results));
+        names = (char *)malloc(2 * BENCH_SHAPES * 64);
+        files = (char *)malloc(2 * BENCH_SHAPES * 4096);
+        arena = stl_arena_create(BENCH_ARENA_BLOCK);
+        if (results == NULL || names == NULL || files == NULL || arena == NULL) {
+                fprintf(stderr, "Unable to allocate memory for the results\n");
+                exit(1);
+        }
+
+        for (shape = 0; shape < BENCH_SHAPES; shape++) {
+                for (binary = 0; binary < 2; binary++) {
+                        bench_result_t *r = &results[cnt];
+                        char *name = &names[cnt * 64];
+                        char *file = &files[cnt * 4096];
+
+                        if (!(shapes & (1 << shape)) || !(formats & (1 << binary))) {
+                                continue;
+                        }
+
+                        snprintf(name, 64, "%s_%s", bench_shape_names[shape],
+                                 binary ? "binary" : "ascii");
+                        snprintf(file, 4096, "%s/%s%s.stl", dir ? dir : BENCH_DIR,
+                                 dir ? "" : "stl_bench_", name);
+                        r->name = name;
+                        r->file = file;
+
+                        if (generate(file, shape, binary, facet_cnt) != 0) {
+                                fprintf(stderr, "Unable to generate %s\n", file);
+                                exit(1);
+                        }
+
+                        ret |= bench_file(r, runs, thread_cnt, arena);
+                        print_result(out, r);
+                        cnt++;
+
+                        if (dir == NULL) {
+                                remove(file);
+                        }
+                }
+        }
+
+        ret |= bench_empty(out, dir ? dir : BENCH_DIR, dir != NULL);
+
+        for (i = optind; i < argc; i++) {
+                results[cnt].name = argv[i];
+                results[cnt].file = argv[i];
+                ret |= bench_file(&results[cnt], runs, thread_cnt, arena);
+                print_result(out, &results[cnt]);
+                cnt++;
+        }
+
+        if (json && write_json(json, results, cnt, facet_cnt, runs, thread_cnt) != 0) {
+                ret = 1;
+        }
+
+        free(results);
+        free(names);
+        free(files);
+        stl_arena_destroy(arena);
+
+        return ret ? 1 : 0;
+}
@@ -0,0 +1,1246 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "stl_bvh.h"
+#include "stl_parallel.h"
+
+/*
+ * The hierarchy is built top down with the surface area heuristic,
+ * evaluated on up to STL_BVH_BINS bins of the facet centroids per axis. The top
+ * of the tree is split on the calling thread until there are enough
+ * subtrees to keep every thread busy, the subtrees are then built in
+ * parallel and appended to the node array one after the other.
+ *
+ * Nodes are 32 bytes. The two children of a node are next to each other,
+ * so both boxes are tested from one 64 byte block, and the facets are
+ * copied into leaf order so that a leaf reads one contiguous run.
+ */
+
+#define STL_BVH_MAX_THREADS 64
+
+#define STL_BVH_BINS 16
+
+/* Ranges this small always become a leaf */
+#define STL_BVH_MIN_SPLIT 4
+
+/* Ranges larger than this are split even when the heuristic says not to */
+#define STL_BVH_MAX_LEAF 16
+
+/* Cost of testing the boxes of a node, relative to testing a facet */
+#define STL_BVH_TRAVERSAL_COST 1.0f
+
+/* Below this depth ranges are halved, which bounds the depth of the tree */
+#define STL_BVH_MAX_SAH_DEPTH 40
+
+/* Deeper than any tree the builder makes */
+#define STL_BVH_STACK_SIZE 128
+
+/* Subtrees per thread, more even out subtrees of different cost */
+#define STL_BVH_SUBTREES_PER_THREAD 4
+
+#define STL_BVH_ROOT ((STLuint32)-1)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+typedef struct {
+        STLFloat min[3];
+        STLFloat max[3];
+} stl_bvh_box_t;
+
+/*
+ * A leaf has cnt facets starting at facet index, an interior node has its
+ * children at index and index + 1.
+ */
+typedef struct {
+        stl_bvh_box_t box;
+        STLuint32 index;
+        STLuint32 cnt;
+} stl_bvh_node_t;
+
+/* A facet as its first vertex and its two edges from there */
+typedef struct {
+        STLFloat v0[3];
+        STLFloat e1[3];
+        STLFloat e2[3];
+} stl_bvh_tri_t;
+
+struct stl_bvh_s {
+        const stl_allocator_t *allocator;
+        stl_bvh_node_t *nodes;
+        STLuint node_cnt;
+        stl_bvh_tri_t *tris;
+        STLuint32 *facets;
+        STLuint tri_cnt;
+};
+
+/* Growable array of nodes, children are always appended in pairs */
+typedef struct {
+        stl_bvh_node_t *nodes;
+        STLuint cnt;
+        STLuint capacity;
+} stl_bvh_list_t;
+
+typedef struct {
+        STLuint32 node;
+        STLuint32 begin;
+        STLuint32 end;
+        int depth;
+} stl_bvh_range_t;
+
+/* A facet while building, the facets of a node are kept together */
+typedef struct {
+        stl_bvh_box_t box;
+        STLuint32 facet;
+} stl_bvh_ref_t;
+
+typedef struct {
+        const stl_allocator_t *allocator;
+        stl_bvh_ref_t *refs;
+} stl_bvh_build_t;
+
+/* A subtree built by one thread, its root is stored apart from its list */
+typedef struct {
+        stl_bvh_range_t range;
+        stl_bvh_node_t root;
+        stl_bvh_list_t list;
+        stl_error_t err;
+} stl_bvh_subtree_t;
+
+typedef struct {
+        stl_bvh_build_t *build;
+        stl_t *stl;
+        stl_bvh_tri_t *tris;
+        stl_bvh_box_t bounds;
+        STLuint first;
+        STLuint cnt;
+
+        stl_bvh_subtree_t *subtrees;
+        int subtree_cnt;
+        int *next_subtree;
+} stl_bvh_job_t;
+
+static void *
+stl_bvh_alloc(const stl_allocator_t *allocator, size_t size)
+{
+        return allocator->alloc(allocator->ctx, size);
+}
+
+static void
+stl_bvh_release(const stl_allocator_t *allocator, void *ptr)
+{
+        if (ptr) {
+                allocator->release(allocator->ctx, ptr);
+        }
+}
+
+static void
+stl_bvh_box_init(stl_bvh_box_t *box)
+{
+        int i = 0;
+
+        for (i = 0; i < 3; i++) {
+                box->min[i] = HUGE_VALF;
+                box->max[i] = -HUGE_VALF;
+        }
+}
+
+static void
+stl_bvh_box_merge(stl_bvh_box_t *box, const stl_bvh_box_t *other)
+{
+        int i = 0;
+
+        for (i = 0; i < 3; i++) {
+                box->min[i] = MIN(box->min[i], other->min[i]);
+                box->max[i] = MAX(box->max[i], other->max[i]);
+        }
+}
+
+/* Half the surface area, all the heuristic needs */
+static STLFloat
+stl_bvh_box_area(const stl_bvh_box_t *box)
+{
+        STLFloat dx = box->max[0] - box->min[0];
+        STLFloat dy = box->max[1] - box->min[1];
+        STLFloat dz = box->max[2] - box->min[2];
+
+        if (dx < 0) {
+                return 0;
+        }
+
+        return dx * dy + dy * dz + dz * dx;
+}
+
+static void
+stl_bvh_range_box(const stl_bvh_build_t *build, STLuint begin, STLuint end,
+                  stl_bvh_box_t *box)
+{
+        STLuint i = 0;
+
+        stl_bvh_box_init(box);
+        for (i = begin; i < end; i++) {
+                stl_bvh_box_merge(box, &build->refs[i].box);
+        }
+}
+
+static int
+stl_bvh_bin(STLFloat centroid, STLFloat min, STLFloat scale, int bin_cnt)
+{
+        STLFloat bin = (centroid - min) * scale;
+
+        if (!(bin > 0)) {
+                return 0;
+        }
+
+        return bin < bin_cnt ? (int)bin : bin_cnt - 1;
+}
+
+static STLFloat
+stl_bvh_centroid(const stl_bvh_ref_t *ref, int axis)
+{
+        return (ref->box.min[axis] + ref->box.max[axis]) / 2;
+}
+
+/*
+ * Find the cheapest split of the facets in refs[begin, end) and partition
+ * them accordingly. Returns the start of the right half with the boxes of
+ * both halves, or begin when the range is better off as a leaf.
+ */
+static STLuint
+stl_bvh_split(const stl_bvh_build_t *build, STLuint begin, STLuint end,
+              const stl_bvh_box_t *box, int depth,
+              stl_bvh_box_t *left, stl_bvh_box_t *right)
+{
+        stl_bvh_box_t bins[3][STL_BVH_BINS], right_boxes[STL_BVH_BINS];
+        STLuint bin_cnts[3][STL_BVH_BINS], right_cnts[STL_BVH_BINS];
+        stl_bvh_box_t centroid_box, acc;
+        STLFloat best_cost = HUGE_VALF, cost = 0, scale[3];
+        STLFloat area = stl_bvh_box_area(box);
+        STLuint cnt = end - begin, acc_cnt = 0;
+        STLuint i = 0, mid = 0;
+        stl_bvh_ref_t *refs = build->refs;
+        stl_bvh_ref_t tmp;
+        int axis = 0, best_axis = -1, best_bin = 0, b = 0;
+        int bin_cnt = MIN(cnt, STL_BVH_BINS);
+
+        if (cnt <= STL_BVH_MIN_SPLIT) {
+                return begin;
+        }
+
+        stl_bvh_box_init(&centroid_box);
+        for (i = begin; i < end; i++) {
+                for (axis = 0; axis < 3; axis++) {
+                        centroid_box.min[axis] = MIN(centroid_box.min[axis],
+                                                     stl_bvh_centroid(&refs[i], axis));
+                        centroid_box.max[axis] = MAX(centroid_box.max[axis],
+                                                     stl_bvh_centroid(&refs[i], axis));
+                }
+        }
+
+        /* All three axes are binned in one pass over the facets */
+        for (axis = 0; axis < 3; axis++) {
+                scale[axis] = 0;
+                if (centroid_box.max[axis] > centroid_box.min[axis]) {
+                        scale[axis] = bin_cnt /
+                                      (centroid_box.max[axis] - centroid_box.min[axis]);
+                }
+
+                for (b = 0; b < bin_cnt; b++) {
+                        stl_bvh_box_init(&bins[axis][b]);
+                        bin_cnts[axis][b] = 0;
+                }
+        }
+
+        for (i = begin; i < end && depth < STL_BVH_MAX_SAH_DEPTH; i++) {
+                for (axis = 0; axis < 3; axis++) {
+                        b = stl_bvh_bin(stl_bvh_centroid(&refs[i], axis),
+                                        centroid_box.min[axis], scale[axis], bin_cnt);
+                        stl_bvh_box_merge(&bins[axis][b], &refs[i].box);
+                        bin_cnts[axis][b]++;
+                }
+        }
+
+        for (axis = 0; axis < 3 && depth < STL_BVH_MAX_SAH_DEPTH; axis++) {
+                if (scale[axis] == 0) {
+                        continue;
+                }
+
+                /* Everything right of each plane, then sweep from the left */
+                stl_bvh_box_init(&acc);
+                acc_cnt = 0;
+                for (b = bin_cnt - 1; b > 0; b--) {
+                        stl_bvh_box_merge(&acc, &bins[axis][b]);
+                        acc_cnt += bin_cnts[axis][b];
+                        right_boxes[b] = acc;
+                        right_cnts[b] = acc_cnt;
+                }
+
+                stl_bvh_box_init(&acc);
+                acc_cnt = 0;
+                for (b = 0; b < bin_cnt - 1; b++) {
+                        stl_bvh_box_merge(&acc, &bins[axis][b]);
+                        acc_cnt += bin_cnts[axis][b];
+                        if (acc_cnt == 0 || right_cnts[b + 1] == 0) {
+                                continue;
+                        }
+
+                        cost = stl_bvh_box_area(&acc) * acc_cnt +
+                               stl_bvh_box_area(&right_boxes[b + 1]) * right_cnts[b + 1];
+                        if (cost < best_cost) {
+                                best_cost = cost;
+                                best_axis = axis;
+                                best_bin = b;
+                                *left = acc;
+                                *right = right_boxes[b + 1];
+                        }
+                }
+        }
+
+        if (best_axis >= 0) {
+                /* A leaf costs cnt facet tests */
+                if (cnt <= STL_BVH_MAX_LEAF &&
+                    STL_BVH_TRAVERSAL_COST + best_cost / area >= cnt) {
+                        return begin;
+                }
+
+                mid = begin;
+                for (i = begin; i < end; i++) {
+                        b = stl_bvh_bin(stl_bvh_centroid(&refs[i], best_axis),
+                                        centroid_box.min[best_axis], scale[best_axis],
+                                        bin_cnt);
+                        if (b <= best_bin) {
+                                tmp = refs[i];
+                                refs[i] = refs[mid];
+                                refs[mid++] = tmp;
+                        }
+                }
+
+                return mid;
+        }
+
+        /* Too deep, or all centroids in one spot */
+        if (cnt <= STL_BVH_MAX_LEAF && depth < STL_BVH_MAX_SAH_DEPTH) {
+                return begin;
+        }
+
+        mid = begin + cnt / 2;
+        stl_bvh_range_box(build, begin, mid, left);
+        stl_bvh_range_box(build, mid, end, right);
+
+        return mid;
+}
+
+static stl_bvh_node_t *
+stl_bvh_subtree_node(stl_bvh_subtree_t *subtree, STLuint32 index)
+{
+        return index == STL_BVH_ROOT ? &subtree->root : &subtree->list.nodes[index];
+}
+
+/* Append a pair of children, returns the index of the first one */
+static STLuint32
+stl_bvh_push_pair(const stl_allocator_t *allocator, stl_bvh_list_t *list)
+{
+        stl_bvh_node_t *nodes = NULL;
+        STLuint capacity = 0;
+
+        if (list->cnt + 2 > list->capacity) {
+                capacity = list->capacity ? 2 * list->capacity : 256;
+                nodes = (stl_bvh_node_t *)allocator->resize(allocator->ctx, list->nodes,
+                                                            capacity * sizeof(*nodes));
+                if (nodes == NULL) {
+                        return STL_BVH_ROOT;
+                }
+
+                list->nodes = nodes;
+                list->capacity = capacity;
+        }
+
+        list->cnt += 2;
+        return list->cnt - 2;
+}
+
+/*
+ * Split the node of range into a leaf or two children. The children are
+ * returned in children, which is left alone for a leaf. Returns the number
+ * of children, or -1 when out of memory.
+ */
+static int
+stl_bvh_split_node(const stl_bvh_build_t *build, stl_bvh_subtree_t *subtree,
+                   const stl_bvh_range_t *range, stl_bvh_range_t children[2])
+{
+        stl_bvh_node_t *node = stl_bvh_subtree_node(subtree, range->node);
+        stl_bvh_box_t left, right;
+        STLuint32 pair = 0;
+        STLuint mid = stl_bvh_split(build, range->begin, range->end, &node->box,
+                                    range->depth, &left, &right);
+
+        if (mid == range->begin) {
+                node->index = range->begin;
+                node->cnt = range->end - range->begin;
+                return 0;
+        }
+
+        pair = stl_bvh_push_pair(build->allocator, &subtree->list);
+        if (pair == STL_BVH_ROOT) {
+                return -1;
+        }
+
+        node = stl_bvh_subtree_node(subtree, range->node);
+        node->index = pair;
+        node->cnt = 0;
+
+        subtree->list.nodes[pair].box = left;
+        subtree->list.nodes[pair + 1].box = right;
+
+        children[0].node = pair;
+        children[0].begin = range->begin;
+        children[0].end = mid;
+        children[0].depth = range->depth + 1;
+
+        children[1].node = pair + 1;
+        children[1].begin = mid;
+        children[1].end = range->end;
+        children[1].depth = range->depth + 1;
+
+        return 2;
+}
+
+static void
+stl_bvh_build_subtree(const stl_bvh_build_t *build, stl_bvh_subtree_t *subtree)
+{
+        stl_bvh_range_t stack[STL_BVH_STACK_SIZE];
+        stl_bvh_range_t range;
+        int depth = 1, cnt = 0;
+
+        stack[0] = subtree->range;
+        stack[0].node = STL_BVH_ROOT;
+
+        while (depth > 0) {
+                range = stack[--depth];
+                cnt = stl_bvh_split_node(build, subtree, &range, &stack[depth]);
+                if (cnt < 0) {
+                        subtree->err = STL_ERR_MEM;
+                        return;
+                }
+
+                depth += cnt;
+        }
+}
+
+/* Copy the facets of a range of the mesh and collect their boxes */
+static void *
+stl_bvh_facets_worker(void *arg)
+{
+        stl_bvh_job_t *job = (stl_bvh_job_t *)arg;
+        stl_bvh_build_t *build = job->build;
+        STLFloat v[9];
+        STLuint i = 0;
+        int k = 0, axis = 0;
+
+        stl_bvh_box_init(&job->bounds);
+
+        for (i = job->first; i < job->first + job->cnt; i++) {
+                stl_bvh_tri_t *tri = &job->tris[i];
+                stl_bvh_box_t *box = &build->refs[i].box;
+
+                stl_facet_vertices(job->stl, i, v);
+
+                for (axis = 0; axis < 3; axis++) {
+                        tri->v0[axis] = v[axis];
+                        tri->e1[axis] = v[3 + axis] - v[axis];
+                        tri->e2[axis] = v[6 + axis] - v[axis];
+
+                        box->min[axis] = box->max[axis] = v[axis];
+                        for (k = 1; k < 3; k++) {
+                                box->min[axis] = MIN(box->min[axis], v[3 * k + axis]);
+                                box->max[axis] = MAX(box->max[axis], v[3 * k + axis]);
+                        }
+                }
+
+                build->refs[i].facet = i;
+                stl_bvh_box_merge(&job->bounds, box);
+        }
+
+        return NULL;
+}
+
+static void *
+stl_bvh_subtree_worker(void *arg)
+{
+        stl_bvh_job_t *job = (stl_bvh_job_t *)arg;
+        int i = 0;
+
+        while ((i = __atomic_fetch_add(job->next_subtree, 1, __ATOMIC_RELAXED)) <
+               job->subtree_cnt) {
+                stl_bvh_build_subtree(job->build, &job->subtrees[i]);
+        }
+
+        return NULL;
+}
+
+/*
+ * Split the top of the tree, largest range first, until there are enough
+ * ranges for the threads. Returns the number of ranges left in subtrees.
+ */
+static int
+stl_bvh_build_top(const stl_bvh_build_t *build, stl_bvh_subtree_t *top,
+                  stl_bvh_subtree_t *subtrees, int max_cnt, STLuint min_size)
+{
+        stl_bvh_range_t children[2];
+        int cnt = 1, largest = 0, i = 0, k = 0, split = 0;
+
+        subtrees[0].range = top->range;
+        subtrees[0].range.node = STL_BVH_ROOT;
+
+        while (cnt + 1 <= max_cnt) {
+                largest = -1;
+                for (i = 0; i < cnt; i++) {
+                        if (subtrees[i].range.end - subtrees[i].range.begin > min_size &&
+                            (largest < 0 ||
+                             subtrees[i].range.end - subtrees[i].range.begin >
+                             subtrees[largest].range.end - subtrees[largest].range.begin)) {
+                                largest = i;
+                        }
+                }
+
+                if (largest < 0) {
+                        break;
+                }
+
+                split = stl_bvh_split_node(build, top, &subtrees[largest].range, children);
+                if (split < 0) {
+                        top->err = STL_ERR_MEM;
+                        break;
+                }
+
+                /* A leaf at the top needs no subtree of its own */
+                subtrees[largest] = subtrees[--cnt];
+                for (k = 0; k < split; k++) {
+                        subtrees[cnt++].range = children[k];
+                }
+        }
+
+        for (i = 0; i < cnt; i++) {
+                subtrees[i].root = *stl_bvh_subtree_node(top, subtrees[i].range.node);
+                subtrees[i].err = STL_ERR_NONE;
+                memset(&subtrees[i].list, 0, sizeof(subtrees[i].list));
+        }
+
+        return cnt;
+}
+
+/* Move the nodes of a subtree to the end of the top list */
+static stl_error_t
+stl_bvh_append(const stl_allocator_t *allocator, stl_bvh_subtree_t *top,
+               stl_bvh_subtree_t *subtree)
+{
+        STLuint base = top->list.cnt;
+        STLuint i = 0;
+        stl_bvh_node_t *node = NULL;
+
+        for (i = 0; i < subtree->list.cnt; i += 2) {
+                if (stl_bvh_push_pair(allocator, &top->list) == STL_BVH_ROOT) {
+                        return STL_ERR_MEM;
+                }
+        }
+
+        for (i = 0; i < subtree->list.cnt; i++) {
+                node = &top->list.nodes[base + i];
+                *node = subtree->list.nodes[i];
+                if (node->cnt == 0) {
+                        node->index += base;
+                }
+        }
+
+        node = stl_bvh_subtree_node(top, subtree->range.node);
+        *node = subtree->root;
+        if (node->cnt == 0) {
+                node->index += base;
+        }
+
+        return STL_ERR_NONE;
+}
+
+stl_error_t
+stl_bvh_build(stl_t *stl, int thread_cnt, const stl_allocator_t *allocator,
+              stl_bvh_t **result)
+{
+        stl_bvh_job_t jobs[STL_BVH_MAX_THREADS];
+        stl_bvh_subtree_t subtrees[STL_BVH_MAX_THREADS * STL_BVH_SUBTREES_PER_THREAD];
+        stl_bvh_subtree_t top;
+        stl_bvh_build_t build;
+        stl_bvh_tri_t *tris = NULL;
+        stl_bvh_t *bvh = NULL;
+        stl_error_t err = STL_ERR_NONE;
+        STLuint tri_cnt = stl_facet_cnt(stl);
+        STLuint per_job = 0, i = 0;
+        int subtree_cnt = 0, next_subtree = 0;
+
+        thread_cnt = thread_cnt < 1 ? 1 : MIN(thread_cnt, STL_BVH_MAX_THREADS);
+        per_job = (tri_cnt + thread_cnt - 1) / thread_cnt;
+
+        memset(&build, 0, sizeof(build));
+        memset(&top, 0, sizeof(top));
+        build.allocator = allocator;
+
+        bvh = (stl_bvh_t *)stl_bvh_alloc(allocator, sizeof(*bvh));
+        if (bvh == NULL) {
+                return STL_ERR_MEM;
+        }
+
+        memset(bvh, 0, sizeof(*bvh));
+        bvh->allocator = allocator;
+        bvh->tri_cnt = tri_cnt;
+
+        build.refs = (stl_bvh_ref_t *)stl_bvh_alloc(allocator,
+                                (size_t)tri_cnt * sizeof(stl_bvh_ref_t) + 1);
+        tris = (stl_bvh_tri_t *)stl_bvh_alloc(allocator,
+                                (size_t)tri_cnt * sizeof(stl_bvh_tri_t) + 1);
+        bvh->tris = (stl_bvh_tri_t *)stl_bvh_alloc(allocator,
+                                (size_t)tri_cnt * sizeof(stl_bvh_tri_t) + 1);
+        bvh->facets = (STLuint32 *)stl_bvh_alloc(allocator,
+                                (size_t)tri_cnt * sizeof(STLuint32) + 1);
+
+        if (build.refs == NULL || tris == NULL || bvh->tris == NULL || bvh->facets == NULL ||
+            stl_bvh_push_pair(allocator, &top.list) == STL_BVH_ROOT) {
+                err = STL_ERR_MEM;
+                goto done;
+        }
+
+        /* The root is node 0, the pairs of children follow it */
+        top.list.cnt = 1;
+
+        for (i = 0; i < (STLuint)thread_cnt; i++) {
+                memset(&jobs[i], 0, sizeof(jobs[i]));
+                jobs[i].build = &build;
+                jobs[i].stl = stl;
+                jobs[i].tris = tris;
+                jobs[i].first = MIN(tri_cnt, i * per_job);
+                jobs[i].cnt = MIN(tri_cnt - jobs[i].first, per_job);
+        }
+
+        stl_parallel(stl_bvh_facets_worker, jobs, sizeof(jobs[0]), thread_cnt);
+
+        top.root.box = jobs[0].bounds;
+        for (i = 1; i < (STLuint)thread_cnt; i++) {
+                stl_bvh_box_merge(&top.root.box, &jobs[i].bounds);
+        }
+        top.range.begin = 0;
+        top.range.end = tri_cnt;
+
+        subtree_cnt = stl_bvh_build_top(&build, &top, subtrees,
+                                        thread_cnt * STL_BVH_SUBTREES_PER_THREAD,
+                                        thread_cnt > 1 ? tri_cnt / (thread_cnt *
+                                        STL_BVH_SUBTREES_PER_THREAD) : tri_cnt);
+        if (top.err != STL_ERR_NONE) {
+                err = top.err;
+                goto done;
+        }
+
+        for (i = 0; i < (STLuint)thread_cnt; i++) {
+                jobs[i].subtrees = subtrees;
+                jobs[i].subtree_cnt = subtree_cnt;
+                jobs[i].next_subtree = &next_subtree;
+        }
+
+        stl_parallel(stl_bvh_subtree_worker, jobs, sizeof(jobs[0]), thread_cnt);
+
+        for (i = 0; i < (STLuint)subtree_cnt && err == STL_ERR_NONE; i++) {
+                err = subtrees[i].err;
+                if (err == STL_ERR_NONE) {
+                        err = stl_bvh_append(allocator, &top, &subtrees[i]);
+                }
+        }
+
+        if (err != STL_ERR_NONE) {
+                goto done;
+        }
+
+        top.list.nodes[0] = top.root;
+        for (i = 0; i < tri_cnt; i++) {
+                bvh->tris[i] = tris[build.refs[i].facet];
+                bvh->facets[i] = build.refs[i].facet;
+        }
+
+        bvh->nodes = top.list.nodes;
+        bvh->node_cnt = top.list.cnt;
+        top.list.nodes = NULL;
+
+done:
+        for (i = 0; i < (STLuint)subtree_cnt; i++) {
+                stl_bvh_release(allocator, subtrees[i].list.nodes);
+        }
+
+        stl_bvh_release(allocator, top.list.nodes);
+        stl_bvh_release(allocator, build.refs);
+        stl_bvh_release(allocator, tris);
+
+        if (err != STL_ERR_NONE) {
+                stl_bvh_free(bvh);
+                bvh = NULL;
+        }
+
+        *result = bvh;
+        return err;
+}
+
+void
+stl_bvh_free(stl_bvh_t *bvh)
+{
+        if (bvh) {
+                stl_bvh_release(bvh->allocator, bvh->nodes);
+                stl_bvh_release(bvh->allocator, bvh->tris);
+                stl_bvh_release(bvh->allocator, bvh->facets);
+                stl_bvh_release(bvh->allocator, bvh);
+        }
+}
+
+static STLFloat
+stl_bvh_dot(const STLFloat a[3], const STLFloat b[3])
+{
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void
+stl_bvh_cross(const STLFloat a[3], const STLFloat b[3], STLFloat r[3])
+{
+        r[0] = a[1] * b[2] - a[2] * b[1];
+        r[1] = a[2] * b[0] - a[0] * b[2];
+        r[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+/* Distance along the ray to where it enters box, HUGE_VALF when it misses */
+static STLFloat
+stl_bvh_ray_box(const stl_bvh_box_t *box, const STLFloat origin[3],
+                const STLFloat inv_dir[3], STLFloat max_t)
+{
+        STLFloat t0 = 0, t1 = max_t, near = 0, far = 0, tmp = 0;
+        int axis = 0;
+
+        for (axis = 0; axis < 3; axis++) {
+                near = (box->min[axis] - origin[axis]) * inv_dir[axis];
+                far = (box->max[axis] - origin[axis]) * inv_dir[axis];
+                if (near > far) {
+                        tmp = near;
+                        near = far;
+                        far = tmp;
+                }
+
+                /* Written so that a NaN from 0 * inf leaves the bounds alone */
+                t0 = near > t0 ? near : t0;
+                t1 = far < t1 ? far : t1;
+        }
+
+        return t0 <= t1 ? t0 : HUGE_VALF;
+}
+
+/* Moller-Trumbore, both sides of the facet count */
+static int
+stl_bvh_ray_tri(const stl_bvh_tri_t *tri, const STLFloat origin[3],
+                const STLFloat dir[3], STLFloat max_t, stl_hit_t *hit)
+{
+        STLFloat p[3], q[3], s[3];
+        STLFloat det = 0, inv = 0, u = 0, v = 0, t = 0;
+
+        stl_bvh_cross(dir, tri->e2, p);
+        det = stl_bvh_dot(tri->e1, p);
+        if (det == 0) {
+                return 0;
+        }
+
+        inv = 1 / det;
+        s[0] = origin[0] - tri->v0[0];
+        s[1] = origin[1] - tri->v0[1];
+        s[2] = origin[2] - tri->v0[2];
+
+        u = stl_bvh_dot(s, p) * inv;
+        if (!(u >= 0 && u <= 1)) {
+                return 0;
+        }
+
+        stl_bvh_cross(s, tri->e1, q);
+        v = stl_bvh_dot(dir, q) * inv;
+        if (!(v >= 0 && u + v <= 1)) {
+                return 0;
+        }
+
+        t = stl_bvh_dot(tri->e2, q) * inv;
+        if (!(t >= 0 && t < max_t)) {
+                return 0;
+        }
+
+        hit->t = t;
+        hit->u = u;
+        hit->v = v;
+        return 1;
+}
+
+/*
+ * Walk the nodes along a ray, nearer child first. Returns the number of
+ * facets hit before max_t, with all set every facet is counted, otherwise
+ * the ray is shortened to each hit and hit ends up with the closest one.
+ */
+static STLuint
+stl_bvh_trace(const stl_bvh_t *bvh, const STLFloat origin[3], const STLFloat dir[3],
+              STLFloat max_t, stl_hit_t *hit, int all)
+{
+        STLuint32 stack[STL_BVH_STACK_SIZE];
+        STLFloat stack_t[STL_BVH_STACK_SIZE];
+        STLFloat inv_dir[3], t_left = 0, t_right = 0;
+        const stl_bvh_node_t *node = NULL;
+        stl_hit_t candidate;
+        STLuint32 index = 0, i = 0;
+        STLuint cnt = 0;
+        int depth = 0;
+
+        inv_dir[0] = 1 / dir[0];
+        inv_dir[1] = 1 / dir[1];
+        inv_dir[2] = 1 / dir[2];
+
+        if (bvh->tri_cnt == 0 ||
+            stl_bvh_ray_box(&bvh->nodes[0].box, origin, inv_dir, max_t) == HUGE_VALF) {
+                return 0;
+        }
+
+        for (;;) {
+                node = &bvh->nodes[index];
+
+                if (node->cnt) {
+                        for (i = node->index; i < node->index + node->cnt; i++) {
+                                if (!stl_bvh_ray_tri(&bvh->tris[i], origin, dir, max_t,
+                                                     &candidate)) {
+                                        continue;
+                                }
+
+                                cnt++;
+                                if (!all) {
+                                        max_t = candidate.t;
+                                        candidate.facet = bvh->facets[i];
+                                        *hit = candidate;
+                                }
+                        }
+                } else {
+                        t_left = stl_bvh_ray_box(&bvh->nodes[node->index].box,
+                                                 origin, inv_dir, max_t);
+                        t_right = stl_bvh_ray_box(&bvh->nodes[node->index + 1].box,
+                                                  origin, inv_dir, max_t);
+
+                        if (t_left != HUGE_VALF || t_right != HUGE_VALF) {
+                                if (t_left <= t_right) {
+                                        stack[depth] = node->index + 1;
+                                        stack_t[depth] = t_right;
+                                        index = node->index;
+                                } else {
+                                        stack[depth] = node->index;
+                                        stack_t[depth] = t_left;
+                                        index = node->index + 1;
+                                }
+
+                                depth += stack_t[depth] != HUGE_VALF;
+                                continue;
+                        }
+                }
+
+                /* Next node that is still in front of the closest hit */
+                do {
+                        if (depth == 0) {
+                                return cnt;
+                        }
+                        depth--;
+                } while (stack_t[depth] > max_t);
+
+                index = stack[depth];
+        }
+}
+
+int
+stl_bvh_ray(const stl_bvh_t *bvh, const STLFloat origin[3], const STLFloat dir[3],
+            STLFloat max_t, stl_hit_t *hit)
+{
+        hit->t = max_t;
+        hit->u = 0;
+        hit->v = 0;
+        hit->facet = STL_NO_FACET;
+
+        return stl_bvh_trace(bvh, origin, dir, max_t, hit, 0) > 0;
+}
+
+/*
+ * A point is inside when rays from it cross the surface an odd number of
+ * times. Three rays in skewed directions vote, so that a ray grazing an
+ * edge or slipping through a crack of a mesh that is not quite closed is
+ * outvoted.
+ */
+static const STLFloat stl_bvh_inside_dirs[3][3] = {
+        {0.8305f, 0.4117f, 0.3751f},
+        {-0.2903f, 0.8712f, -0.3960f},
+        {0.2139f, -0.3307f, 0.9191f}
+};
+
+int
+stl_bvh_inside(const stl_bvh_t *bvh, const STLFloat point[3])
+{
+        int votes = 0, i = 0;
+
+        for (i = 0; i < 3; i++) {
+                votes += stl_bvh_trace(bvh, point, stl_bvh_inside_dirs[i],
+                                       HUGE_VALF, NULL, 1) & 1;
+        }
+
+        return votes >= 2;
+}
+
+static STLFloat
+stl_bvh_box_dist2(const stl_bvh_box_t *box, const STLFloat p[3])
+{
+        STLFloat d = 0, dist2 = 0;
+        int axis = 0;
+
+        for (axis = 0; axis < 3; axis++) {
+                d = MAX(box->min[axis] - p[axis], p[axis] - box->max[axis]);
+                if (d > 0) {
+                        dist2 += d * d;
+                }
+        }
+
+        return dist2;
+}
+
+static void
+stl_bvh_point_on(const stl_bvh_tri_t *tri, STLFloat v, STLFloat w, STLFloat out[3])
+{
+        int axis = 0;
+
+        for (axis = 0; axis < 3; axis++) {
+                out[axis] = tri->v0[axis] + v * tri->e1[axis] + w * tri->e2[axis];
+        }
+}
+
+/* Closest point to p on the segment from a to a + ab, with its squared distance */
+static STLFloat
+stl_bvh_closest_on_segment(const STLFloat a[3], const STLFloat ab[3],
+                           const STLFloat p[3], STLFloat out[3])
+{
+        STLFloat len2 = stl_bvh_dot(ab, ab), t = 0, d[3];
+        int axis = 0;
+
+        for (axis = 0; axis < 3; axis++) {
+                d[axis] = p[axis] - a[axis];
+        }
+
+        if (len2 > 0) {
+                t = stl_bvh_dot(d, ab) / len2;
+                t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        }
+
+        for (axis = 0; axis < 3; axis++) {
+                out[axis] = a[axis] + t * ab[axis];
+                d[axis] = p[axis] - out[axis];
+        }
+
+        return stl_bvh_dot(d, d);
+}
+
+/* A facet without area is a segment, or a point */
+static void
+stl_bvh_closest_on_degenerate(const stl_bvh_tri_t *tri, const STLFloat p[3],
+                              STLFloat out[3])
+{
+        STLFloat b[3], bc[3], q[3], best = 0, dist2 = 0;
+        int axis = 0;
+
+        for (axis = 0; axis < 3; axis++) {
+                b[axis] = tri->v0[axis] + tri->e1[axis];
+                bc[axis] = tri->e2[axis] - tri->e1[axis];
+        }
+
+        best = stl_bvh_closest_on_segment(tri->v0, tri->e1, p, out);
+
+        dist2 = stl_bvh_closest_on_segment(tri->v0, tri->e2, p, q);
+        if (dist2 < best) {
+                best = dist2;
+                memcpy(out, q, sizeof(q));
+        }
+
+        dist2 = stl_bvh_closest_on_segment(b, bc, p, q);
+        if (dist2 < best) {
+                memcpy(out, q, sizeof(q));
+        }
+}
+
+/*
+ * Closest point of a facet to p, by the Voronoi region of the facet p is
+ * in (Ericson, Real-Time Collision Detection, 5.1.5).
+ */
+static void
+stl_bvh_closest_on_tri(const stl_bvh_tri_t *tri, const STLFloat p[3], STLFloat out[3])
+{
+        STLFloat ap[3], bp[3], cp[3], n[3];
+        STLFloat d1, d2, d3, d4, d5, d6, va, vb, vc, w;
+        int axis = 0;
+
+        stl_bvh_cross(tri->e1, tri->e2, n);
+        if (stl_bvh_dot(n, n) == 0) {
+                stl_bvh_closest_on_degenerate(tri, p, out);
+                return;
+        }
+
+        for (axis = 0; axis < 3; axis++) {
+                ap[axis] = p[axis] - tri->v0[axis];
+                bp[axis] = ap[axis] - tri->e1[axis];
+                cp[axis] = ap[axis] - tri->e2[axis];
+        }
+
+        d1 = stl_bvh_dot(tri->e1, ap);
+        d2 = stl_bvh_dot(tri->e2, ap);
+        if (d1 <= 0 && d2 <= 0) {
+                stl_bvh_point_on(tri, 0, 0, out);
+                return;
+        }
+
+        d3 = stl_bvh_dot(tri->e1, bp);
+        d4 = stl_bvh_dot(tri->e2, bp);
+        if (d3 >= 0 && d4 <= d3) {
+                stl_bvh_point_on(tri, 1, 0, out);
+                return;
+        }
+
+        vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+                stl_bvh_point_on(tri, d1 / (d1 - d3), 0, out);
+                return;
+        }
+
+        d5 = stl_bvh_dot(tri->e1, cp);
+        d6 = stl_bvh_dot(tri->e2, cp);
+        if (d6 >= 0 && d5 <= d6) {
+                stl_bvh_point_on(tri, 0, 1, out);
+                return;
+        }
+
+        vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+                stl_bvh_point_on(tri, 0, d2 / (d2 - d6), out);
+                return;
+        }
+
+        va = d3 * d6 - d5 * d4;
+        if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+                w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+                stl_bvh_point_on(tri, 1 - w, w, out);
+                return;
+        }
+
+        stl_bvh_point_on(tri, vb / (va + vb + vc), vc / (va + vb + vc), out);
+}
+
+STLFloat
+stl_bvh_closest_point(const stl_bvh_t *bvh, const STLFloat point[3],
+                      STLFloat closest[3], STLuint *facet)
+{
+        STLuint32 stack[STL_BVH_STACK_SIZE];
+        STLFloat stack_d[STL_BVH_STACK_SIZE];
+        STLFloat best = HUGE_VALF, d_left = 0, d_right = 0, dist2 = 0;
+        STLFloat p[3], d[3];
+        const stl_bvh_node_t *node = NULL;
+        STLuint32 index = 0, i = 0;
+        int depth = 0;
+
+        if (bvh->tri_cnt == 0) {
+                return -1;
+        }
+
+        for (;;) {
+                node = &bvh->nodes[index];
+
+                if (node->cnt) {
+                        for (i = node->index; i < node->index + node->cnt; i++) {
+                                stl_bvh_closest_on_tri(&bvh->tris[i], point, p);
+                                d[0] = p[0] - point[0];
+                                d[1] = p[1] - point[1];
+                                d[2] = p[2] - point[2];
+                                dist2 = stl_bvh_dot(d, d);
+
+                                if (dist2 < best) {
+                                        best = dist2;
+                                        if (closest) {
+                                                memcpy(closest, p, sizeof(p));
+                                        }
+                                        if (facet) {
+                                                *facet = bvh->facets[i];
+                                        }
+                                }
+                        }
+                } else {
+                        d_left = stl_bvh_box_dist2(&bvh->nodes[node->index].box, point);
+                        d_right = stl_bvh_box_dist2(&bvh->nodes[node->index + 1].box, point);
+
+                        if (d_left <= d_right) {
+                                stack[depth] = node->index + 1;
+                                stack_d[depth] = d_right;
+                                index = node->index;
+                        } else {
+                                stack[depth] = node->index;
+                                stack_d[depth] = d_left;
+                                index = node->index + 1;
+                        }
+
+                        if (MIN(d_left, d_right) < best) {
+                                depth += stack_d[depth] < best;
+                                continue;
+                        }
+                }
+
+                do {
+                        if (depth == 0) {
+                                return sqrtf(best);
+                        }
+                        depth--;
+                } while (stack_d[depth] >= best);
+
+                index = stack[depth];
+        }
+}
+
+/*
+ * Separating axis test of a facet and a box (Akenine-Moller): the box
+ * axes, the normal of the facet and the cross products of the box axes
+ * with the edges of the facet.
+ */
+static int
+stl_bvh_tri_box(const stl_bvh_tri_t *tri, const STLFloat center[3],
+                const STLFloat half[3])
+{
+        STLFloat v[3][3], f[3][3], axis[3], n[3];
+        STLFloat p0, p1, p2, lo, hi, r;
+        int i = 0, j = 0, k = 0;
+
+        for (k = 0; k < 3; k++) {
+                v[0][k] = tri->v0[k] - center[k];
+                v[1][k] = v[0][k] + tri->e1[k];
+                v[2][k] = v[0][k] + tri->e2[k];
+        }
+
+        for (k = 0; k < 3; k++) {
+                lo = MIN(MIN(v[0][k], v[1][k]), v[2][k]);
+                hi = MAX(MAX(v[0][k], v[1][k]), v[2][k]);
+                if (lo > half[k] || hi < -half[k]) {
+                        return 0;
+                }
+        }
+
+        for (k = 0; k < 3; k++) {
+                f[0][k] = v[1][k] - v[0][k];
+                f[1][k] = v[2][k] - v[1][k];
+                f[2][k] = v[0][k] - v[2][k];
+        }
+
+        for (i = 0; i < 3; i++) {
+                for (j = 0; j < 3; j++) {
+                        axis[i] = 0;
+                        axis[(i + 1) % 3] = -f[j][(i + 2) % 3];
+                        axis[(i + 2) % 3] = f[j][(i + 1) % 3];
+
+                        p0 = stl_bvh_dot(axis, v[0]);
+                        p1 = stl_bvh_dot(axis, v[1]);
+                        p2 = stl_bvh_dot(axis, v[2]);
+                        lo = MIN(MIN(p0, p1), p2);
+                        hi = MAX(MAX(p0, p1), p2);
+                        r = half[0] * fabsf(axis[0]) + half[1] * fabsf(axis[1]) +
+                            half[2] * fabsf(axis[2]);
+                        if (lo > r || hi < -r) {
+                                return 0;
+                        }
+                }
+        }
+
+        stl_bvh_cross(tri->e1, tri->e2, n);
+        r = half[0] * fabsf(n[0]) + half[1] * fabsf(n[1]) + half[2] * fabsf(n[2]);
+
+        return fabsf(stl_bvh_dot(n, v[0])) <= r;
+}
+
+static int
+stl_bvh_box_overlap(const stl_bvh_box_t *box, const STLFloat min[3],
+                    const STLFloat max[3])
+{
+        return box->min[0] <= max[0] && box->max[0] >= min[0] &&
+               box->min[1] <= max[1] && box->max[1] >= min[1] &&
+               box->min[2] <= max[2] && box->max[2] >= min[2];
+}
+
+STLuint
+stl_bvh_overlap(const stl_bvh_t *bvh, const STLFloat min[3], const STLFloat max[3],
+                STLuint *facets, STLuint max_cnt)
+{
+        STLuint32 stack[STL_BVH_STACK_SIZE];
+        STLFloat center[3], half[3];
+        const stl_bvh_node_t *node = NULL;
+        STLuint32 i = 0;
+        STLuint cnt = 0;
+        int depth = 0, axis = 0;
+
+        if (bvh->tri_cnt == 0) {
+                return 0;
+        }
+
+        for (axis = 0; axis < 3; axis++) {
+                center[axis] = (min[axis] + max[axis]) / 2;
+                half[axis] = (max[axis] - min[axis]) / 2;
+        }
+
+        stack[depth++] = 0;
+        while (depth > 0) {
+                node = &bvh->nodes[stack[--depth]];
+                if (!stl_bvh_box_overlap(&node->box, min, max)) {
+                        continue;
+                }
+
+                if (node->cnt == 0) {
+                        stack[depth++] = node->index + 1;
+                        stack[depth++] = node->index;
+                        continue;
+                }
+
+                for (i = node->index; i < node->index + node->cnt; i++) {
+                        if (!stl_bvh_tri_box(&bvh->tris[i], center, half)) {
+                                continue;
+                        }
+
+                        if (cnt < max_cnt) {
+                                facets[cnt] = bvh->facets[i];
+                        }
+                        cnt++;
+                }
+        }
+
+        return cnt;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STL_BVH_H_
+#define _STL_BVH_H_
+
+#include "stl.h"
+
+/*
+ * Bounding volume hierarchy over the facets of a mesh. The queries only
+ * read the hierarchy, any number of threads may run them at once.
+ */
+typedef struct stl_bvh_s stl_bvh_t;
+
+stl_error_t stl_bvh_build(stl_t *stl, int thread_cnt,
+                          const stl_allocator_t *allocator, stl_bvh_t **bvh);
+void stl_bvh_free(stl_bvh_t *bvh);
+
+int stl_bvh_ray(const stl_bvh_t *bvh, const STLFloat origin[3],
+                const STLFloat dir[3], STLFloat max_t, stl_hit_t *hit);
+STLFloat stl_bvh_closest_point(const stl_bvh_t *bvh, const STLFloat point[3],
+                               STLFloat closest[3], STLuint *facet);
+int stl_bvh_inside(const stl_bvh_t *bvh, const STLFloat point[3]);
+STLuint stl_bvh_overlap(const stl_bvh_t *bvh, const STLFloat min[3],
+                        const STLFloat max[3], STLuint *facets, STLuint max_cnt);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Converts between ASCII and binary stl files. The input is read with
+ * the stream interface and every batch goes straight to a writer, so
+ * memory use does not depend on the size of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "stl.h"
+
+#define CONVERT_DEFAULT_BATCH 16384
+
+static double
+convert_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+convert_batch(void *arg, const STLFloat *vertices, STLuint facet_cnt)
+{
+        return stl_writer_write((stl_writer_t *)arg, vertices, facet_cnt) !=
+               STL_ERR_NONE;
+}
+
+static off_t
+file_size(const char *filename)
+{
+        struct stat st;
+
+        return stat(filename, &st) == 0 ? st.st_size : 0;
+}
+
+static void
+usage(char *program)
+{
+        fprintf(stderr, "%s [-f ascii|binary] [-b batch facets] <input> <output>\n",
+                program);
+        fprintf(stderr, "Without -f the output is the other format than the input\n");
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        stl_stream_t *stream = NULL;
+        stl_writer_t *writer = NULL;
+        stl_file_type_t type = STL_FILE_TYPE_INVALID;
+        stl_error_t err = STL_ERR_NONE;
+        stl_error_t close_err = STL_ERR_NONE;
+        char *input = NULL, *output = NULL;
+        int batch_size = CONVERT_DEFAULT_BATCH;
+        int opt = 0;
+        double start = 0, elapsed = 0;
+        off_t input_size = 0;
+
+        while ((opt = getopt(argc, argv, "f:b:")) != -1) {
+                switch (opt) {
+                case 'f':
+                        type = strcmp(optarg, "ascii") == 0 ? STL_FILE_TYPE_TXT :
+                               strcmp(optarg, "binary") == 0 ? STL_FILE_TYPE_BIN :
+                               STL_FILE_TYPE_INVALID;
+                        if (type == STL_FILE_TYPE_INVALID) {
+                                usage(argv[0]);
+                        }
+                        break;
+                case 'b':
+                        batch_size = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (argc - optind != 2 || batch_size <= 0) {
+                usage(argv[0]);
+        }
+
+        input = argv[optind];
+        output = argv[optind + 1];
+        start = convert_now();
+        input_size = file_size(input);
+
+        stream = stl_stream_open(input, &err);
+        if (stream == NULL) {
+                fprintf(stderr, "Unable to read %s\n", input);
+                return 1;
+        }
+
+        if (type == STL_FILE_TYPE_INVALID) {
+                type = stl_stream_type(stream) == STL_FILE_TYPE_TXT ?
+                       STL_FILE_TYPE_BIN : STL_FILE_TYPE_TXT;
+        }
+
+        /*
+         * The writer only replaces the output once it is complete, so the
+         * output may even be the input.
+         */
+        writer = stl_writer_open(output, type, &err);
+        if (writer == NULL) {
+                fprintf(stderr, "Unable to create %s\n", output);
+                stl_stream_close(stream);
+                return 1;
+        }
+
+        err = stl_stream_read(stream, batch_size, convert_batch, writer);
+
+        /* A file that could not be read completely leaves the output alone */
+        if (err != STL_ERR_NONE && err != STL_ERR_ABORTED) {
+                fprintf(stderr, "Problem reading %s, check lineno %d\n", input,
+                        stl_stream_lineno(stream));
+                stl_writer_abort(writer);
+        } else if ((close_err = stl_writer_close(writer)) != STL_ERR_NONE ||
+                   err != STL_ERR_NONE) {
+                fprintf(stderr, "Problem writing %s\n", output);
+                err = STL_ERR_LOAD;
+        }
+
+        stl_stream_close(stream);
+
+        if (err != STL_ERR_NONE) {
+                return 1;
+        }
+
+        elapsed = convert_now() - start;
+        fprintf(stderr, "%s (%.1f MB) to %s %s (%.1f MB) in %.2f s, %.1f MB/s\n",
+                input, input_size / 1e6, type == STL_FILE_TYPE_BIN ?
+                "binary" : "ascii", output, file_size(output) / 1e6, elapsed,
+                elapsed > 0 ? input_size / 1e6 / elapsed : 0.0);
+
+        return 0;
+}
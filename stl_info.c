@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Batch analysis of stl files. Prints one row per file, in the order
+ * given, with its facet and vertex counts, bounds, surface area and
+ * volume, as CSV or JSON. The paths come from the command line or, with
+ * none there, one per line from the standard input.
+ *
+ * The files are read with the stl stream interface, so every worker
+ * holds a fixed amount of memory however large its file is. Each worker
+ * starts with its own range of the files and steals half of what is left
+ * of another worker's range once its own runs out, so a few huge files
+ * do not leave the other workers idle. There are twice as many workers
+ * as processors by default so that the disk stays busy while some of
+ * them parse.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "stl.h"
+
+#define INFO_DEFAULT_BATCH 16384
+#define INFO_MAX_PATH 4096
+
+typedef struct {
+        const char *file;
+        stl_file_type_t type;
+        STLuint facet_cnt;
+        STLFloat min[3];
+        STLFloat max[3];
+        double area;
+        double volume;
+        size_t size;
+        stl_error_t err;
+        int lineno;
+        int done;
+} info_result_t;
+
+/* The files a worker has left, [next, end), stolen from at the end */
+typedef struct {
+        pthread_mutex_t lock;
+        size_t next;
+        size_t end;
+} info_range_t;
+
+typedef struct {
+        info_result_t *results;
+        size_t file_cnt;
+        info_range_t *ranges;
+        int worker_cnt;
+        STLuint batch_size;
+        int json;
+        FILE *out;
+        pthread_mutex_t out_lock;
+        size_t out_next;
+} info_job_t;
+
+typedef struct {
+        info_job_t *job;
+        int idx;
+} info_worker_t;
+
+/* Running sums of a file, the volume relative to its first vertex */
+typedef struct {
+        info_result_t *result;
+        double origin[3];
+} info_sums_t;
+
+static double
+info_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Area is half the length of the cross product of two edges, volume the
+ * sum of the signed volumes of the tetrahedra the facets make with the
+ * origin. Moving the origin onto the mesh keeps the terms small, for a
+ * closed mesh the volume does not depend on it.
+ */
+static int
+info_batch(void *arg, const STLFloat *vertices, STLuint facet_cnt)
+{
+        info_sums_t *sums = (info_sums_t *)arg;
+        info_result_t *r = sums->result;
+        double v[3][3], e1[3], e2[3], c[3];
+        STLuint i = 0;
+        int idx = 0, axis = 0;
+
+        if (r->facet_cnt == 0 && facet_cnt > 0) {
+                for (axis = 0; axis < 3; axis++) {
+                        sums->origin[axis] = vertices[axis];
+                        r->min[axis] = r->max[axis] = vertices[axis];
+                }
+        }
+
+        for (i = 0; i < facet_cnt; i++, vertices += 18) {
+                for (idx = 0; idx < 3; idx++) {
+                        for (axis = 0; axis < 3; axis++) {
+                                STLFloat x = vertices[6 * idx + axis];
+
+                                if (x < r->min[axis]) {
+                                        r->min[axis] = x;
+                                }
+                                if (x > r->max[axis]) {
+                                        r->max[axis] = x;
+                                }
+                                v[idx][axis] = x - sums->origin[axis];
+                        }
+                }
+
+                for (axis = 0; axis < 3; axis++) {
+                        e1[axis] = v[1][axis] - v[0][axis];
+                        e2[axis] = v[2][axis] - v[0][axis];
+                }
+
+                c[0] = e1[1] * e2[2] - e1[2] * e2[1];
+                c[1] = e1[2] * e2[0] - e1[0] * e2[2];
+                c[2] = e1[0] * e2[1] - e1[1] * e2[0];
+
+                r->area += 0.5 * sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+
+                /* v0 . (v1 x v2) is v0 . (e1 x e2) */
+                r->volume += (v[0][0] * c[0] + v[0][1] * c[1] + v[0][2] * c[2]) / 6;
+        }
+
+        r->facet_cnt += facet_cnt;
+
+        return 0;
+}
+
+static void
+info_file(info_result_t *r, STLuint batch_size)
+{
+        stl_stream_t *stream = NULL;
+        info_sums_t sums;
+        struct stat st;
+
+        if (stat(r->file, &st) != 0) {
+                r->err = STL_ERR_FOPEN;
+                return;
+        }
+
+        r->size = st.st_size;
+
+        stream = stl_stream_open((char *)r->file, &r->err);
+        if (stream == NULL) {
+                r->type = stl_filetype((char *)r->file, NULL);
+                return;
+        }
+
+        memset(&sums, 0, sizeof(sums));
+        sums.result = r;
+        r->type = stl_stream_type(stream);
+        r->err = stl_stream_read(stream, batch_size, info_batch, &sums);
+        r->lineno = stl_stream_lineno(stream);
+
+        stl_stream_close(stream);
+}
+
+static int
+info_take(info_range_t *range, size_t *file)
+{
+        int taken = 0;
+
+        pthread_mutex_lock(&range->lock);
+        if (range->next < range->end) {
+                *file = range->next++;
+                taken = 1;
+        }
+        pthread_mutex_unlock(&range->lock);
+
+        return taken;
+}
+
+/* Move the back half of another worker's files to this one's range */
+static int
+info_steal(info_job_t *job, int idx)
+{
+        info_range_t *victim = NULL;
+        size_t first = 0, cnt = 0;
+        int i = 0;
+
+        for (i = 1; i < job->worker_cnt && cnt == 0; i++) {
+                victim = &job->ranges[(idx + i) % job->worker_cnt];
+
+                pthread_mutex_lock(&victim->lock);
+                cnt = (victim->end - victim->next + 1) / 2;
+                victim->end -= cnt;
+                first = victim->end;
+                pthread_mutex_unlock(&victim->lock);
+        }
+
+        if (cnt == 0) {
+                return 0;
+        }
+
+        pthread_mutex_lock(&job->ranges[idx].lock);
+        job->ranges[idx].next = first;
+        job->ranges[idx].end = first + cnt;
+        pthread_mutex_unlock(&job->ranges[idx].lock);
+
+        return 1;
+}
+
+static void
+print_string(FILE *fp, const char *str, int json)
+{
+        int quote = json || strpbrk(str, ",\"\n") != NULL;
+
+        if (quote) {
+                fputc('"', fp);
+        }
+
+        for (; *str; str++) {
+                if (*str == '"') {
+                        fputs(json ? "\\\"" : "\"\"", fp);
+                } else if (json && *str == '\\') {
+                        fputs("\\\\", fp);
+                } else if (json && (unsigned char)*str < 0x20) {
+                        fprintf(fp, "\\u%04x", (unsigned char)*str);
+                } else {
+                        fputc(*str, fp);
+                }
+        }
+
+        if (quote) {
+                fputc('"', fp);
+        }
+}
+
+static const char *
+error_str(stl_error_t err)
+{
+        switch (err) {
+        case STL_ERR_FOPEN:
+                return "unable to open";
+        case STL_ERR_FILE_FORMAT:
+                return "invalid file";
+        case STL_ERR_MEM:
+                return "out of memory";
+        case STL_ERR_LOAD:
+                return "read error";
+        default:
+                return "error";
+        }
+}
+
+static void
+print_result(FILE *fp, const info_result_t *r, int json, int first)
+{
+        static const char *names[] = {
+                "min_x", "min_y", "min_z", "max_x", "max_y", "max_z"
+        };
+        const char *type = r->type == STL_FILE_TYPE_BIN ? "binary" :
+                           r->type == STL_FILE_TYPE_TXT ? "ascii" : "invalid";
+        char error[64];
+        int i = 0;
+
+        if (r->err != STL_ERR_NONE) {
+                snprintf(error, sizeof(error), r->lineno ? "%s at line %d" : "%s",
+                         error_str(r->err), r->lineno);
+        }
+
+        if (json) {
+                fprintf(fp, "%s  {\"file\": ", first ? "" : ",\n");
+                print_string(fp, r->file, 1);
+                fprintf(fp, ", \"type\": \"%s\"", type);
+                if (r->err != STL_ERR_NONE) {
+                        fprintf(fp, ", \"error\": \"%s\"}", error);
+                        return;
+                }
+
+                fprintf(fp, ", \"facet_cnt\": %u, \"vertex_cnt\": %u", r->facet_cnt,
+                        3 * r->facet_cnt);
+                for (i = 0; i < 6; i++) {
+                        fprintf(fp, ", \"%s\": %.9g", names[i],
+                                i < 3 ? r->min[i] : r->max[i - 3]);
+                }
+                fprintf(fp, ", \"area\": %.10g, \"volume\": %.10g}", r->area, r->volume);
+                return;
+        }
+
+        print_string(fp, r->file, 0);
+        fprintf(fp, ",%s", type);
+        if (r->err != STL_ERR_NONE) {
+                fprintf(fp, ",,,,,,,,,,,%s\n", error);
+                return;
+        }
+
+        fprintf(fp, ",%u,%u", r->facet_cnt, 3 * r->facet_cnt);
+        for (i = 0; i < 6; i++) {
+                fprintf(fp, ",%.9g", i < 3 ? r->min[i] : r->max[i - 3]);
+        }
+        fprintf(fp, ",%.10g,%.10g,\n", r->area, r->volume);
+}
+
+/* Rows go out in file order as soon as all the rows before them are done */
+static void
+info_done(info_job_t *job, size_t file)
+{
+        pthread_mutex_lock(&job->out_lock);
+
+        job->results[file].done = 1;
+        for (; job->out_next < job->file_cnt && job->results[job->out_next].done;
+             job->out_next++) {
+                print_result(job->out, &job->results[job->out_next], job->json,
+                             job->out_next == 0);
+        }
+
+        pthread_mutex_unlock(&job->out_lock);
+}
+
+static void *
+info_worker(void *arg)
+{
+        info_worker_t *worker = (info_worker_t *)arg;
+        info_job_t *job = worker->job;
+        size_t file = 0;
+
+        for (;;) {
+                if (!info_take(&job->ranges[worker->idx], &file) &&
+                    !(info_steal(job, worker->idx) &&
+                      info_take(&job->ranges[worker->idx], &file))) {
+                        break;
+                }
+
+                info_file(&job->results[file], job->batch_size);
+                info_done(job, file);
+        }
+
+        return NULL;
+}
+
+/* Paths from the standard input, one per line */
+static char **
+read_paths(size_t *cnt)
+{
+        char line[INFO_MAX_PATH];
+        char **paths = NULL, **grown = NULL;
+        size_t capacity = 0, len = 0;
+
+        *cnt = 0;
+        while (fgets(line, sizeof(line), stdin)) {
+                len = strcspn(line, "\r\n");
+                if (len == 0) {
+                        continue;
+                }
+                line[len] = '\0';
+
+                if (*cnt == capacity) {
+                        capacity = capacity ? 2 * capacity : 1024;
+                        grown = (char **)realloc(paths, capacity * sizeof(char *));
+                        if (grown == NULL) {
+                                return NULL;
+                        }
+                        paths = grown;
+                }
+
+                if ((paths[*cnt] = strdup(line)) == NULL) {
+                        return NULL;
+                }
+                (*cnt)++;
+        }
+
+        return paths;
+}
+
+static void
+usage(char *program)
+{
+        fprintf(stderr, "%s [-j threads] [-b batch facets] [-f csv|json] [-o file] "
+                "[stl file ...]\n", program);
+        fprintf(stderr, "Without files the paths are read from the standard input\n");
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        info_job_t job;
+        info_worker_t *workers = NULL;
+        pthread_t *threads = NULL;
+        char **paths = NULL;
+        char *output = NULL;
+        size_t file_cnt = 0, failed = 0, bytes = 0, i = 0;
+        int thread_cnt = 0;
+        int batch_size = INFO_DEFAULT_BATCH;
+        int json = 0;
+        int opt = 0;
+        double start = 0, elapsed = 0;
+
+        while ((opt = getopt(argc, argv, "j:b:f:o:")) != -1) {
+                switch (opt) {
+                case 'j':
+                        thread_cnt = atoi(optarg);
+                        break;
+                case 'b':
+                        batch_size = atoi(optarg);
+                        break;
+                case 'f':
+                        if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0) {
+                                usage(argv[0]);
+                        }
+                        json = strcmp(optarg, "json") == 0;
+                        break;
+                case 'o':
+                        output = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (batch_size <= 0) {
+                usage(argv[0]);
+        }
+
+        if (optind < argc) {
+                paths = &argv[optind];
+                file_cnt = argc - optind;
+        } else if ((paths = read_paths(&file_cnt)) == NULL && file_cnt > 0) {
+                fprintf(stderr, "Unable to allocate memory for the paths\n");
+                exit(1);
+        }
+
+        if (thread_cnt <= 0) {
+                thread_cnt = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if ((size_t)thread_cnt > file_cnt) {
+                thread_cnt = file_cnt ? file_cnt : 1;
+        }
+
+        memset(&job, 0, sizeof(job));
+        job.file_cnt = file_cnt;
+        job.worker_cnt = thread_cnt;
+        job.batch_size = batch_size;
+        job.json = json;
+        job.out = stdout;
+        pthread_mutex_init(&job.out_lock, NULL);
+
+        if (output && (job.out = fopen(output, "w")) == NULL) {
+                fprintf(stderr, "Unable to write %s\n", output);
+                exit(1);
+        }
+
+        job.results = (info_result_t *)calloc(file_cnt ? file_cnt : 1,
+                                              sizeof(info_result_t));
+        job.ranges = (info_range_t *)calloc(thread_cnt, sizeof(info_range_t));
+        workers = (info_worker_t *)calloc(thread_cnt, sizeof(info_worker_t));
+        threads = (pthread_t *)calloc(thread_cnt, sizeof(pthread_t));
+        if (job.results == NULL || job.ranges == NULL || workers == NULL ||
+            threads == NULL) {
+                fprintf(stderr, "Unable to allocate memory for the results\n");
+                exit(1);
+        }
+
+        for (i = 0; i < file_cnt; i++) {
+                job.results[i].file = paths[i];
+        }
+
+        if (json) {
+                fprintf(job.out, "[\n");
+        } else {
+                fprintf(job.out, "file,type,facet_cnt,vertex_cnt,min_x,min_y,min_z,"
+                        "max_x,max_y,max_z,area,volume,error\n");
+        }
+
+        start = info_now();
+
+        for (i = 0; i < (size_t)thread_cnt; i++) {
+                pthread_mutex_init(&job.ranges[i].lock, NULL);
+                job.ranges[i].next = i * file_cnt / thread_cnt;
+                job.ranges[i].end = (i + 1) * file_cnt / thread_cnt;
+                workers[i].job = &job;
+                workers[i].idx = i;
+        }
+
+        for (i = 0; i < (size_t)thread_cnt; i++) {
+                if (pthread_create(&threads[i], NULL, info_worker, &workers[i]) != 0) {
+                        fprintf(stderr, "Unable to start the workers\n");
+                        exit(1);
+                }
+        }
+
+        for (i = 0; i < (size_t)thread_cnt; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        elapsed = info_now() - start;
+
+        if (json) {
+                fprintf(job.out, "%s]\n", file_cnt ? "\n" : "");
+        }
+
+        for (i = 0; i < file_cnt; i++) {
+                failed += job.results[i].err != STL_ERR_NONE;
+                bytes += job.results[i].size;
+        }
+
+        fprintf(stderr, "%zu files, %zu failed, %.1f MB in %.2f s (%.1f MB/s) "
+                "on %d threads\n", file_cnt, failed, bytes / 1e6, elapsed,
+                elapsed > 0 ? bytes / 1e6 / elapsed : 0.0, thread_cnt);
+
+        if (job.out != stdout && fclose(job.out) != 0) {
+                fprintf(stderr, "Unable to write %s\n", output);
+                failed++;
+        }
+
+        return failed ? 1 : 0;
+}
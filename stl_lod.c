@@ -0,0 +1,701 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "stl_lod.h"
+#include "stl_parallel.h"
+
+/*
+ * The simplification runs in passes. Each pass sorts the edges of the
+ * current mesh by the quadric error of collapsing them and then collapses
+ * the cheapest ones, at most one collapse per vertex so that the costs
+ * computed at the start of the pass stay valid. Collapses that would flip
+ * a facet and collapses that remove a vertex on a non manifold edge are
+ * rejected. Open edges get a heavily weighted plane through them at right
+ * angles to their facet, so vertices on a hole or a T-junction slide along
+ * it but hardly ever leave it, and an edge between two such vertices that
+ * is not itself open is never collapsed, which would pinch the mesh.
+ */
+
+#define STL_LOD_MAX_THREADS 64
+
+/* Passes without progress after which the mesh is as simple as it gets */
+#define STL_LOD_MAX_PASSES 256
+
+/* Weight of the plane of an open edge, relative to its squared length */
+#define STL_LOD_BOUNDARY_WEIGHT 100.0
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+#define STL_LOD_RADIX_BITS 16
+#define STL_LOD_RADIX_SIZE (1 << STL_LOD_RADIX_BITS)
+
+/* Symmetric 4x4 matrix of a quadric, a2 ab ac ad b2 bc bd c2 cd d2 */
+typedef struct {
+        double q[10];
+} stl_quadric_t;
+
+typedef struct {
+        unsigned long long key;
+        STLuint32 from;
+        STLuint32 to;
+} stl_lod_edge_t;
+
+typedef struct {
+        const STLFloat *vertices;
+        STLuint vertex_cnt;
+        const stl_allocator_t *allocator;
+
+        STLuint32 *indices;
+        STLuint facet_cnt;
+
+        stl_quadric_t *quadrics;
+        STLuint32 *remap;
+        STLuint8 *locked;
+        STLuint8 *boundary;
+        STLuint32 *adjacency_offsets;
+        STLuint32 *adjacency;
+        stl_lod_edge_t *edges;
+        stl_lod_edge_t *sorted;
+} stl_lod_state_t;
+
+/* Per thread work of a pass, a range of facets or of edges */
+typedef struct {
+        stl_lod_state_t *state;
+        size_t first;
+        size_t cnt;
+} stl_lod_job_t;
+
+static void *
+stl_lod_alloc(stl_lod_state_t *state, size_t size)
+{
+        return state->allocator->alloc(state->allocator->ctx, size);
+}
+
+static void
+stl_lod_release(stl_lod_state_t *state, void *ptr)
+{
+        if (ptr) {
+                state->allocator->release(state->allocator->ctx, ptr);
+        }
+}
+
+static void
+stl_quadric_add_plane(stl_quadric_t *quadric, const double plane[4], double weight)
+{
+        const double a = plane[0], b = plane[1], c = plane[2], d = plane[3];
+
+        quadric->q[0] += weight * a * a;
+        quadric->q[1] += weight * a * b;
+        quadric->q[2] += weight * a * c;
+        quadric->q[3] += weight * a * d;
+        quadric->q[4] += weight * b * b;
+        quadric->q[5] += weight * b * c;
+        quadric->q[6] += weight * b * d;
+        quadric->q[7] += weight * c * c;
+        quadric->q[8] += weight * c * d;
+        quadric->q[9] += weight * d * d;
+}
+
+static void
+stl_quadric_merge(stl_quadric_t *quadric, const stl_quadric_t *other)
+{
+        int i = 0;
+
+        for (i = 0; i < 10; i++) {
+                quadric->q[i] += other->q[i];
+        }
+}
+
+/* Error of the sum of two quadrics at position p */
+static double
+stl_quadric_error(const stl_quadric_t *x, const stl_quadric_t *y, const STLFloat *p)
+{
+        double q[10];
+        double px = p[0], py = p[1], pz = p[2];
+        int i = 0;
+
+        for (i = 0; i < 10; i++) {
+                q[i] = x->q[i] + y->q[i];
+        }
+
+        return q[0] * px * px + 2 * q[1] * px * py + 2 * q[2] * px * pz +
+               2 * q[3] * px + q[4] * py * py + 2 * q[5] * py * pz +
+               2 * q[6] * py + q[7] * pz * pz + 2 * q[8] * pz + q[9];
+}
+
+static void
+stl_lod_cross(const STLFloat *a, const STLFloat *b, const STLFloat *c, double n[3])
+{
+        double ux = b[0] - a[0], uy = b[1] - a[1], uz = b[2] - a[2];
+        double vx = c[0] - a[0], vy = c[1] - a[1], vz = c[2] - a[2];
+
+        n[0] = uy * vz - uz * vy;
+        n[1] = uz * vx - ux * vz;
+        n[2] = ux * vy - uy * vx;
+}
+
+/* Each vertex starts with the planes of its facets weighted by their area */
+static void
+stl_lod_init_quadrics(stl_lod_state_t *state)
+{
+        const STLFloat *v = state->vertices;
+        const STLuint32 *indices = state->indices;
+        double n[3], plane[4], length;
+        STLuint i = 0;
+        int k = 0;
+
+        memset(state->quadrics, 0, state->vertex_cnt * sizeof(stl_quadric_t));
+
+        for (i = 0; i < state->facet_cnt; i++) {
+                const STLFloat *a = &v[3 * (size_t)indices[3 * i]];
+
+                stl_lod_cross(a, &v[3 * (size_t)indices[3 * i + 1]],
+                              &v[3 * (size_t)indices[3 * i + 2]], n);
+                length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                if (!(length > 0)) {
+                        continue;
+                }
+
+                plane[0] = n[0] / length;
+                plane[1] = n[1] / length;
+                plane[2] = n[2] / length;
+                plane[3] = -(plane[0] * a[0] + plane[1] * a[1] + plane[2] * a[2]);
+
+                for (k = 0; k < 3; k++) {
+                        stl_quadric_add_plane(&state->quadrics[indices[3 * i + k]],
+                                              plane, length / 2);
+                }
+        }
+}
+
+/* Sort edges on the low key_bits bits of their key, least significant digit first */
+static void
+stl_lod_radix_sort(stl_lod_edge_t *edges, stl_lod_edge_t *tmp, size_t cnt,
+                   STLuint32 *counts, int key_bits)
+{
+        stl_lod_edge_t *src = edges;
+        stl_lod_edge_t *dst = tmp;
+        stl_lod_edge_t *swap = NULL;
+        size_t i = 0;
+        STLuint32 sum = 0, count = 0;
+        int shift = 0;
+
+        if (cnt == 0) {
+                return;
+        }
+
+        for (shift = 0; shift < key_bits; shift += STL_LOD_RADIX_BITS) {
+                memset(counts, 0, STL_LOD_RADIX_SIZE * sizeof(STLuint32));
+                for (i = 0; i < cnt; i++) {
+                        counts[(src[i].key >> shift) & (STL_LOD_RADIX_SIZE - 1)]++;
+                }
+
+                /* Nothing to do when every key has the same digit */
+                if (counts[(src[0].key >> shift) & (STL_LOD_RADIX_SIZE - 1)] == cnt) {
+                        continue;
+                }
+
+                for (i = 0, sum = 0; i < STL_LOD_RADIX_SIZE; i++) {
+                        count = counts[i];
+                        counts[i] = sum;
+                        sum += count;
+                }
+
+                for (i = 0; i < cnt; i++) {
+                        dst[counts[(src[i].key >> shift) & (STL_LOD_RADIX_SIZE - 1)]++] = src[i];
+                }
+
+                swap = src;
+                src = dst;
+                dst = swap;
+        }
+
+        if (src != edges) {
+                memcpy(edges, src, cnt * sizeof(*edges));
+        }
+}
+
+static void *
+stl_lod_collect_edges(void *arg)
+{
+        stl_lod_job_t *job = (stl_lod_job_t *)arg;
+        const STLuint32 *indices = job->state->indices;
+        stl_lod_edge_t *edge = &job->state->edges[3 * job->first];
+        STLuint32 a, b;
+        size_t i = 0;
+        int k = 0;
+
+        for (i = job->first; i < job->first + job->cnt; i++) {
+                for (k = 0; k < 3; k++, edge++) {
+                        a = indices[3 * i + k];
+                        b = indices[3 * i + (k + 1) % 3];
+                        edge->key = a < b ? ((unsigned long long)a << 32) | b :
+                                            ((unsigned long long)b << 32) | a;
+                        /* The facet, for the plane of an open edge */
+                        edge->from = (STLuint32)i;
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Pick the cheaper direction of each edge. The cost, a non negative
+ * float, becomes the sort key, its bits order like the values.
+ */
+static void *
+stl_lod_edge_costs(void *arg)
+{
+        stl_lod_job_t *job = (stl_lod_job_t *)arg;
+        stl_lod_state_t *state = job->state;
+        stl_lod_edge_t *edge = NULL;
+        const STLFloat *v = state->vertices;
+        double cost_ab, cost_ba;
+        STLuint32 a, b, bits;
+        float cost;
+        size_t i = 0;
+
+        for (i = job->first; i < job->first + job->cnt; i++) {
+                edge = &state->edges[i];
+                a = edge->from;
+                b = edge->to;
+
+                /* An inner edge across a hole would pinch the mesh */
+                if (!edge->key && state->boundary[a] && state->boundary[b]) {
+                        edge->key = 0x7f800000u;
+                        continue;
+                }
+
+                /* A vertex on a non manifold edge stays where it is */
+                cost_ab = state->locked[a] ? HUGE_VAL :
+                          stl_quadric_error(&state->quadrics[a], &state->quadrics[b],
+                                            &v[3 * (size_t)b]);
+                cost_ba = state->locked[b] ? HUGE_VAL :
+                          stl_quadric_error(&state->quadrics[a], &state->quadrics[b],
+                                            &v[3 * (size_t)a]);
+
+                if (cost_ba < cost_ab) {
+                        edge->from = b;
+                        edge->to = a;
+                        cost_ab = cost_ba;
+                }
+
+                cost = cost_ab > 0 ? (float)cost_ab : 0.0f;
+                if (cost_ab == HUGE_VAL) {
+                        cost = HUGE_VALF;
+                }
+
+                memcpy(&bits, &cost, sizeof(bits));
+                edge->key = bits;
+        }
+
+        return NULL;
+}
+
+static void
+stl_lod_run(stl_lod_state_t *state, void *(*worker)(void *), size_t work_cnt,
+            int thread_cnt)
+{
+        stl_lod_job_t jobs[STL_LOD_MAX_THREADS];
+        size_t per_job = (work_cnt + thread_cnt - 1) / thread_cnt;
+        int i = 0;
+
+        for (i = 0; i < thread_cnt; i++) {
+                jobs[i].state = state;
+                jobs[i].first = MIN(work_cnt, i * per_job);
+                jobs[i].cnt = MIN(work_cnt - jobs[i].first, per_job);
+        }
+
+        stl_parallel(worker, jobs, sizeof(jobs[0]), thread_cnt);
+}
+
+/* Facets around every vertex of the current mesh */
+static void
+stl_lod_build_adjacency(stl_lod_state_t *state)
+{
+        STLuint32 *offsets = state->adjacency_offsets;
+        STLuint i = 0;
+
+        memset(offsets, 0, ((size_t)state->vertex_cnt + 1) * sizeof(STLuint32));
+        for (i = 0; i < 3 * state->facet_cnt; i++) {
+                offsets[state->indices[i] + 1]++;
+        }
+
+        for (i = 0; i < state->vertex_cnt; i++) {
+                offsets[i + 1] += offsets[i];
+        }
+
+        for (i = 0; i < 3 * state->facet_cnt; i++) {
+                state->adjacency[offsets[state->indices[i]]++] = i / 3;
+        }
+
+        /* Filling advanced every offset to the start of the next vertex */
+        memmove(offsets + 1, offsets, (size_t)state->vertex_cnt * sizeof(STLuint32));
+        offsets[0] = 0;
+}
+
+/*
+ * Check the facets around from for flips when from moves onto to. Returns
+ * the number of facets the collapse removes, or -1 to reject it.
+ */
+static int
+stl_lod_check_collapse(stl_lod_state_t *state, STLuint32 from, STLuint32 to)
+{
+        const STLFloat *v = state->vertices;
+        const STLFloat *corners[3];
+        const STLFloat *moved[3];
+        STLuint32 first = state->adjacency_offsets[from];
+        STLuint32 last = state->adjacency_offsets[from + 1];
+        STLuint32 corner;
+        double before[3], after[3];
+        int removed = 0;
+        int degenerate = 0;
+        int k = 0;
+
+        for (; first < last; first++) {
+                const STLuint32 *facet = &state->indices[3 * (size_t)state->adjacency[first]];
+
+                degenerate = 0;
+                for (k = 0; k < 3; k++) {
+                        corner = state->remap[facet[k]];
+                        degenerate |= (corner == to);
+                        corners[k] = &v[3 * (size_t)corner];
+                        moved[k] = (facet[k] == from) ? &v[3 * (size_t)to] : corners[k];
+                }
+
+                if (degenerate) {
+                        removed++;
+                        continue;
+                }
+
+                stl_lod_cross(corners[0], corners[1], corners[2], before);
+                stl_lod_cross(moved[0], moved[1], moved[2], after);
+
+                if (before[0] * after[0] + before[1] * after[1] +
+                    before[2] * after[2] <= 0) {
+                        return -1;
+                }
+        }
+
+        return removed;
+}
+
+/*
+ * Mark the vertices of open and of non manifold edges, the edges are
+ * sorted. Until the costs replace it the key of an edge tells whether it
+ * is open.
+ */
+static size_t
+stl_lod_unique_edges(stl_lod_state_t *state, size_t edge_cnt)
+{
+        stl_lod_edge_t *edges = state->edges;
+        size_t unique_cnt = 0;
+        size_t i = 0, j = 0;
+        STLuint32 a, b;
+
+        for (i = 0; i < edge_cnt; i = j) {
+                for (j = i + 1; j < edge_cnt && edges[j].key == edges[i].key; j++) {
+                }
+
+                a = (STLuint32)(edges[i].key >> 32);
+                b = (STLuint32)edges[i].key;
+
+                if (j - i == 1) {
+                        state->boundary[a] = 1;
+                        state->boundary[b] = 1;
+                } else if (j - i != 2) {
+                        state->locked[a] = 1;
+                        state->locked[b] = 1;
+                }
+
+                edges[unique_cnt].key = (j - i == 1);
+                edges[unique_cnt].from = a;
+                edges[unique_cnt].to = b;
+                unique_cnt++;
+        }
+
+        return unique_cnt;
+}
+
+/* Every edge of every facet, sorted so that copies of an edge are adjacent */
+static void
+stl_lod_sorted_edges(stl_lod_state_t *state, int thread_cnt, STLuint32 *counts)
+{
+        stl_lod_run(state, stl_lod_collect_edges, state->facet_cnt, thread_cnt);
+        stl_lod_radix_sort(state->edges, state->sorted, 3 * (size_t)state->facet_cnt,
+                           counts, 64);
+}
+
+/*
+ * Add the plane through each open edge at right angles to its facet to
+ * both ends of the edge, weighted well above the planes of the facets.
+ */
+static void
+stl_lod_boundary_quadrics(stl_lod_state_t *state, int thread_cnt, STLuint32 *counts)
+{
+        const STLFloat *v = state->vertices;
+        stl_lod_edge_t *edges = state->edges;
+        size_t edge_cnt = 3 * (size_t)state->facet_cnt;
+        const STLuint32 *facet = NULL;
+        const STLFloat *pa, *pb;
+        double n[3], plane[4], e[3], length;
+        size_t i = 0, j = 0;
+        STLuint32 a, b, c;
+
+        stl_lod_sorted_edges(state, thread_cnt, counts);
+
+        for (i = 0; i < edge_cnt; i = j) {
+                for (j = i + 1; j < edge_cnt && edges[j].key == edges[i].key; j++) {
+                }
+
+                if (j - i != 1) {
+                        continue;
+                }
+
+                a = (STLuint32)(edges[i].key >> 32);
+                b = (STLuint32)edges[i].key;
+                facet = &state->indices[3 * (size_t)edges[i].from];
+                c = (facet[0] != a && facet[0] != b) ? facet[0] :
+                    (facet[1] != a && facet[1] != b) ? facet[1] : facet[2];
+
+                pa = &v[3 * (size_t)a];
+                pb = &v[3 * (size_t)b];
+                stl_lod_cross(pa, pb, &v[3 * (size_t)c], n);
+                e[0] = pb[0] - pa[0];
+                e[1] = pb[1] - pa[1];
+                e[2] = pb[2] - pa[2];
+
+                plane[0] = e[1] * n[2] - e[2] * n[1];
+                plane[1] = e[2] * n[0] - e[0] * n[2];
+                plane[2] = e[0] * n[1] - e[1] * n[0];
+                length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] +
+                              plane[2] * plane[2]);
+                if (!(length > 0)) {
+                        continue;
+                }
+
+                plane[0] /= length;
+                plane[1] /= length;
+                plane[2] /= length;
+                plane[3] = -(plane[0] * pa[0] + plane[1] * pa[1] + plane[2] * pa[2]);
+
+                length = e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+                stl_quadric_add_plane(&state->quadrics[a], plane,
+                                      STL_LOD_BOUNDARY_WEIGHT * length);
+                stl_quadric_add_plane(&state->quadrics[b], plane,
+                                      STL_LOD_BOUNDARY_WEIGHT * length);
+        }
+}
+
+/* Apply the collapses of a pass and drop the facets they made degenerate */
+static void
+stl_lod_compact(stl_lod_state_t *state)
+{
+        STLuint32 *indices = state->indices;
+        STLuint cnt = 0;
+        STLuint i = 0;
+        STLuint32 a, b, c;
+
+        for (i = 0; i < state->facet_cnt; i++) {
+                a = state->remap[indices[3 * i]];
+                b = state->remap[indices[3 * i + 1]];
+                c = state->remap[indices[3 * i + 2]];
+
+                if (a == b || b == c || a == c) {
+                        continue;
+                }
+
+                indices[3 * cnt] = a;
+                indices[3 * cnt + 1] = b;
+                indices[3 * cnt + 2] = c;
+                cnt++;
+        }
+
+        state->facet_cnt = cnt;
+}
+
+/* One pass of collapses towards target facets, returns the number made */
+static size_t
+stl_lod_pass(stl_lod_state_t *state, STLuint target, int thread_cnt,
+             STLuint32 *counts)
+{
+        size_t edge_cnt = 3 * (size_t)state->facet_cnt;
+        size_t collapse_cnt = 0;
+        STLuint remaining = state->facet_cnt;
+        STLuint32 from, to;
+        size_t i = 0;
+        int removed = 0;
+
+        memset(state->locked, 0, state->vertex_cnt);
+        memset(state->boundary, 0, state->vertex_cnt);
+
+        stl_lod_sorted_edges(state, thread_cnt, counts);
+        edge_cnt = stl_lod_unique_edges(state, edge_cnt);
+
+        stl_lod_run(state, stl_lod_edge_costs, edge_cnt, thread_cnt);
+        stl_lod_radix_sort(state->edges, state->sorted, edge_cnt, counts, 32);
+
+        stl_lod_build_adjacency(state);
+
+        /* Locks now mean "touched in this pass" */
+        memset(state->locked, 0, state->vertex_cnt);
+
+        for (i = 0; i < edge_cnt && remaining > target; i++) {
+                from = state->edges[i].from;
+                to = state->edges[i].to;
+
+                if (state->edges[i].key >= 0x7f800000u) {
+                        break;
+                }
+
+                if (state->locked[from] || state->locked[to]) {
+                        continue;
+                }
+
+                if ((removed = stl_lod_check_collapse(state, from, to)) < 0) {
+                        continue;
+                }
+
+                state->remap[from] = to;
+                stl_quadric_merge(&state->quadrics[to], &state->quadrics[from]);
+                remaining -= MIN((STLuint)removed, remaining);
+
+                state->locked[from] = 1;
+                state->locked[to] = 1;
+                collapse_cnt++;
+        }
+
+        stl_lod_compact(state);
+
+        return collapse_cnt;
+}
+
+stl_error_t
+stl_lod_simplify(const STLFloat *vertices, STLuint vertex_cnt,
+                 const STLuint32 *indices, STLuint facet_cnt,
+                 stl_lod_level_t *levels, int level_cnt,
+                 int thread_cnt, const stl_allocator_t *allocator)
+{
+        stl_lod_state_t state;
+        stl_error_t err = STL_ERR_NONE;
+        STLuint32 *counts = NULL;
+        STLuint target = 0;
+        STLuint i = 0;
+        int level = 0;
+        int passes = 0;
+
+        memset(&state, 0, sizeof(state));
+        state.vertices = vertices;
+        state.vertex_cnt = vertex_cnt;
+        state.facet_cnt = facet_cnt;
+        state.allocator = allocator;
+
+        thread_cnt = thread_cnt < 1 ? 1 : MIN(thread_cnt, STL_LOD_MAX_THREADS);
+
+        state.indices = (STLuint32 *)stl_lod_alloc(&state,
+                                3 * (size_t)facet_cnt * sizeof(STLuint32) + 1);
+        state.quadrics = (stl_quadric_t *)stl_lod_alloc(&state,
+                                (size_t)vertex_cnt * sizeof(stl_quadric_t) + 1);
+        state.remap = (STLuint32 *)stl_lod_alloc(&state,
+                                (size_t)vertex_cnt * sizeof(STLuint32) + 1);
+        state.locked = (STLuint8 *)stl_lod_alloc(&state, (size_t)vertex_cnt + 1);
+        state.boundary = (STLuint8 *)stl_lod_alloc(&state, (size_t)vertex_cnt + 1);
+        state.adjacency_offsets = (STLuint32 *)stl_lod_alloc(&state,
+                                ((size_t)vertex_cnt + 1) * sizeof(STLuint32));
+        state.adjacency = (STLuint32 *)stl_lod_alloc(&state,
+                                3 * (size_t)facet_cnt * sizeof(STLuint32) + 1);
+        state.edges = (stl_lod_edge_t *)stl_lod_alloc(&state,
+                                3 * (size_t)facet_cnt * sizeof(stl_lod_edge_t) + 1);
+        state.sorted = (stl_lod_edge_t *)stl_lod_alloc(&state,
+                                3 * (size_t)facet_cnt * sizeof(stl_lod_edge_t) + 1);
+        counts = (STLuint32 *)stl_lod_alloc(&state,
+                                STL_LOD_RADIX_SIZE * sizeof(STLuint32));
+
+        if (state.indices == NULL || state.quadrics == NULL ||
+            state.remap == NULL || state.locked == NULL || state.boundary == NULL ||
+            state.adjacency_offsets == NULL || state.adjacency == NULL ||
+            state.edges == NULL || state.sorted == NULL || counts == NULL) {
+                err = STL_ERR_MEM;
+                goto done;
+        }
+
+        memcpy(state.indices, indices, 3 * (size_t)facet_cnt * sizeof(STLuint32));
+        for (i = 0; i < vertex_cnt; i++) {
+                state.remap[i] = i;
+        }
+
+        stl_lod_init_quadrics(&state);
+        stl_lod_boundary_quadrics(&state, thread_cnt, counts);
+
+        for (level = 0; level < level_cnt; level++) {
+                target = (STLuint)(levels[level].ratio * facet_cnt);
+
+                for (passes = 0; state.facet_cnt > target &&
+                     passes < STL_LOD_MAX_PASSES; passes++) {
+                        if (stl_lod_pass(&state, target, thread_cnt, counts) == 0) {
+                                break;
+                        }
+                }
+
+                levels[level].facet_cnt = state.facet_cnt;
+                levels[level].indices = (STLuint32 *)stl_lod_alloc(&state,
+                                3 * (size_t)state.facet_cnt * sizeof(STLuint32) + 1);
+                if (levels[level].indices == NULL) {
+                        err = STL_ERR_MEM;
+                        goto done;
+                }
+
+                memcpy(levels[level].indices, state.indices,
+                       3 * (size_t)state.facet_cnt * sizeof(STLuint32));
+        }
+
+done:
+        if (err != STL_ERR_NONE) {
+                for (level = 0; level < level_cnt; level++) {
+                        stl_lod_release(&state, levels[level].indices);
+                        levels[level].indices = NULL;
+                }
+        }
+
+        stl_lod_release(&state, state.indices);
+        stl_lod_release(&state, state.quadrics);
+        stl_lod_release(&state, state.remap);
+        stl_lod_release(&state, state.locked);
+        stl_lod_release(&state, state.boundary);
+        stl_lod_release(&state, state.adjacency_offsets);
+        stl_lod_release(&state, state.adjacency);
+        stl_lod_release(&state, state.edges);
+        stl_lod_release(&state, state.sorted);
+        stl_lod_release(&state, counts);
+
+        return err;
+}
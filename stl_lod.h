@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _STL_LOD_H_
+#define _STL_LOD_H_
+
+#include <stddef.h>
+
+#include "stl.h"
+
+/*
+ * Mesh simplification with quadric error metrics. Vertices are only ever
+ * collapsed into one of their neighbours, so every level indexes into the
+ * vertices of the original mesh.
+ */
+
+typedef struct {
+        STLFloat ratio;
+        STLuint facet_cnt;
+        STLuint32 *indices;
+} stl_lod_level_t;
+
+/*
+ * Simplify the indexed mesh (3 floats per vertex, 3 indices per facet)
+ * down to ratio * facet_cnt facets for each level, the ratios must be
+ * decreasing. The index buffers of the levels come from allocator.
+ */
+stl_error_t stl_lod_simplify(const STLFloat *vertices, STLuint vertex_cnt,
+                             const STLuint32 *indices, STLuint facet_cnt,
+                             stl_lod_level_t *levels, int level_cnt,
+                             int thread_cnt, const stl_allocator_t *allocator);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define STL_NORMALS_X86
+#include <immintrin.h>
+#endif
+
+#include "stl_normals.h"
+
+/* Floats per triangle in the interleaved layout */
+#define STL_TRIANGLE_STRIDE 18
+
+typedef void (*stl_normals_fn)(STLFloat *, size_t);
+
+void
+stl_normal(const STLFloat *v1, const STLFloat *v2, const STLFloat *v3,
+           STLFloat normal[3])
+{
+        STLFloat ux = v2[0] - v1[0];
+        STLFloat uy = v2[1] - v1[1];
+        STLFloat uz = v2[2] - v1[2];
+        STLFloat vx = v3[0] - v1[0];
+        STLFloat vy = v3[1] - v1[1];
+        STLFloat vz = v3[2] - v1[2];
+        STLFloat nx = uy * vz - uz * vy;
+        STLFloat ny = uz * vx - ux * vz;
+        STLFloat nz = ux * vy - uy * vx;
+        STLFloat length2 = nx * nx + ny * ny + nz * nz;
+        STLFloat length;
+
+        if (!(length2 > 0)) {
+                normal[0] = normal[1] = normal[2] = 0;
+                return;
+        }
+
+        length = sqrtf(length2);
+        normal[0] = nx / length;
+        normal[1] = ny / length;
+        normal[2] = nz / length;
+}
+
+static void
+stl_normals_store(STLFloat *triangle, const STLFloat normal[3])
+{
+        memcpy(&triangle[3], normal, 3 * sizeof(STLFloat));
+        memcpy(&triangle[9], normal, 3 * sizeof(STLFloat));
+        memcpy(&triangle[15], normal, 3 * sizeof(STLFloat));
+}
+
+static void
+stl_normals_scalar(STLFloat *vertices, size_t triangle_cnt)
+{
+        STLFloat normal[3];
+        size_t i = 0;
+
+        for (i = 0; i < triangle_cnt; i++) {
+                STLFloat *triangle = &vertices[STL_TRIANGLE_STRIDE * i];
+
+                stl_normal(&triangle[0], &triangle[6], &triangle[12], normal);
+                stl_normals_store(triangle, normal);
+        }
+}
+
+#ifdef STL_NORMALS_X86
+
+/*
+ * The vector kernels below evaluate the same expressions in the same order
+ * as stl_normal, with a true square root and division and without fused
+ * multiply-adds, so their results match it exactly. Each one handles 4, 8
+ * or 16 triangles per iteration and leaves the remainder to the scalar
+ * kernel.
+ */
+
+#define STL_SSE_LOAD(p, off) \
+        _mm_set_ps((p)[3 * STL_TRIANGLE_STRIDE + (off)], \
+                   (p)[2 * STL_TRIANGLE_STRIDE + (off)], \
+                   (p)[STL_TRIANGLE_STRIDE + (off)], (p)[off])
+
+static void
+stl_normals_sse(STLFloat *vertices, size_t triangle_cnt)
+{
+        size_t i = 0;
+        int j = 0;
+        float nx[4], ny[4], nz[4];
+
+        for (i = 0; i + 4 <= triangle_cnt; i += 4) {
+                STLFloat *p = &vertices[STL_TRIANGLE_STRIDE * i];
+
+                __m128 x1 = STL_SSE_LOAD(p, 0), y1 = STL_SSE_LOAD(p, 1), z1 = STL_SSE_LOAD(p, 2);
+                __m128 ux = _mm_sub_ps(STL_SSE_LOAD(p, 6), x1);
+                __m128 uy = _mm_sub_ps(STL_SSE_LOAD(p, 7), y1);
+                __m128 uz = _mm_sub_ps(STL_SSE_LOAD(p, 8), z1);
+                __m128 vx = _mm_sub_ps(STL_SSE_LOAD(p, 12), x1);
+                __m128 vy = _mm_sub_ps(STL_SSE_LOAD(p, 13), y1);
+                __m128 vz = _mm_sub_ps(STL_SSE_LOAD(p, 14), z1);
+
+                __m128 cx = _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(uz, vy));
+                __m128 cy = _mm_sub_ps(_mm_mul_ps(uz, vx), _mm_mul_ps(ux, vz));
+                __m128 cz = _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(uy, vx));
+                __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx),
+                                                       _mm_mul_ps(cy, cy)),
+                                            _mm_mul_ps(cz, cz));
+                __m128 length = _mm_sqrt_ps(length2);
+                __m128 valid = _mm_cmpgt_ps(length2, _mm_setzero_ps());
+
+                _mm_storeu_ps(nx, _mm_and_ps(valid, _mm_div_ps(cx, length)));
+                _mm_storeu_ps(ny, _mm_and_ps(valid, _mm_div_ps(cy, length)));
+                _mm_storeu_ps(nz, _mm_and_ps(valid, _mm_div_ps(cz, length)));
+
+                for (j = 0; j < 4; j++) {
+                        STLFloat normal[3] = {nx[j], ny[j], nz[j]};
+                        stl_normals_store(&p[STL_TRIANGLE_STRIDE * j], normal);
+                }
+        }
+
+        stl_normals_scalar(&vertices[STL_TRIANGLE_STRIDE * i], triangle_cnt - i);
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void
+stl_normals_avx2(STLFloat *vertices, size_t triangle_cnt)
+{
+        const __m256i idx = _mm256_setr_epi32(0, 18, 36, 54, 72, 90, 108, 126);
+        size_t i = 0;
+        int j = 0;
+        float nx[8], ny[8], nz[8];
+
+        for (i = 0; i + 8 <= triangle_cnt; i += 8) {
+                STLFloat *p = &vertices[STL_TRIANGLE_STRIDE * i];
+
+#define STL_AVX2_LOAD(off) _mm256_i32gather_ps(p + (off), idx, 4)
+                __m256 x1 = STL_AVX2_LOAD(0), y1 = STL_AVX2_LOAD(1), z1 = STL_AVX2_LOAD(2);
+                __m256 ux = _mm256_sub_ps(STL_AVX2_LOAD(6), x1);
+                __m256 uy = _mm256_sub_ps(STL_AVX2_LOAD(7), y1);
+                __m256 uz = _mm256_sub_ps(STL_AVX2_LOAD(8), z1);
+                __m256 vx = _mm256_sub_ps(STL_AVX2_LOAD(12), x1);
+                __m256 vy = _mm256_sub_ps(STL_AVX2_LOAD(13), y1);
+                __m256 vz = _mm256_sub_ps(STL_AVX2_LOAD(14), z1);
+#undef STL_AVX2_LOAD
+
+                __m256 cx = _mm256_sub_ps(_mm256_mul_ps(uy, vz), _mm256_mul_ps(uz, vy));
+                __m256 cy = _mm256_sub_ps(_mm256_mul_ps(uz, vx), _mm256_mul_ps(ux, vz));
+                __m256 cz = _mm256_sub_ps(_mm256_mul_ps(ux, vy), _mm256_mul_ps(uy, vx));
+                __m256 length2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, cx),
+                                                             _mm256_mul_ps(cy, cy)),
+                                               _mm256_mul_ps(cz, cz));
+                __m256 length = _mm256_sqrt_ps(length2);
+                __m256 valid = _mm256_cmp_ps(length2, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+                _mm256_storeu_ps(nx, _mm256_and_ps(valid, _mm256_div_ps(cx, length)));
+                _mm256_storeu_ps(ny, _mm256_and_ps(valid, _mm256_div_ps(cy, length)));
+                _mm256_storeu_ps(nz, _mm256_and_ps(valid, _mm256_div_ps(cz, length)));
+
+                for (j = 0; j < 8; j++) {
+                        STLFloat normal[3] = {nx[j], ny[j], nz[j]};
+                        stl_normals_store(&p[STL_TRIANGLE_STRIDE * j], normal);
+                }
+        }
+
+        stl_normals_scalar(&vertices[STL_TRIANGLE_STRIDE * i], triangle_cnt - i);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void
+stl_normals_avx512(STLFloat *vertices, size_t triangle_cnt)
+{
+        const __m512i idx = _mm512_setr_epi32(0, 18, 36, 54, 72, 90, 108, 126,
+                                              144, 162, 180, 198, 216, 234,
+                                              252, 270);
+        size_t i = 0;
+
+        for (i = 0; i + 16 <= triangle_cnt; i += 16) {
+                STLFloat *p = &vertices[STL_TRIANGLE_STRIDE * i];
+
+#define STL_AVX512_LOAD(off) _mm512_i32gather_ps(idx, p + (off), 4)
+                __m512 x1 = STL_AVX512_LOAD(0), y1 = STL_AVX512_LOAD(1), z1 = STL_AVX512_LOAD(2);
+                __m512 ux = _mm512_sub_ps(STL_AVX512_LOAD(6), x1);
+                __m512 uy = _mm512_sub_ps(STL_AVX512_LOAD(7), y1);
+                __m512 uz = _mm512_sub_ps(STL_AVX512_LOAD(8), z1);
+                __m512 vx = _mm512_sub_ps(STL_AVX512_LOAD(12), x1);
+                __m512 vy = _mm512_sub_ps(STL_AVX512_LOAD(13), y1);
+                __m512 vz = _mm512_sub_ps(STL_AVX512_LOAD(14), z1);
+#undef STL_AVX512_LOAD
+
+                __m512 cx = _mm512_sub_ps(_mm512_mul_ps(uy, vz), _mm512_mul_ps(uz, vy));
+                __m512 cy = _mm512_sub_ps(_mm512_mul_ps(uz, vx), _mm512_mul_ps(ux, vz));
+                __m512 cz = _mm512_sub_ps(_mm512_mul_ps(ux, vy), _mm512_mul_ps(uy, vx));
+                __m512 length2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(cx, cx),
+                                                             _mm512_mul_ps(cy, cy)),
+                                               _mm512_mul_ps(cz, cz));
+                __m512 length = _mm512_sqrt_ps(length2);
+                __mmask16 valid = _mm512_cmp_ps_mask(length2, _mm512_setzero_ps(),
+                                                     _CMP_GT_OQ);
+
+                cx = _mm512_maskz_div_ps(valid, cx, length);
+                cy = _mm512_maskz_div_ps(valid, cy, length);
+                cz = _mm512_maskz_div_ps(valid, cz, length);
+
+                _mm512_i32scatter_ps(p + 3, idx, cx, 4);
+                _mm512_i32scatter_ps(p + 4, idx, cy, 4);
+                _mm512_i32scatter_ps(p + 5, idx, cz, 4);
+                _mm512_i32scatter_ps(p + 9, idx, cx, 4);
+                _mm512_i32scatter_ps(p + 10, idx, cy, 4);
+                _mm512_i32scatter_ps(p + 11, idx, cz, 4);
+                _mm512_i32scatter_ps(p + 15, idx, cx, 4);
+                _mm512_i32scatter_ps(p + 16, idx, cy, 4);
+                _mm512_i32scatter_ps(p + 17, idx, cz, 4);
+        }
+
+        stl_normals_scalar(&vertices[STL_TRIANGLE_STRIDE * i], triangle_cnt - i);
+}
+
+#endif
+
+static stl_normals_fn stl_normals_impl = stl_normals_scalar;
+static const char *stl_normals_name = "scalar";
+static pthread_once_t stl_normals_once = PTHREAD_ONCE_INIT;
+
+static void
+stl_normals_select(void)
+{
+#ifdef STL_NORMALS_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f")) {
+                stl_normals_impl = stl_normals_avx512;
+                stl_normals_name = "avx512";
+        } else if (__builtin_cpu_supports("avx2")) {
+                stl_normals_impl = stl_normals_avx2;
+                stl_normals_name = "avx2";
+        } else {
+                stl_normals_impl = stl_normals_sse;
+                stl_normals_name = "sse";
+        }
+#endif
+}
+
+void
+stl_normals_interleaved(STLFloat *vertices, size_t triangle_cnt)
+{
+        pthread_once(&stl_normals_once, stl_normals_select);
+        stl_normals_impl(vertices, triangle_cnt);
+}
+
+const char *
+stl_normals_kernel(void)
+{
+        pthread_once(&stl_normals_once, stl_normals_select);
+        return stl_normals_name;
+}
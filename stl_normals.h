@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _STL_NORMALS_H_
+#define _STL_NORMALS_H_
+
+#include <stddef.h>
+
+#include "stl.h"
+
+/*
+ * Face normal kernels. Degenerate triangles get a zero normal. All the
+ * variants give bit for bit the same results, the fastest one supported
+ * by the CPU is picked at run time.
+ */
+
+/* Normal of the triangle v1, v2, v3 */
+void stl_normal(const STLFloat *v1, const STLFloat *v2, const STLFloat *v3,
+                STLFloat normal[3]);
+
+/*
+ * Compute the normals of triangle_cnt triangles stored as interleaved
+ * position and normal (18 floats per triangle), writing the face normal
+ * to each of the three vertices.
+ */
+void stl_normals_interleaved(STLFloat *vertices, size_t triangle_cnt);
+
+/* Name of the kernel in use, "scalar", "sse", "avx2" or "avx512" */
+const char *stl_normals_kernel(void);
+
+#endif
@@ -0,0 +1,845 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#define STL_RASTER_SSE
+#include <emmintrin.h>
+#endif
+
+#include "stl_raster.h"
+#include "stl_parallel.h"
+
+/*
+ * Triangles are transformed, lit and binned to the tiles they overlap on
+ * every thread, each thread taking a range of the facets into bins of its
+ * own. The tiles are then rasterized in parallel, each by one thread
+ * going through the bins in facet order, so no two threads touch the same
+ * pixel and the image does not depend on the number of threads.
+ *
+ * Coverage is decided by edge functions at the pixel centers, four pixels
+ * at a time. An edge shared by two triangles is evaluated from the same
+ * end point in both, which gives exactly opposite values, and pixels
+ * right on it go to one of them only.
+ */
+
+#define STL_RASTER_MAX_THREADS 64
+
+/* Tile edge in pixels, a multiple of 4 */
+#define STL_RASTER_TILE 64
+
+/* The lights of the viewer, both are white */
+#define STL_RASTER_AMBIENT 0.3f
+#define STL_RASTER_DIFFUSE 0.5f
+/* Specular of the lights times the specular of the material */
+#define STL_RASTER_SPECULAR 0.25f
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* A vertex in window coordinates, with depth from -1 to 1, and its color */
+typedef struct {
+        float x;
+        float y;
+        float z;
+        float rgb[3];
+} stl_raster_vertex_t;
+
+/* A triangle wound counter clockwise and the pixels its box covers */
+typedef struct {
+        stl_raster_vertex_t v[3];
+        int min_x;
+        int min_y;
+        int max_x;
+        int max_y;
+} stl_raster_tri_t;
+
+/*
+ * The triangles binned by one thread. The triangles of tile t are
+ * tris[bins[offsets[t]]] to tris[bins[offsets[t + 1] - 1]].
+ */
+typedef struct {
+        stl_raster_tri_t *tris;
+        size_t tri_cnt;
+        size_t tri_capacity;
+        STLuint32 *bins;
+        size_t bin_capacity;
+        STLuint32 *offsets;
+        size_t offset_capacity;
+} stl_raster_bin_t;
+
+struct stl_raster_s {
+        const stl_allocator_t *allocator;
+        float *depth;
+        size_t depth_capacity;
+        stl_raster_bin_t bins[STL_RASTER_MAX_THREADS];
+};
+
+/* The view of a draw, prepared once */
+typedef struct {
+        const stl_view_t *view;
+        /* Normals are transformed by the inverse transpose of the modelview */
+        float normal_matrix[9];
+        float scale[3];
+        float offset[3];
+        float light[3];
+        float half[3];
+        int width;
+        int height;
+        /* Pixels inside both the viewport and the image, inclusive */
+        int clip[4];
+        int tiles_x;
+        int tile_cnt;
+        STLuint8 *pixels;
+        float *depth;
+        int depth_stride;
+} stl_raster_frame_t;
+
+typedef struct {
+        stl_t *stl;
+        const STLFloat *vertices;
+        const stl_raster_frame_t *frame;
+        const stl_allocator_t *allocator;
+        stl_raster_bin_t *bin;
+        stl_raster_bin_t *bins;
+        int bin_cnt;
+        STLuint first;
+        STLuint cnt;
+        int *next_tile;
+        stl_error_t err;
+} stl_raster_job_t;
+
+/* An edge function, w = sign * (dx * (y - ay) - dy * (x - ax)) */
+typedef struct {
+        float ax;
+        float ay;
+        float dx;
+        float dy;
+        float sign;
+        /* Whether pixels with w = 0 are covered */
+        int tie;
+} stl_raster_edge_t;
+
+/*
+ * A triangle ready to fill. Depth and color are those of vertex 0 plus
+ * their changes towards vertex 1 and 2 times the weights of those.
+ */
+typedef struct {
+        stl_raster_edge_t e[3];
+        float inv_area;
+        float z0;
+        float dz[2];
+        float c0[3];
+        float dc[2][3];
+} stl_raster_setup_t;
+
+static void *
+stl_raster_resize(const stl_allocator_t *allocator, void *ptr, size_t size)
+{
+        return allocator->resize(allocator->ctx, ptr, size);
+}
+
+static void
+stl_raster_release(const stl_allocator_t *allocator, void *ptr)
+{
+        if (ptr) {
+                allocator->release(allocator->ctx, ptr);
+        }
+}
+
+/* Make room for cnt elements of size bytes in *array */
+static int
+stl_raster_reserve(const stl_allocator_t *allocator, void **array,
+                   size_t *capacity, size_t cnt, size_t size)
+{
+        void *grown = NULL;
+        size_t new_capacity = *capacity;
+
+        if (cnt <= *capacity) {
+                return 0;
+        }
+
+        while (new_capacity < cnt) {
+                new_capacity = new_capacity ? 2 * new_capacity : 1024;
+        }
+
+        grown = stl_raster_resize(allocator, *array, new_capacity * size);
+        if (grown == NULL) {
+                return -1;
+        }
+
+        *array = grown;
+        *capacity = new_capacity;
+        return 0;
+}
+
+static float
+stl_raster_dot(const float a[3], const float b[3])
+{
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void
+stl_raster_normalize(float v[3])
+{
+        float length = sqrtf(stl_raster_dot(v, v));
+
+        if (length > 0) {
+                v[0] /= length;
+                v[1] /= length;
+                v[2] /= length;
+        }
+}
+
+static void
+stl_raster_cross(const float a[3], const float b[3], float c[3])
+{
+        c[0] = a[1] * b[2] - a[2] * b[1];
+        c[1] = a[2] * b[0] - a[0] * b[2];
+        c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+/* x to the power of 10, the shininess of the material */
+static float
+stl_raster_shine(float x)
+{
+        float x2 = x * x;
+        float x8 = x2 * x2 * x2 * x2;
+
+        return x8 * x2;
+}
+
+/*
+ * The color of a vertex at eye position pos with eye normal n as the
+ * fixed function pipeline computes it, without two sided lighting
+ */
+static void
+stl_raster_light(const stl_raster_frame_t *frame, const float pos[3],
+                 const float n[3], float rgb[3])
+{
+        float diffuse = 0, specular = 0, d = 0, s = 0;
+        float light[3], half[3];
+        int i = 0;
+
+        /* The first light is at the eye, the viewer is at infinity */
+        light[0] = -pos[0];
+        light[1] = -pos[1];
+        light[2] = -pos[2];
+        stl_raster_normalize(light);
+        half[0] = light[0];
+        half[1] = light[1];
+        half[2] = light[2] + 1;
+        stl_raster_normalize(half);
+
+        d = stl_raster_dot(n, light);
+        if (d > 0) {
+                diffuse += d;
+                s = stl_raster_dot(n, half);
+                specular += s > 0 ? stl_raster_shine(s) : 0;
+        }
+
+        d = stl_raster_dot(n, frame->light);
+        if (d > 0) {
+                diffuse += d;
+                s = stl_raster_dot(n, frame->half);
+                specular += s > 0 ? stl_raster_shine(s) : 0;
+        }
+
+        for (i = 0; i < 3; i++) {
+                rgb[i] = frame->view->color[i] * (2 * STL_RASTER_AMBIENT +
+                         STL_RASTER_DIFFUSE * diffuse) + STL_RASTER_SPECULAR * specular;
+                rgb[i] = MIN(MAX(rgb[i], 0), 1);
+        }
+}
+
+/* Transform, light and bin one facet, vertices and normals 3 floats each */
+static int
+stl_raster_facet(stl_raster_job_t *job, const STLFloat *vertices[3],
+                 const STLFloat *normals[3])
+{
+        const stl_raster_frame_t *frame = job->frame;
+        const STLFloat *m = frame->view->modelview;
+        const float *nm = frame->normal_matrix;
+        stl_raster_bin_t *bin = job->bin;
+        stl_raster_tri_t *tri = NULL;
+        stl_raster_vertex_t swap;
+        float eye[3][3], normal[3], area = 0;
+        float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+        int i = 0, smooth = frame->view->shading == STL_SHADE_SMOOTH;
+
+        if (stl_raster_reserve(job->allocator, (void **)&bin->tris, &bin->tri_capacity,
+                               bin->tri_cnt + 1, sizeof(stl_raster_tri_t)) != 0) {
+                return -1;
+        }
+
+        tri = &bin->tris[bin->tri_cnt];
+        for (i = 0; i < 3; i++) {
+                const STLFloat *p = vertices[i];
+
+                eye[i][0] = m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12];
+                eye[i][1] = m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13];
+                eye[i][2] = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+
+                tri->v[i].x = eye[i][0] * frame->scale[0] + frame->offset[0];
+                tri->v[i].y = eye[i][1] * frame->scale[1] + frame->offset[1];
+                tri->v[i].z = eye[i][2] * frame->scale[2] + frame->offset[2];
+        }
+
+        /* Outside the depth range, or covering no area */
+        if ((tri->v[0].z < -1 && tri->v[1].z < -1 && tri->v[2].z < -1) ||
+            (tri->v[0].z > 1 && tri->v[1].z > 1 && tri->v[2].z > 1)) {
+                return 0;
+        }
+
+        area = (tri->v[1].x - tri->v[0].x) * (tri->v[2].y - tri->v[0].y) -
+               (tri->v[1].y - tri->v[0].y) * (tri->v[2].x - tri->v[0].x);
+        if (!(area > 0 || area < 0)) {
+                return 0;
+        }
+
+        /* The centers of the pixels in the box */
+        min_x = MIN(MIN(tri->v[0].x, tri->v[1].x), tri->v[2].x);
+        min_y = MIN(MIN(tri->v[0].y, tri->v[1].y), tri->v[2].y);
+        max_x = MAX(MAX(tri->v[0].x, tri->v[1].x), tri->v[2].x);
+        max_y = MAX(MAX(tri->v[0].y, tri->v[1].y), tri->v[2].y);
+        min_x = MAX(ceilf(min_x - 0.5f), frame->clip[0]);
+        min_y = MAX(ceilf(min_y - 0.5f), frame->clip[1]);
+        max_x = MIN(floorf(max_x - 0.5f), frame->clip[2]);
+        max_y = MIN(floorf(max_y - 0.5f), frame->clip[3]);
+        if (min_x > max_x || min_y > max_y) {
+                return 0;
+        }
+
+        tri->min_x = min_x;
+        tri->min_y = min_y;
+        tri->max_x = max_x;
+        tri->max_y = max_y;
+
+        /* Flat shading takes the color of the last vertex */
+        for (i = smooth ? 0 : 2; i < 3; i++) {
+                const STLFloat *n = normals[i];
+
+                normal[0] = nm[0] * n[0] + nm[3] * n[1] + nm[6] * n[2];
+                normal[1] = nm[1] * n[0] + nm[4] * n[1] + nm[7] * n[2];
+                normal[2] = nm[2] * n[0] + nm[5] * n[1] + nm[8] * n[2];
+                stl_raster_normalize(normal);
+                stl_raster_light(frame, eye[i], normal, tri->v[i].rgb);
+        }
+        if (!smooth) {
+                memcpy(tri->v[0].rgb, tri->v[2].rgb, sizeof(tri->v[0].rgb));
+                memcpy(tri->v[1].rgb, tri->v[2].rgb, sizeof(tri->v[1].rgb));
+        }
+
+        if (area < 0) {
+                swap = tri->v[1];
+                tri->v[1] = tri->v[2];
+                tri->v[2] = swap;
+        }
+
+        bin->tri_cnt++;
+        return 0;
+}
+
+static void
+stl_raster_tiles(const stl_raster_tri_t *tri, int *x0, int *y0, int *x1, int *y1)
+{
+        *x0 = tri->min_x / STL_RASTER_TILE;
+        *y0 = tri->min_y / STL_RASTER_TILE;
+        *x1 = tri->max_x / STL_RASTER_TILE;
+        *y1 = tri->max_y / STL_RASTER_TILE;
+}
+
+static void *
+stl_raster_bin_worker(void *arg)
+{
+        stl_raster_job_t *job = (stl_raster_job_t *)arg;
+        const stl_raster_frame_t *frame = job->frame;
+        stl_raster_bin_t *bin = job->bin;
+        const STLFloat *vertices[3], *normals[3];
+        STLFloat facet[9], normal[3];
+        STLuint32 *offsets = NULL;
+        size_t cnt = 0, t = 0, i = 0;
+        STLuint f = 0;
+        int x = 0, y = 0, x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+        bin->tri_cnt = 0;
+        if (stl_raster_reserve(job->allocator, (void **)&bin->offsets,
+                               &bin->offset_capacity, frame->tile_cnt + 1,
+                               sizeof(STLuint32)) != 0) {
+                job->err = STL_ERR_MEM;
+                return NULL;
+        }
+
+        for (f = job->first; f < job->first + job->cnt; f++) {
+                if (job->vertices) {
+                        for (i = 0; i < 3; i++) {
+                                vertices[i] = &job->vertices[18 * (size_t)f + 6 * i];
+                                normals[i] = vertices[i] + 3;
+                        }
+                } else {
+                        stl_facet_vertices(job->stl, f, facet);
+                        stl_facet_normal(job->stl, f, normal);
+                        for (i = 0; i < 3; i++) {
+                                vertices[i] = &facet[3 * i];
+                                normals[i] = normal;
+                        }
+                }
+
+                if (stl_raster_facet(job, vertices, normals) != 0) {
+                        job->err = STL_ERR_MEM;
+                        return NULL;
+                }
+        }
+
+        /* Count the triangles of each tile, then place them */
+        offsets = bin->offsets;
+        memset(offsets, 0, (frame->tile_cnt + 1) * sizeof(STLuint32));
+        for (i = 0; i < bin->tri_cnt; i++) {
+                stl_raster_tiles(&bin->tris[i], &x0, &y0, &x1, &y1);
+                for (y = y0; y <= y1; y++) {
+                        for (x = x0; x <= x1; x++) {
+                                offsets[y * frame->tiles_x + x + 1]++;
+                        }
+                }
+        }
+
+        for (t = 0; t < (size_t)frame->tile_cnt; t++) {
+                offsets[t + 1] += offsets[t];
+        }
+
+        cnt = offsets[frame->tile_cnt];
+        if (stl_raster_reserve(job->allocator, (void **)&bin->bins, &bin->bin_capacity,
+                               cnt, sizeof(STLuint32)) != 0) {
+                job->err = STL_ERR_MEM;
+                return NULL;
+        }
+
+        for (i = 0; i < bin->tri_cnt; i++) {
+                stl_raster_tiles(&bin->tris[i], &x0, &y0, &x1, &y1);
+                for (y = y0; y <= y1; y++) {
+                        for (x = x0; x <= x1; x++) {
+                                bin->bins[offsets[y * frame->tiles_x + x]++] = i;
+                        }
+                }
+        }
+
+        /* Placing moved every offset to the start of the next tile */
+        memmove(offsets + 1, offsets, frame->tile_cnt * sizeof(STLuint32));
+        offsets[0] = 0;
+
+        return NULL;
+}
+
+/* The edge from a to b, evaluated from the leftmost of the two */
+static void
+stl_raster_edge(const stl_raster_vertex_t *a, const stl_raster_vertex_t *b,
+                stl_raster_edge_t *edge)
+{
+        const stl_raster_vertex_t *swap = NULL;
+        float a_coef = 0, b_coef = 0;
+
+        edge->sign = 1;
+        if (a->x > b->x || (a->x == b->x && a->y > b->y)) {
+                swap = a;
+                a = b;
+                b = swap;
+                edge->sign = -1;
+        }
+
+        edge->ax = a->x;
+        edge->ay = a->y;
+        edge->dx = b->x - a->x;
+        edge->dy = b->y - a->y;
+
+        /* w = a_coef * x + b_coef * y + c, the tie goes to one side only */
+        a_coef = -edge->sign * edge->dy;
+        b_coef = edge->sign * edge->dx;
+        edge->tie = a_coef > 0 || (a_coef == 0 && b_coef > 0);
+}
+
+static STLuint8
+stl_raster_byte(float c)
+{
+        return (STLuint8)(c * 255 + 0.5f);
+}
+
+#ifdef STL_RASTER_SSE
+
+/* Fill the covered pixels of rows y0 to y1, four pixels at a time */
+static void
+stl_raster_fill(const stl_raster_frame_t *frame, const stl_raster_setup_t *s,
+                int x0, int y0, int x1, int y1)
+{
+        const __m128 lanes = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1);
+        const __m128 minus_one = _mm_set1_ps(-1);
+        const __m128 first = _mm_set1_ps(x0 + 0.5f);
+        const __m128 last = _mm_set1_ps(x1 + 0.5f);
+        __m128 ax[3], dy[3], sign[3], tie[3], row[3], w[3];
+        __m128 px, z, l1, l2, mask, old;
+        float rgb[3][4], py = 0;
+        float *depth = NULL;
+        STLuint8 *pixel = NULL;
+        int x = 0, y = 0, i = 0, c = 0, bits = 0, lane = 0;
+
+        for (i = 0; i < 3; i++) {
+                ax[i] = _mm_set1_ps(s->e[i].ax);
+                dy[i] = _mm_set1_ps(s->e[i].dy);
+                sign[i] = _mm_set1_ps(s->e[i].sign);
+                tie[i] = _mm_castsi128_ps(_mm_set1_epi32(s->e[i].tie ? -1 : 0));
+        }
+
+        for (y = y0; y <= y1; y++) {
+                py = y + 0.5f;
+                for (i = 0; i < 3; i++) {
+                        row[i] = _mm_set1_ps(s->e[i].dx * (py - s->e[i].ay));
+                }
+
+                depth = &frame->depth[(size_t)y * frame->depth_stride];
+                for (x = x0 & ~3; x <= x1; x += 4) {
+                        px = _mm_add_ps(_mm_set1_ps(x), lanes);
+                        mask = _mm_and_ps(_mm_cmpge_ps(px, first), _mm_cmple_ps(px, last));
+
+                        for (i = 0; i < 3; i++) {
+                                w[i] = _mm_mul_ps(_mm_sub_ps(row[i], _mm_mul_ps(dy[i],
+                                                  _mm_sub_ps(px, ax[i]))), sign[i]);
+                                mask = _mm_and_ps(mask, _mm_or_ps(_mm_cmpgt_ps(w[i], zero),
+                                                  _mm_and_ps(_mm_cmpeq_ps(w[i], zero), tie[i])));
+                        }
+                        if (_mm_movemask_ps(mask) == 0) {
+                                continue;
+                        }
+
+                        l1 = _mm_mul_ps(w[1], _mm_set1_ps(s->inv_area));
+                        l2 = _mm_mul_ps(w[2], _mm_set1_ps(s->inv_area));
+                        z = _mm_add_ps(_mm_set1_ps(s->z0),
+                                       _mm_add_ps(_mm_mul_ps(l1, _mm_set1_ps(s->dz[0])),
+                                                  _mm_mul_ps(l2, _mm_set1_ps(s->dz[1]))));
+
+                        old = _mm_loadu_ps(&depth[x]);
+                        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmplt_ps(z, old),
+                                          _mm_and_ps(_mm_cmpge_ps(z, minus_one),
+                                                     _mm_cmple_ps(z, one))));
+                        bits = _mm_movemask_ps(mask);
+                        if (bits == 0) {
+                                continue;
+                        }
+
+                        _mm_storeu_ps(&depth[x], _mm_or_ps(_mm_and_ps(mask, z),
+                                                           _mm_andnot_ps(mask, old)));
+
+                        for (c = 0; c < 3; c++) {
+                                _mm_storeu_ps(rgb[c], _mm_add_ps(_mm_set1_ps(s->c0[c]),
+                                              _mm_add_ps(_mm_mul_ps(l1, _mm_set1_ps(s->dc[0][c])),
+                                                         _mm_mul_ps(l2, _mm_set1_ps(s->dc[1][c])))));
+                        }
+
+                        for (lane = 0; lane < 4; lane++) {
+                                if (bits & (1 << lane)) {
+                                        pixel = &frame->pixels[3 * ((size_t)y * frame->width +
+                                                                    x + lane)];
+                                        pixel[0] = stl_raster_byte(rgb[0][lane]);
+                                        pixel[1] = stl_raster_byte(rgb[1][lane]);
+                                        pixel[2] = stl_raster_byte(rgb[2][lane]);
+                                }
+                        }
+                }
+        }
+}
+
+#else
+
+/* Fill the covered pixels of rows y0 to y1 */
+static void
+stl_raster_fill(const stl_raster_frame_t *frame, const stl_raster_setup_t *s,
+                int x0, int y0, int x1, int y1)
+{
+        float row[3], w[3], px = 0, py = 0, z = 0, l1 = 0, l2 = 0;
+        float *depth = NULL;
+        STLuint8 *pixel = NULL;
+        int x = 0, y = 0, i = 0, c = 0;
+
+        for (y = y0; y <= y1; y++) {
+                py = y + 0.5f;
+                for (i = 0; i < 3; i++) {
+                        row[i] = s->e[i].dx * (py - s->e[i].ay);
+                }
+
+                depth = &frame->depth[(size_t)y * frame->depth_stride];
+                for (x = x0; x <= x1; x++) {
+                        px = x + 0.5f;
+                        for (i = 0; i < 3; i++) {
+                                w[i] = (row[i] - s->e[i].dy * (px - s->e[i].ax)) * s->e[i].sign;
+                                if (!(w[i] > 0 || (w[i] == 0 && s->e[i].tie))) {
+                                        break;
+                                }
+                        }
+                        if (i < 3) {
+                                continue;
+                        }
+
+                        l1 = w[1] * s->inv_area;
+                        l2 = w[2] * s->inv_area;
+                        z = s->z0 + (l1 * s->dz[0] + l2 * s->dz[1]);
+                        if (!(z < depth[x] && z >= -1 && z <= 1)) {
+                                continue;
+                        }
+
+                        depth[x] = z;
+                        pixel = &frame->pixels[3 * ((size_t)y * frame->width + x)];
+                        for (c = 0; c < 3; c++) {
+                                pixel[c] = stl_raster_byte(s->c0[c] + (l1 * s->dc[0][c] +
+                                                                       l2 * s->dc[1][c]));
+                        }
+                }
+        }
+}
+
+#endif
+
+/* Draw the part of tri inside the pixels x0 to x1 and y0 to y1, inclusive */
+static void
+stl_raster_tri(const stl_raster_frame_t *frame, const stl_raster_tri_t *tri,
+               int x0, int y0, int x1, int y1)
+{
+        const stl_raster_vertex_t *v = tri->v;
+        stl_raster_setup_t s;
+        int c = 0;
+
+        x0 = MAX(x0, tri->min_x);
+        y0 = MAX(y0, tri->min_y);
+        x1 = MIN(x1, tri->max_x);
+        y1 = MIN(y1, tri->max_y);
+        if (x0 > x1 || y0 > y1) {
+                return;
+        }
+
+        /* Edge i is opposite vertex i, its weight is that of vertex i */
+        stl_raster_edge(&v[1], &v[2], &s.e[0]);
+        stl_raster_edge(&v[2], &v[0], &s.e[1]);
+        stl_raster_edge(&v[0], &v[1], &s.e[2]);
+
+        s.inv_area = 1 / ((v[1].x - v[0].x) * (v[2].y - v[0].y) -
+                          (v[1].y - v[0].y) * (v[2].x - v[0].x));
+
+        s.z0 = v[0].z;
+        s.dz[0] = v[1].z - v[0].z;
+        s.dz[1] = v[2].z - v[0].z;
+        for (c = 0; c < 3; c++) {
+                s.c0[c] = v[0].rgb[c];
+                s.dc[0][c] = v[1].rgb[c] - v[0].rgb[c];
+                s.dc[1][c] = v[2].rgb[c] - v[0].rgb[c];
+        }
+
+        stl_raster_fill(frame, &s, x0, y0, x1, y1);
+}
+
+
+static void *
+stl_raster_tile_worker(void *arg)
+{
+        stl_raster_job_t *job = (stl_raster_job_t *)arg;
+        const stl_raster_frame_t *frame = job->frame;
+        const stl_raster_bin_t *bin = NULL;
+        STLuint8 background[3];
+        STLuint32 k = 0;
+        int tile = 0, x0 = 0, y0 = 0, x1 = 0, y1 = 0, x = 0, y = 0, b = 0;
+
+        for (b = 0; b < 3; b++) {
+                background[b] = stl_raster_byte(MIN(MAX(frame->view->background[b], 0), 1));
+        }
+
+        while ((tile = __atomic_fetch_add(job->next_tile, 1, __ATOMIC_RELAXED)) <
+               frame->tile_cnt) {
+                x0 = (tile % frame->tiles_x) * STL_RASTER_TILE;
+                y0 = (tile / frame->tiles_x) * STL_RASTER_TILE;
+                x1 = MIN(x0 + STL_RASTER_TILE, frame->width) - 1;
+                y1 = MIN(y0 + STL_RASTER_TILE, frame->height) - 1;
+
+                for (y = y0; y <= y1; y++) {
+                        for (x = x0; x <= x1; x++) {
+                                frame->depth[(size_t)y * frame->depth_stride + x] = 1;
+                                memcpy(&frame->pixels[3 * ((size_t)y * frame->width + x)],
+                                       background, 3);
+                        }
+                }
+
+                for (b = 0; b < job->bin_cnt; b++) {
+                        bin = &job->bins[b];
+                        for (k = bin->offsets[tile]; k < bin->offsets[tile + 1]; k++) {
+                                stl_raster_tri(frame, &bin->tris[bin->bins[k]],
+                                               x0, y0, x1, y1);
+                        }
+                }
+        }
+
+        return NULL;
+}
+
+/* The window transform, normal matrix and second light of view */
+static void
+stl_raster_frame(const stl_view_t *view, int width, int height,
+                 stl_raster_frame_t *frame)
+{
+        const STLFloat *m = view->modelview;
+        const STLFloat *o = view->ortho;
+        const int *vp = view->viewport;
+        float c0[3] = {m[0], m[1], m[2]};
+        float c1[3] = {m[4], m[5], m[6]};
+        float c2[3] = {m[8], m[9], m[10]};
+        float det = 0;
+        int i = 0;
+
+        frame->view = view;
+        frame->width = width;
+        frame->height = height;
+
+        /* Columns of the inverse transpose, up to the scale of the determinant */
+        stl_raster_cross(c1, c2, &frame->normal_matrix[0]);
+        stl_raster_cross(c2, c0, &frame->normal_matrix[3]);
+        stl_raster_cross(c0, c1, &frame->normal_matrix[6]);
+        det = stl_raster_dot(c0, &frame->normal_matrix[0]);
+        if (det < 0) {
+                for (i = 0; i < 9; i++) {
+                        frame->normal_matrix[i] = -frame->normal_matrix[i];
+                }
+        }
+
+        /* Eye coordinates to the viewport as glOrtho and glViewport do */
+        frame->scale[0] = vp[2] / (o[1] - o[0]);
+        frame->offset[0] = vp[0] + vp[2] * 0.5f - (o[1] + o[0]) / (o[1] - o[0]) * vp[2] * 0.5f;
+        frame->scale[1] = vp[3] / (o[3] - o[2]);
+        frame->offset[1] = vp[1] + vp[3] * 0.5f - (o[3] + o[2]) / (o[3] - o[2]) * vp[3] * 0.5f;
+        frame->scale[2] = -2 / (o[5] - o[4]);
+        frame->offset[2] = -(o[5] + o[4]) / (o[5] - o[4]);
+
+        memcpy(frame->light, view->light, sizeof(frame->light));
+        stl_raster_normalize(frame->light);
+        frame->half[0] = frame->light[0];
+        frame->half[1] = frame->light[1];
+        frame->half[2] = frame->light[2] + 1;
+        stl_raster_normalize(frame->half);
+
+        frame->clip[0] = MAX(vp[0], 0);
+        frame->clip[1] = MAX(vp[1], 0);
+        frame->clip[2] = MIN(vp[0] + vp[2], width) - 1;
+        frame->clip[3] = MIN(vp[1] + vp[3], height) - 1;
+
+        frame->tiles_x = (width + STL_RASTER_TILE - 1) / STL_RASTER_TILE;
+        frame->tile_cnt = frame->tiles_x * ((height + STL_RASTER_TILE - 1) / STL_RASTER_TILE);
+        frame->depth_stride = (width + 3) & ~3;
+}
+
+stl_error_t
+stl_raster_draw(stl_t *stl, const stl_view_t *view, int width, int height,
+                STLuint8 *pixels, int thread_cnt, const stl_allocator_t *allocator,
+                stl_raster_t **result)
+{
+        stl_raster_job_t jobs[STL_RASTER_MAX_THREADS];
+        stl_raster_frame_t frame;
+        stl_raster_t *raster = *result;
+        STLFloat *vertices = NULL;
+        STLuint tri_cnt = stl_facet_cnt(stl);
+        STLuint per_job = 0;
+        int next_tile = 0, i = 0;
+
+        if (width <= 0 || height <= 0) {
+                return STL_ERR_INVALID;
+        }
+
+        if (raster == NULL) {
+                raster = (stl_raster_t *)allocator->alloc(allocator->ctx, sizeof(*raster));
+                if (raster == NULL) {
+                        return STL_ERR_MEM;
+                }
+                memset(raster, 0, sizeof(*raster));
+                raster->allocator = allocator;
+                *result = raster;
+        }
+
+        stl_raster_frame(view, width, height, &frame);
+        if (stl_raster_reserve(allocator, (void **)&raster->depth, &raster->depth_capacity,
+                               (size_t)frame.depth_stride * height, sizeof(float)) != 0) {
+                return STL_ERR_MEM;
+        }
+        frame.depth = raster->depth;
+        frame.pixels = pixels;
+
+        /* Meshes that are not interleaved in memory are read facet by facet */
+        if (stl_vertices(stl, &vertices) != STL_ERR_NONE) {
+                vertices = NULL;
+        }
+
+        thread_cnt = thread_cnt < 1 ? 1 : MIN(thread_cnt, STL_RASTER_MAX_THREADS);
+        per_job = (tri_cnt + thread_cnt - 1) / thread_cnt;
+
+        for (i = 0; i < thread_cnt; i++) {
+                memset(&jobs[i], 0, sizeof(jobs[i]));
+                jobs[i].stl = stl;
+                jobs[i].vertices = vertices;
+                jobs[i].frame = &frame;
+                jobs[i].allocator = allocator;
+                jobs[i].bin = &raster->bins[i];
+                jobs[i].bins = raster->bins;
+                jobs[i].bin_cnt = thread_cnt;
+                jobs[i].first = MIN(tri_cnt, i * per_job);
+                jobs[i].cnt = MIN(tri_cnt - jobs[i].first, per_job);
+                jobs[i].next_tile = &next_tile;
+        }
+
+        stl_parallel(stl_raster_bin_worker, jobs, sizeof(jobs[0]), thread_cnt);
+
+        for (i = 0; i < thread_cnt; i++) {
+                if (jobs[i].err != STL_ERR_NONE) {
+                        return jobs[i].err;
+                }
+        }
+
+        stl_parallel(stl_raster_tile_worker, jobs, sizeof(jobs[0]), thread_cnt);
+
+        return STL_ERR_NONE;
+}
+
+void
+stl_raster_free(stl_raster_t *raster)
+{
+        int i = 0;
+
+        if (raster) {
+                for (i = 0; i < STL_RASTER_MAX_THREADS; i++) {
+                        stl_raster_release(raster->allocator, raster->bins[i].tris);
+                        stl_raster_release(raster->allocator, raster->bins[i].bins);
+                        stl_raster_release(raster->allocator, raster->bins[i].offsets);
+                }
+                stl_raster_release(raster->allocator, raster->depth);
+                stl_raster_release(raster->allocator, raster);
+        }
+}
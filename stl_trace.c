@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stl_trace.h"
+
+/*
+ * The events are written in the JSON array format as they happen, a
+ * complete ("X") event per phase with its start and duration in
+ * microseconds since tracing started. The array is closed at exit, and
+ * a trace cut short by a crash still loads as the format allows a
+ * missing end.
+ */
+
+FILE *stl_trace_file = NULL;
+
+static pthread_once_t stl_trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stl_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static double stl_trace_start = 0;
+static int stl_trace_event_cnt = 0;
+static int stl_trace_thread_cnt = 0;
+
+/* Small thread ids, numbered in the order the threads first trace */
+static __thread int stl_trace_tid = 0;
+
+double
+stl_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+stl_trace_close(void)
+{
+        pthread_mutex_lock(&stl_trace_lock);
+        fprintf(stl_trace_file, "\n]\n");
+        fclose(stl_trace_file);
+        stl_trace_file = NULL;
+        pthread_mutex_unlock(&stl_trace_lock);
+}
+
+static void
+stl_trace_open(void)
+{
+        const char *path = getenv("STL_TRACE");
+
+        if (path == NULL || *path == '\0') {
+                return;
+        }
+
+        stl_trace_file = fopen(path, "w");
+        if (stl_trace_file == NULL) {
+                return;
+        }
+
+        stl_trace_start = stl_clock();
+        fprintf(stl_trace_file, "[");
+        atexit(stl_trace_close);
+}
+
+void
+stl_trace_init(void)
+{
+        pthread_once(&stl_trace_once, stl_trace_open);
+}
+
+static void
+stl_trace_string(FILE *fp, const char *str)
+{
+        fputc('"', fp);
+        for (; *str; str++) {
+                if (*str == '"' || *str == '\\') {
+                        fprintf(fp, "\\%c", *str);
+                } else if ((unsigned char)*str < 0x20) {
+                        fprintf(fp, "\\u%04x", (unsigned char)*str);
+                } else {
+                        fputc(*str, fp);
+                }
+        }
+        fputc('"', fp);
+}
+
+void
+stl_trace_event(const char *name, const char *file, double start, double end)
+{
+        if (stl_trace_tid == 0) {
+                stl_trace_tid = __atomic_add_fetch(&stl_trace_thread_cnt, 1,
+                                                   __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&stl_trace_lock);
+
+        if (stl_trace_file) {
+                fprintf(stl_trace_file, "%s\n{\"name\": ", stl_trace_event_cnt++ ? "," : "");
+                stl_trace_string(stl_trace_file, name);
+                fprintf(stl_trace_file, ", \"cat\": \"stl\", \"ph\": \"X\", \"ts\": %.3f, "
+                        "\"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+                        (start - stl_trace_start) * 1e6, (end - start) * 1e6,
+                        (int)getpid(), stl_trace_tid);
+                if (file) {
+                        fprintf(stl_trace_file, ", \"args\": {\"file\": ");
+                        stl_trace_string(stl_trace_file, file);
+                        fprintf(stl_trace_file, "}");
+                }
+                fprintf(stl_trace_file, "}");
+        }
+
+        pthread_mutex_unlock(&stl_trace_lock);
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "stl_txt.h"
+
+/* Largest integer below which every integer is exactly representable */
+#define STL_TXT_FLOAT_EXACT_INT (1 << 24)
+
+/* Longest token handed over to strtof on the slow path */
+#define STL_TXT_FLOAT_MAX_LEN 64
+
+#define STL_TXT_MAX_DIGITS 19
+
+/* Powers of ten that are exactly representable as a float */
+static const STLFloat stl_txt_pow10[] = {
+        1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+        1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+#define STL_TXT_MAX_POW10 \
+        ((int)(sizeof(stl_txt_pow10)/sizeof(stl_txt_pow10[0])) - 1)
+
+static int
+stl_txt_is_space(char c)
+{
+        return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int
+stl_txt_is_digit(char c)
+{
+        return c >= '0' && c <= '9';
+}
+
+const char *
+stl_txt_eol(const char *str, const char *end)
+{
+#ifdef __AVX2__
+        const __m256i nl32 = _mm256_set1_epi8('\n');
+
+        while (end - str >= 32) {
+                __m256i chunk = _mm256_loadu_si256((const __m256i *)str);
+                unsigned int mask = _mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(chunk, nl32));
+
+                if (mask) {
+                        return str + __builtin_ctz(mask);
+                }
+
+                str += 32;
+        }
+#endif
+
+#ifdef __SSE2__
+        const __m128i nl16 = _mm_set1_epi8('\n');
+
+        while (end - str >= 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i *)str);
+                unsigned int mask = _mm_movemask_epi8(
+                        _mm_cmpeq_epi8(chunk, nl16));
+
+                if (mask) {
+                        return str + __builtin_ctz(mask);
+                }
+
+                str += 16;
+        }
+#endif
+
+        while (str < end && *str != '\n') {
+                str++;
+        }
+
+        return str;
+}
+
+const char *
+stl_txt_skip_space(const char *str, const char *end)
+{
+        while (str < end && stl_txt_is_space(*str)) {
+                str++;
+        }
+
+        return str;
+}
+
+const char *
+stl_txt_word_end(const char *str, const char *end)
+{
+        while (str < end && !stl_txt_is_space(*str) && *str != '\n') {
+                str++;
+        }
+
+        return str;
+}
+
+/*
+ * Slow path for numbers that can not be converted exactly with a single
+ * float operation. The token is copied so that it can be NUL terminated
+ * and its decimal point is replaced by the one of the current locale.
+ */
+static int
+stl_txt_float_slow(const char *str, const char *token_end, STLFloat *value)
+{
+        char buffer[STL_TXT_FLOAT_MAX_LEN];
+        char decimal_point = localeconv()->decimal_point[0];
+        size_t len = token_end - str;
+        char *parse_end = NULL;
+        size_t i = 0;
+
+        if (len >= sizeof(buffer)) {
+                return -1;
+        }
+
+        for (i = 0; i < len; i++) {
+                buffer[i] = (str[i] == '.') ? decimal_point : str[i];
+        }
+        buffer[len] = '\0';
+
+        *value = strtof(buffer, &parse_end);
+
+        return (parse_end == buffer + len) ? 0 : -1;
+}
+
+int
+stl_txt_float(const char **str, const char *end, STLFloat *value)
+{
+        const char *p = stl_txt_skip_space(*str, end);
+        const char *start = p;
+        const char *token_end = stl_txt_word_end(p, end);
+        unsigned long long mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        int exp_value = 0;
+        int exp_negative = 0;
+        int negative = 0;
+        int seen_digit = 0;
+        STLFloat result;
+
+        if (p == token_end) {
+                return -1;
+        }
+
+        if (*p == '+' || *p == '-') {
+                negative = (*p == '-');
+                p++;
+        }
+
+        for (; p < token_end && stl_txt_is_digit(*p); p++) {
+                seen_digit = 1;
+                if (mantissa == 0 && *p == '0') {
+                        continue;
+                }
+                if (digits < STL_TXT_MAX_DIGITS) {
+                        mantissa = mantissa * 10 + (*p - '0');
+                        digits++;
+                } else {
+                        exponent++;
+                }
+        }
+
+        if (p < token_end && *p == '.') {
+                for (p++; p < token_end && stl_txt_is_digit(*p); p++) {
+                        seen_digit = 1;
+                        if (mantissa == 0 && *p == '0') {
+                                exponent--;
+                                continue;
+                        }
+                        if (digits < STL_TXT_MAX_DIGITS) {
+                                mantissa = mantissa * 10 + (*p - '0');
+                                digits++;
+                                exponent--;
+                        }
+                }
+        }
+
+        if (!seen_digit) {
+                /* inf, nan, hexadecimal floats... */
+                goto slow;
+        }
+
+        if (p < token_end && (*p == 'e' || *p == 'E')) {
+                p++;
+                if (p < token_end && (*p == '+' || *p == '-')) {
+                        exp_negative = (*p == '-');
+                        p++;
+                }
+
+                if (p == token_end || !stl_txt_is_digit(*p)) {
+                        return -1;
+                }
+
+                for (; p < token_end && stl_txt_is_digit(*p); p++) {
+                        if (exp_value < 10000) {
+                                exp_value = exp_value * 10 + (*p - '0');
+                        }
+                }
+
+                exponent += exp_negative ? -exp_value : exp_value;
+        }
+
+        if (p != token_end) {
+                return -1;
+        }
+
+        if (mantissa == 0) {
+                *value = negative ? -0.0f : 0.0f;
+                goto done;
+        }
+
+        if (digits >= STL_TXT_MAX_DIGITS) {
+                goto slow;
+        }
+
+        while (mantissa % 10 == 0) {
+                mantissa /= 10;
+                exponent++;
+        }
+
+        /*
+         * Both operands are exact so the single multiplication or division
+         * is correctly rounded, which is exactly what strtof returns.
+         */
+        if (mantissa > STL_TXT_FLOAT_EXACT_INT ||
+            exponent > STL_TXT_MAX_POW10 || exponent < -STL_TXT_MAX_POW10) {
+                goto slow;
+        }
+
+        result = (STLFloat)mantissa;
+        if (exponent < 0) {
+                result = result / stl_txt_pow10[-exponent];
+        } else {
+                result = result * stl_txt_pow10[exponent];
+        }
+
+        *value = negative ? -result : result;
+
+done:
+        *str = token_end;
+        return 0;
+
+slow:
+        if (stl_txt_float_slow(start, token_end, value) != 0) {
+                return -1;
+        }
+
+        *str = token_end;
+        return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _STL_TXT_H_
+#define _STL_TXT_H_
+
+#include <stddef.h>
+
+#include "stl.h"
+
+/*
+ * Tokenizer helpers for the ASCII stl parser. All of them work on a
+ * buffer delimited by [str, end) and never look past end, so they can be
+ * run directly on a memory mapped file.
+ */
+
+/* Return a pointer to the next '\n' or end */
+const char *stl_txt_eol(const char *str, const char *end);
+
+/* Skip blanks (space, tab and carriage return) */
+const char *stl_txt_skip_space(const char *str, const char *end);
+
+/* Return a pointer just past the word starting at str */
+const char *stl_txt_word_end(const char *str, const char *end);
+
+/*
+ * Parse a floating point number, skipping any leading blanks. On success
+ * *str is advanced past the number and 0 is returned. The result is
+ * identical to strtof's but does not depend on the locale.
+ */
+int stl_txt_float(const char **str, const char *end, STLFloat *value);
+
+#endif
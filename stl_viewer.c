@@ -29,9 +29,20 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #ifdef _Linux_
+/* Buffer objects are core since OpenGL 1.5 */
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #endif
 
 #ifdef _Darwin_
@@ -55,10 +66,62 @@
 #define MAX_Z_ORTHO_FACTOR 20
 #define ROTATION_FACTOR 15
 
+/* Facets per batch handed from the loader thread to the renderer */
+#define LOAD_BATCH_FACETS 16384
+/* Batches in flight between the loader thread and the renderer */
+#define LOAD_QUEUE_SIZE 64
+/* Batches uploaded per poll of the loader, keeps rotation smooth */
+#define LOAD_BATCHES_PER_FRAME 8
+/* Milliseconds between polls of the loader while it runs */
+#define LOAD_POLL_INTERVAL 10
+/* Models with fewer facets are always drawn at full resolution */
+#define LOD_MIN_FACETS 500000
+/* Facets of the coarse model drawn while rotating */
+#define LOD_MAX_FACETS 250000
+/* Milliseconds between frame statistics reports */
+#define STATS_INTERVAL 1000
+/* Frames shown by the profile overlay, and its histogram of 1 ms buckets */
+#define PROFILE_FRAMES 128
+#define PROFILE_BUCKETS 32
+
+/* Headless mode defaults */
+#define THUMB_DEFAULT_SIZE 256
+#define THUMB_DEFAULT_VIEWS "iso"
+#define THUMB_MAX_VIEWS 16
+#define PNG_STORED_BLOCK 65535
+
+#define LOAD_RUNNING 0
+#define LOAD_DONE 1
+#define LOAD_FAILED 2
+
+typedef struct {
+	GLfloat *vertices;
+	GLuint facet_cnt;
+} batch_t;
+
+/* All the batches of a streamed model in one buffer */
+typedef struct {
+	GLfloat *vertices;
+	GLuint facet_cnt;
+	GLuint capacity;
+} facets_t;
+
+/*
+ * A batch ready to draw, interleaved position and normal per vertex. The
+ * vertices live in a vertex buffer object, or in client memory when the
+ * OpenGL implementation has no buffer objects.
+ */
+typedef struct {
+	GLuint vbo;
+	GLfloat *vertices;
+	GLsizei vertex_cnt;
+} mesh_t;
+
+#define VERTEX_STRIDE (6 * sizeof(GLfloat))
+
 static int rotating = 0;
 static int wiremesh = 0;
 static GLfloat scale = DEFAULT_SCALE;
-static stl_t *stl;
 static float ortho_factor = 1.5;
 static float zoom = DEFAULT_ZOOM;
 
@@ -71,19 +134,324 @@ static float light_diffuse[4] = {0.5, 0.5, 0.5, 1.0};
 static float light_specular[4] = {0.5, 0.5, 0.5, 1.0};
 static float mat_shininess[] = {10.0};
 static float mat_specular[] = { 0.5, 0.5, 0.5, 1.0 };
+static float clear_color[3] = {135.0 / 255.0, 206.0 / 255.0, 250.0 / 255.0};
+static float model_color[3] = {120.0 / 255.0, 120.0 / 255.0, 120.0 / 255.0};
 
 static float rot_cur_quat[4];
 static float rot_last_quat[4];
 static int rot_begin_x = 0;
 static int rot_begin_y = 0;
 
-static GLuint model;
+/*
+ * Batches loaded so far and their bounds as min x, max x, min y, max y,
+ * min z, max z. Until the first batch arrives the view is set up for a
+ * unit cube.
+ */
+static mesh_t *meshes = NULL;
+static int mesh_cnt = 0;
+static int mesh_capacity = 0;
+static int use_vbo = 0;
+static GLfloat bounds[6] = {-1, 1, -1, 1, -1, 1};
+
+/*
+ * Coarse version of the model drawn while the user rotates it, built by
+ * the loader thread once the model is complete and handed over through
+ * load_lod.
+ */
+static const STLFloat lod_ratios[] = {0.5, 0.1, 0.01};
+static mesh_t lod_mesh;
+static int have_lod = 0;
 
+/*
+ * Single producer, single consumer ring of batches from the loader
+ * thread. load_head is only written by the loader and load_tail only by
+ * the renderer, the release/acquire pairs hand over the batch pointers.
+ */
+static char *load_file;
+static batch_t *load_queue[LOAD_QUEUE_SIZE];
+static unsigned int load_head = 0;
+static unsigned int load_tail = 0;
+static int load_state = LOAD_RUNNING;
+static int load_lineno = 0;
+static batch_t *load_lod = NULL;
+
+/*
+ * The bounding volume hierarchy of the loaded model, without the mesh,
+ * handed over by the loader thread for picking facets with the right
+ * mouse button. The
+ * matrices are the ones the model was last drawn with.
+ */
+static stl_t *pick_stl = NULL;
+static GLdouble pick_modelview[16];
+static GLdouble pick_projection[16];
+static GLint pick_viewport[4];
+
+/* Frame statistics, printed every STATS_INTERVAL while enabled with 's' */
+static int show_stats = 0;
+/* Turning the statistics on again outdates the timer still pending */
+static int stats_generation = 0;
+static int stats_frames = 0;
+static double stats_frame_time = 0;
+static double stats_start = 0;
+static double stats_cpu_start = 0;
+
+/*
+ * Frame profile. Every frame records the time spent setting up the
+ * matrices and issuing the draw calls in drawBox, and in the buffer swap,
+ * where a software OpenGL does most of its work. The overlay toggled with
+ * 'p' shows the last PROFILE_FRAMES frames, with -p every frame is also
+ * kept and written to a CSV file on exit. Times are in seconds.
+ */
 typedef struct {
-	GLfloat x;
-	GLfloat y;
-	GLfloat z;
-} vector_t;
+	double time;
+	double frame;
+	double matrix;
+	double draw;
+	double swap;
+	GLuint triangles;
+	int lod;
+} frame_t;
+
+static int show_profile = 0;
+static frame_t profile_frame;
+static frame_t profile_ring[PROFILE_FRAMES];
+static unsigned int profile_cnt = 0;
+static double profile_start = 0;
+static char *profile_csv = NULL;
+static frame_t *profile_log = NULL;
+static size_t profile_log_cnt = 0;
+static size_t profile_log_capacity = 0;
+
+/* Bytes of vertex data of the meshes, in buffer objects or client memory */
+static size_t model_bytes = 0;
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Processor time used by the viewer, all threads included */
+static double
+cpu_seconds(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+	       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void
+stats_reset(void)
+{
+	stats_frames = 0;
+	stats_frame_time = 0;
+	stats_start = now_seconds();
+	stats_cpu_start = cpu_seconds();
+}
+
+static void
+stats_timer(int value)
+{
+	double elapsed = now_seconds() - stats_start;
+
+	if (!show_stats || value != stats_generation) {
+		return;
+	}
+
+	fprintf(stderr, "%d frames in %.1f s, %.2f ms per frame, cpu %.1f%%\n",
+		stats_frames, elapsed,
+		stats_frames ? 1000.0 * stats_frame_time / stats_frames : 0.0,
+		elapsed > 0 ? 100.0 * (cpu_seconds() - stats_cpu_start) / elapsed : 0.0);
+
+	stats_reset();
+	glutTimerFunc(STATS_INTERVAL, stats_timer, value);
+}
+
+static void
+profile_record(const frame_t *frame)
+{
+	frame_t *grown = NULL;
+
+	profile_ring[profile_cnt++ % PROFILE_FRAMES] = *frame;
+
+	if (profile_csv == NULL) {
+		return;
+	}
+
+	if (profile_log_cnt == profile_log_capacity) {
+		profile_log_capacity = profile_log_capacity ? 2 * profile_log_capacity : 1024;
+		grown = (frame_t *)realloc(profile_log,
+					   profile_log_capacity * sizeof(frame_t));
+		if (grown == NULL) {
+			fprintf(stderr, "Unable to allocate memory for the frame profile\n");
+			profile_csv = NULL;
+			return;
+		}
+		profile_log = grown;
+	}
+
+	profile_log[profile_log_cnt++] = *frame;
+}
+
+/* Write the frames kept with -p, registered with atexit */
+static void
+profile_dump(void)
+{
+	FILE *fp = NULL;
+	size_t i = 0;
+
+	if (profile_csv == NULL) {
+		return;
+	}
+
+	fp = fopen(profile_csv, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to write %s: %s\n", profile_csv, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "frame,time_s,frame_ms,matrix_ms,draw_ms,swap_ms,triangles,lod\n");
+	for (i = 0; i < profile_log_cnt; i++) {
+		const frame_t *f = &profile_log[i];
+
+		fprintf(fp, "%zu,%.6f,%.4f,%.4f,%.4f,%.4f,%u,%d\n", i, f->time,
+			1e3 * f->frame, 1e3 * f->matrix, 1e3 * f->draw, 1e3 * f->swap,
+			f->triangles, f->lod);
+	}
+
+	fclose(fp);
+	free(profile_log);
+}
+
+static void
+overlay_text(int x, int y, const char *str)
+{
+	glRasterPos2i(x, y);
+	for (; *str; str++) {
+		glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *str);
+	}
+}
+
+/*
+ * Draw the profile of the last frames over the model in window
+ * coordinates: averages, triangle throughput, memory and a histogram of
+ * the frame times. The frame being drawn is not part of it yet.
+ */
+static void
+profile_overlay(void)
+{
+	int histogram[PROFILE_BUCKETS];
+	double frame = 0, matrix = 0, draw = 0, swap = 0, triangles = 0;
+	const frame_t *f = NULL;
+	const frame_t *oldest = NULL;
+	const frame_t *newest = NULL;
+	struct rusage usage;
+	char line[128];
+	double fps = 0, max_frame = 0;
+	int n = profile_cnt < PROFILE_FRAMES ? profile_cnt : PROFILE_FRAMES;
+	int i = 0, bucket = 0, max_cnt = 1;
+	int x = 10, y = screen_height - 20;
+
+	memset(histogram, 0, sizeof(histogram));
+
+	for (i = 0; i < n; i++) {
+		f = &profile_ring[(profile_cnt - n + i) % PROFILE_FRAMES];
+		frame += f->frame;
+		matrix += f->matrix;
+		draw += f->draw;
+		swap += f->swap;
+		triangles += f->triangles;
+		if (f->frame > max_frame) {
+			max_frame = f->frame;
+		}
+
+		bucket = (int)(1e3 * f->frame);
+		if (bucket >= PROFILE_BUCKETS) {
+			bucket = PROFILE_BUCKETS - 1;
+		}
+		if (++histogram[bucket] > max_cnt) {
+			max_cnt = histogram[bucket];
+		}
+	}
+
+	if (n > 1) {
+		oldest = &profile_ring[(profile_cnt - n) % PROFILE_FRAMES];
+		newest = &profile_ring[(profile_cnt - 1) % PROFILE_FRAMES];
+		if (newest->time > oldest->time) {
+			fps = (n - 1) / (newest->time - oldest->time);
+		}
+	}
+	n = n ? n : 1;
+	getrusage(RUSAGE_SELF, &usage);
+
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_VIEWPORT_BIT | GL_POLYGON_BIT |
+		     GL_COLOR_BUFFER_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	glViewport(0, 0, screen_width, screen_height);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(0, screen_width, 0, screen_height, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glColor4f(0.1, 0.1, 0.1, 0.6);
+	glRecti(x - 5, y + 17, x + 5 + 8 * 48, y - 144);
+	glDisable(GL_BLEND);
+
+	glColor3f(1, 1, 1);
+	snprintf(line, sizeof(line), "%.1f fps, frame %.2f ms, max %.2f ms", fps,
+		 1e3 * frame / n, 1e3 * max_frame);
+	overlay_text(x, y, line);
+	snprintf(line, sizeof(line), "matrix %.3f ms, draw %.3f ms, swap %.3f ms",
+		 1e3 * matrix / n, 1e3 * draw / n, 1e3 * swap / n);
+	overlay_text(x, y - 15, line);
+	snprintf(line, sizeof(line), "%.0f triangles%s, %.1f M triangles/s",
+		 triangles / n, rotating && have_lod ? " (lod)" : "",
+		 frame > 0 ? triangles / frame / 1e6 : 0.0);
+	overlay_text(x, y - 30, line);
+#ifdef _Darwin_
+	snprintf(line, sizeof(line), "model %.1f MB, peak rss %.1f MB",
+		 model_bytes / 1e6, usage.ru_maxrss / 1e6);
+#else
+	snprintf(line, sizeof(line), "model %.1f MB, peak rss %.1f MB",
+		 model_bytes / 1e6, usage.ru_maxrss / 1e3);
+#endif
+	overlay_text(x, y - 45, line);
+
+	/*
+	 * One bar per ms bucket, the last one holds all slower frames. Frames
+	 * that miss 60 Hz are red.
+	 */
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		int height = 64 * histogram[i] / max_cnt;
+
+		glColor3f(i < 17 ? 0.3 : 0.9, i < 17 ? 0.9 : 0.3, 0.3);
+		glRecti(x + 11 * i, y - 124, x + 11 * i + 9, y - 124 + height);
+	}
+
+	glColor3f(1, 1, 1);
+	overlay_text(x, y - 139, "0 ms");
+	snprintf(line, sizeof(line), "%d+ ms", PROFILE_BUCKETS - 1);
+	overlay_text(x + 11 * (PROFILE_BUCKETS - 1) - 32, y - 139, line);
+
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopAttrib();
+}
 
 static void 
 mouse_motion(int x, int y) 
@@ -97,9 +465,51 @@ mouse_motion(int x, int y)
                 rot_begin_x = x;
                 rot_begin_y = y;
                 add_quats(rot_last_quat, rot_cur_quat, rot_cur_quat);
+                glutPostRedisplay();
         }
 }
 
+/* Report the facet under the mouse */
+static void
+pick(int x, int y)
+{
+	stl_t *stl = __atomic_load_n(&pick_stl, __ATOMIC_ACQUIRE);
+	GLdouble near[3], far[3];
+	STLFloat origin[3], dir[3], point[3];
+	stl_hit_t hit;
+	int axis = 0;
+
+	if (stl == NULL) {
+		fprintf(stderr, "Picking is available once the model is loaded\n");
+		return;
+	}
+
+	y = screen_height - y;
+	if (gluUnProject(x, y, 0, pick_modelview, pick_projection, pick_viewport,
+			 &near[0], &near[1], &near[2]) != GL_TRUE ||
+	    gluUnProject(x, y, 1, pick_modelview, pick_projection, pick_viewport,
+			 &far[0], &far[1], &far[2]) != GL_TRUE) {
+		return;
+	}
+
+	for (axis = 0; axis < 3; axis++) {
+		origin[axis] = near[axis];
+		dir[axis] = far[axis] - near[axis];
+	}
+
+	if (!stl_intersect_ray(stl, origin, dir, 1, &hit)) {
+		fprintf(stderr, "No facet under the mouse\n");
+		return;
+	}
+
+	for (axis = 0; axis < 3; axis++) {
+		point[axis] = origin[axis] + hit.t * dir[axis];
+	}
+
+	fprintf(stderr, "Facet %u at %f %f %f\n", hit.facet, point[0], point[1],
+		point[2]);
+}
+
 static void
 mouse_click(int button, int state, int x, int y) 
 {
@@ -109,8 +519,14 @@ mouse_click(int button, int state, int x, int y)
                 rot_begin_y = y;
         }
 
+        /* Back to full resolution */
         if (button == GLUT_LEFT_BUTTON && state == GLUT_UP) {
                 rotating = 0;
+                glutPostRedisplay();
+        }
+
+        if (button == GLUT_RIGHT_BUTTON && state == GLUT_DOWN) {
+                pick(x, y);
         }
 }
 
@@ -142,6 +558,19 @@ keyboardFunc(unsigned char key, int x, int y)
                         trackball(rot_cur_quat, 0.0, 0.0, 0.0, 0.0);
                         zoom = DEFAULT_ZOOM;
                         break;
+		case 's':
+                case 'S':
+                        show_stats = !show_stats;
+                        if (show_stats) {
+                                stats_reset();
+                                glutTimerFunc(STATS_INTERVAL, stats_timer,
+                                              ++stats_generation);
+                        }
+                        break;
+		case 'p':
+                case 'P':
+                        show_profile = !show_profile;
+                        break;
 		case 'q':
                 case 'Q':
 			exit(0);
@@ -150,6 +579,8 @@ keyboardFunc(unsigned char key, int x, int y)
 			break;
 
 	}
+
+	glutPostRedisplay();
 }
 
 static void
@@ -157,22 +588,23 @@ ortho_dimensions(GLfloat *min_x, GLfloat *max_x,
                 GLfloat *min_y, GLfloat *max_y,
                 GLfloat *min_z, GLfloat *max_z)
 {
-	GLfloat diff_x = stl_max_x(stl) - stl_min_x(stl);
-	GLfloat diff_y = stl_max_y(stl) - stl_min_y(stl);
-	GLfloat diff_z = stl_max_z(stl) - stl_min_z(stl);
+	GLfloat diff_x = bounds[1] - bounds[0];
+	GLfloat diff_y = bounds[3] - bounds[2];
+	GLfloat diff_z = bounds[5] - bounds[4];
 
         GLfloat max_diff = MAX(MAX(diff_x, diff_y), diff_z);
 
-        *min_x = stl_min_x(stl) - ortho_factor*max_diff;
-	*max_x = stl_max_x(stl) + ortho_factor*max_diff;
-	*min_y = stl_min_y(stl) - ortho_factor*max_diff;
-	*max_y = stl_max_y(stl) + ortho_factor*max_diff;
-	*min_z = stl_min_z(stl) - MAX_Z_ORTHO_FACTOR * ortho_factor*max_diff;
-	*max_z = stl_max_z(stl) + MAX_Z_ORTHO_FACTOR * ortho_factor*max_diff;
+        *min_x = bounds[0] - ortho_factor*max_diff;
+	*max_x = bounds[1] + ortho_factor*max_diff;
+	*min_y = bounds[2] - ortho_factor*max_diff;
+	*max_y = bounds[3] + ortho_factor*max_diff;
+	*min_z = bounds[4] - MAX_Z_ORTHO_FACTOR * ortho_factor*max_diff;
+	*max_z = bounds[5] + MAX_Z_ORTHO_FACTOR * ortho_factor*max_diff;
 }
 
+/* Camera and lights for a window of width by height, shared with headless mode */
 static void
-reshape(int width, int height)
+setup_view(int width, int height)
 {
 	int size = MIN(width, height);
         GLfloat min_x, min_y, min_z, max_x, max_y, max_z;
@@ -215,136 +647,480 @@ reshape(int width, int height)
         glEnable(GL_LIGHT1);
 }
 
-
 static void
-drawTriangle(	GLfloat x1, GLfloat y1, GLfloat z1,
-		GLfloat x2, GLfloat y2, GLfloat z2,
-		GLfloat x3, GLfloat y3, GLfloat z3)
+reshape(int width, int height)
 {
-	vector_t normal;
-	vector_t U;
-	vector_t V;
-	GLfloat length;
+        setup_view(width, height);
+        glutPostRedisplay();
+}
 
-	U.x = x2 - x1;
-	U.y = y2 - y1;
-	U.z = z2 - z1;
 
-	V.x = x3 - x1;
-	V.y = y3 - y1;
-	V.z = z3 - z1;
+static void
+draw_mesh(const mesh_t *mesh)
+{
+	const GLfloat *vertices = mesh->vertices;
+
+	if (use_vbo) {
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+		vertices = NULL;
+	}
 
-	normal.x = U.y * V.z - U.z * V.y;
-	normal.y = U.z * V.x - U.x * V.z;
-	normal.z = U.x * V.y - U.y * V.x;
+	glVertexPointer(3, GL_FLOAT, VERTEX_STRIDE, vertices);
+	glNormalPointer(GL_FLOAT, VERTEX_STRIDE, vertices + 3);
+	glDrawArrays(GL_TRIANGLES, 0, mesh->vertex_cnt);
 
-	length = normal.x * normal.x + normal.y * normal.y + normal.z * normal.z;
-	length = sqrt(length);
+	profile_frame.triangles += mesh->vertex_cnt / 3;
+}
 
-	glNormal3f(normal.x / length, normal.y / length, normal.z / length);
-	glVertex3f(x1, y1, z1);
-	glVertex3f(x2, y2, z2);
-	glVertex3f(x3, y3, z3);
+/*
+ * Rotation and zoom about the center of the model, column major as
+ * glMultMatrixf takes it
+ */
+static void
+model_matrix(GLfloat m[16])
+{
+	GLfloat rot_matrix[4][4];
+	GLfloat center[3];
+	int i, j;
+
+	center[0] = (bounds[1] + bounds[0]) / 2;
+	center[1] = (bounds[3] + bounds[2]) / 2;
+	center[2] = (bounds[5] + bounds[4]) / 2;
+
+	build_rotmatrix(rot_matrix, rot_cur_quat);
+
+	for (i = 0; i < 3; i++) {
+		m[12 + i] = center[i];
+		for (j = 0; j < 3; j++) {
+			m[4 * j + i] = zoom * rot_matrix[j][i];
+			m[12 + i] -= zoom * rot_matrix[j][i] * center[j];
+		}
+		m[4 * i + 3] = 0;
+	}
+	m[15] = 1;
 }
 
 void
 drawBox(void)
 {
+	double start, draw_start;
+
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
+	start = now_seconds();
 	glPushMatrix();
 
-	glTranslatef(
-		((stl_max_x(stl) + stl_min_x(stl))/2),
-		((stl_max_y(stl) + stl_min_y(stl))/2),
-		((stl_max_z(stl) + stl_min_z(stl))/2));
-
-
-	glScalef(zoom, zoom, zoom);
+        GLfloat model[16];
+        model_matrix(model);
+        glMultMatrixf(model);
 
-        GLfloat rot_matrix[4][4];
-        build_rotmatrix(rot_matrix, rot_cur_quat);
-        glMultMatrixf(&rot_matrix[0][0]);
-
-	glTranslatef(
-		-((stl_max_x(stl) + stl_min_x(stl))/2),
-		-((stl_max_y(stl) + stl_min_y(stl))/2),
-		-((stl_max_z(stl) + stl_min_z(stl))/2));
+	glGetDoublev(GL_MODELVIEW_MATRIX, pick_modelview);
+	glGetDoublev(GL_PROJECTION_MATRIX, pick_projection);
+	glGetIntegerv(GL_VIEWPORT, pick_viewport);
 
 	glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular );
 	glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
 
-        glCallList(model);
+	draw_start = now_seconds();
+	profile_frame.matrix = draw_start - start;
+	profile_frame.lod = rotating && have_lod;
+
+	int i;
+	if (rotating && have_lod) {
+		draw_mesh(&lod_mesh);
+	} else {
+		for (i = 0; i < mesh_cnt; i++) {
+			draw_mesh(&meshes[i]);
+		}
+	}
+
+	if (use_vbo) {
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
 
         glPopMatrix();
 
 	glFlush();
-	glutSwapBuffers();
+
+	profile_frame.draw = now_seconds() - draw_start;
 }
 
-void
-idle_func(void)
+static void
+queue_push(batch_t *batch)
 {
-	glutPostRedisplay();
+	unsigned int head = __atomic_load_n(&load_head, __ATOMIC_RELAXED);
+
+	/* Wait for the renderer to catch up */
+	while (head - __atomic_load_n(&load_tail, __ATOMIC_ACQUIRE) ==
+	       LOAD_QUEUE_SIZE) {
+		usleep(1000);
+	}
+
+	load_queue[head % LOAD_QUEUE_SIZE] = batch;
+	__atomic_store_n(&load_head, head + 1, __ATOMIC_RELEASE);
 }
 
+static batch_t *
+queue_pop(void)
+{
+	unsigned int tail = __atomic_load_n(&load_tail, __ATOMIC_RELAXED);
+	batch_t *batch = NULL;
 
-void
-display(void)
+	if (tail == __atomic_load_n(&load_head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	batch = load_queue[tail % LOAD_QUEUE_SIZE];
+	__atomic_store_n(&load_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return batch;
+}
+
+/*
+ * Copy facets of the loader into a batch of their own and queue it. When
+ * arg is not NULL the facets are also collected into that facets_t.
+ */
+static int
+publish_batch(void *arg, const STLFloat *vertices, STLuint facet_cnt)
 {
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  drawBox();
+	batch_t *batch = (batch_t *)malloc(sizeof(*batch));
+	facets_t *facets = (facets_t *)arg;
+	GLfloat *grown = NULL;
+
+	if (batch == NULL ||
+	    (batch->vertices = (GLfloat *)malloc(facet_cnt * 18 * sizeof(GLfloat))) == NULL) {
+		fprintf(stderr, "Unable to allocate memory for the model\n");
+		exit(1);
+	}
+
+	if (facets != NULL) {
+		if (facets->facet_cnt + facet_cnt > facets->capacity) {
+			facets->capacity = MAX(2 * facets->capacity,
+					       facets->facet_cnt + facet_cnt);
+			grown = (GLfloat *)realloc(facets->vertices,
+					facets->capacity * 18 * sizeof(GLfloat));
+			if (grown == NULL) {
+				fprintf(stderr, "Unable to allocate memory for the model\n");
+				exit(1);
+			}
+			facets->vertices = grown;
+		}
+
+		memcpy(&facets->vertices[18 * (size_t)facets->facet_cnt], vertices,
+		       facet_cnt * 18 * sizeof(GLfloat));
+		facets->facet_cnt += facet_cnt;
+	}
+
+	memcpy(batch->vertices, vertices, facet_cnt * 18 * sizeof(GLfloat));
+	batch->facet_cnt = facet_cnt;
+	queue_push(batch);
+
+	return 0;
 }
 
-void
-init(char *filename)
+/*
+ * Simplify a large model and hand the finest level that is small enough
+ * to the renderer. The levels are kept in the cache next to the mesh.
+ * Meshes with many non manifold edges may not simplify that far, they
+ * are then drawn in full.
+ */
+static void
+publish_lod(stl_t *stl)
+{
+	batch_t *batch = NULL;
+	STLuint32 *indices = NULL;
+	STLuint facet_cnt = 0;
+	int level = 0;
+
+	if (stl_facet_cnt(stl) < LOD_MIN_FACETS) {
+		return;
+	}
+
+	stl_set_cache(stl, STL_CACHE_READ | STL_CACHE_WRITE);
+	if (stl_build_lods(stl, lod_ratios, sizeof(lod_ratios) / sizeof(lod_ratios[0])) !=
+	    STL_ERR_NONE) {
+		return;
+	}
+
+	for (level = 0; level < stl_lod_cnt(stl); level++) {
+		stl_lod_indices(stl, level, &indices, &facet_cnt);
+		if (facet_cnt <= LOD_MAX_FACETS) {
+			break;
+		}
+	}
+
+	if (level == stl_lod_cnt(stl)) {
+		return;
+	}
+
+	batch = (batch_t *)malloc(sizeof(*batch));
+	if (batch == NULL ||
+	    (batch->vertices = (GLfloat *)malloc(facet_cnt * 18 * sizeof(GLfloat) + 1)) == NULL ||
+	    stl_lod_vertices(stl, level, batch->vertices) != STL_ERR_NONE) {
+		fprintf(stderr, "Unable to allocate memory for the model\n");
+		exit(1);
+	}
+
+	batch->facet_cnt = facet_cnt;
+	__atomic_store_n(&load_lod, batch, __ATOMIC_RELEASE);
+}
+
+/*
+ * Keep the hierarchy of the model for picking, the mesh itself is
+ * dropped as the buffers already hold it. Returns whether it was kept.
+ */
+static int
+publish_pick(stl_t *stl)
+{
+	if (stl_build_bvh(stl) != STL_ERR_NONE) {
+		return 0;
+	}
+
+	stl_keep_bvh(stl);
+	__atomic_store_n(&pick_stl, stl, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Load the model on a thread of its own so that the window stays
+ * responsive. A model in the mesh cache is loaded at once, otherwise the
+ * file is streamed batch by batch and the batches are collected to fill
+ * the cache for the next time it is opened. Large models are then
+ * simplified for drawing while rotating.
+ */
+static void *
+load_thread(void *arg)
 {
+	stl_stream_t *stream = NULL;
 	stl_error_t err;
-	GLfloat *vertices = NULL;
-	GLuint triangle_cnt = 0;
-	int i = 0, base = 0;
+	stl_t *stl = NULL;
+	facets_t facets = { NULL, 0, 0 };
+	STLFloat *vertices = NULL;
+	STLuint facet_cnt = 0;
+	STLuint i = 0;
 
- 	stl = stl_alloc();
+	stl = stl_alloc();
 	if (stl == NULL) {
-		fprintf(stderr, "Unable to allocate memoryfor the stl object");
+		fprintf(stderr, "Unable to allocate memory for the stl object\n");
 		exit(1);
 	}
 
-	err = stl_load(stl, filename);
+	stl_set_cache(stl, STL_CACHE_READ | STL_CACHE_ONLY);
+	if (stl_load(stl, load_file) == STL_ERR_NONE &&
+	    stl_vertices(stl, &vertices) == STL_ERR_NONE) {
+		facet_cnt = stl_facet_cnt(stl);
+		for (i = 0; i < facet_cnt; i += LOAD_BATCH_FACETS) {
+			publish_batch(NULL, &vertices[18 * (size_t)i],
+				      MIN(LOAD_BATCH_FACETS, facet_cnt - i));
+		}
+
+		publish_lod(stl);
+		if (!publish_pick(stl)) {
+			stl_free(stl);
+		}
+		__atomic_store_n(&load_state, LOAD_DONE, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	stl_free(stl);
+
+	stream = stl_stream_open(load_file, &err);
+	if (stream != NULL) {
+		err = stl_stream_read(stream, LOAD_BATCH_FACETS, publish_batch, &facets);
+		load_lineno = stl_stream_lineno(stream);
+		stl_stream_close(stream);
+	}
 
 	if (err != STL_ERR_NONE) {
+		free(facets.vertices);
+		__atomic_store_n(&load_state, LOAD_FAILED, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	stl = stl_alloc();
+	if (stl != NULL) {
+		stl_set_cache(stl, STL_CACHE_WRITE);
+		err = stl_load_facets(stl, load_file, facets.vertices, facets.facet_cnt);
+	}
+	free(facets.vertices);
+
+	if (stl != NULL && err == STL_ERR_NONE) {
+		publish_lod(stl);
+		if (publish_pick(stl)) {
+			stl = NULL;
+		}
+	}
+	stl_free(stl);
+
+	__atomic_store_n(&load_state, LOAD_DONE, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * With buffer objects the batch is copied into the buffer in one call and
+ * released, so the driver holds the only copy of the model.
+ */
+static void
+upload_mesh(mesh_t *mesh, batch_t *batch)
+{
+	mesh->vertex_cnt = batch->facet_cnt * 3;
+	mesh->vertices = batch->vertices;
+	model_bytes += mesh->vertex_cnt * VERTEX_STRIDE;
+
+	if (use_vbo) {
+		glGenBuffers(1, &mesh->vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+		glBufferData(GL_ARRAY_BUFFER, mesh->vertex_cnt * VERTEX_STRIDE,
+			     batch->vertices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		mesh->vertices = NULL;
+		free(batch->vertices);
+	}
+
+	free(batch);
+}
+
+/* Upload the batches that have arrived */
+static int
+upload_batches(void)
+{
+	batch_t *batch = NULL;
+	mesh_t *grown = NULL;
+	GLfloat *vertices = NULL;
+	int bounds_changed = 0;
+	int cnt = 0;
+	int i = 0, axis = 0;
+
+	for (cnt = 0; cnt < LOAD_BATCHES_PER_FRAME && (batch = queue_pop()); cnt++) {
+		if (mesh_cnt == mesh_capacity) {
+			mesh_capacity = mesh_capacity ? 2 * mesh_capacity : 64;
+			grown = (mesh_t *)realloc(meshes, mesh_capacity * sizeof(mesh_t));
+			if (grown == NULL) {
+				fprintf(stderr, "Unable to allocate memory for the model\n");
+				exit(1);
+			}
+			meshes = grown;
+		}
+
+		vertices = batch->vertices;
+
+		for (i = 0; i < batch->facet_cnt * 3; i++) {
+			for (axis = 0; axis < 3; axis++) {
+				GLfloat v = vertices[6 * i + axis];
+
+				if (mesh_cnt == 0 && i == 0) {
+					bounds[2 * axis] = bounds[2 * axis + 1] = v;
+				}
+				bounds[2 * axis] = MIN(bounds[2 * axis], v);
+				bounds[2 * axis + 1] = MAX(bounds[2 * axis + 1], v);
+			}
+		}
+		bounds_changed = 1;
+
+		upload_mesh(&meshes[mesh_cnt++], batch);
+	}
+
+	/* The view is fitted to the part loaded so far */
+	if (bounds_changed && screen_width > 0) {
+		reshape(screen_width, screen_height);
+	}
+
+	return cnt;
+}
+
+/*
+ * Poll the loader thread while it runs. A frame is only drawn when new
+ * batches arrived, once the model is complete nothing is drawn until the
+ * user interacts with it.
+ */
+static void
+load_poll(int value)
+{
+	int state = __atomic_load_n(&load_state, __ATOMIC_ACQUIRE);
+	int cnt = upload_batches();
+	batch_t *lod = __atomic_exchange_n(&load_lod, NULL, __ATOMIC_ACQUIRE);
+
+	if (lod != NULL) {
+		upload_mesh(&lod_mesh, lod);
+		have_lod = 1;
+	}
+
+	if (state == LOAD_FAILED) {
 		fprintf(stderr, "Problem loading the stl file, check lineno %d\n",
-			stl_error_lineno(stl));
+			load_lineno);
 		exit(1);
 	}
 
-	err =  stl_vertices(stl, &vertices);
-	if (err) {
-		fprintf(stderr, "Problem getting the vertex array");
-		exit(1);
+	if (cnt > 0) {
+		glutPostRedisplay();
+	}
+
+	/* Everything queued before the loader finished has been uploaded */
+	if (state == LOAD_DONE && cnt < LOAD_BATCHES_PER_FRAME) {
+		return;
 	}
 
-	triangle_cnt = stl_facet_cnt(stl);
+	glutTimerFunc(LOAD_POLL_INTERVAL, load_poll, 0);
+}
+
+
+/*
+ * Frames are only drawn on demand, GLUT merges the redisplays posted
+ * before it gets to draw into a single frame.
+ */
+void
+display(void)
+{
+  double start = now_seconds();
+  double swap_start, end;
+
+  if (profile_cnt == 0) {
+	profile_start = start;
+  }
+  memset(&profile_frame, 0, sizeof(profile_frame));
+
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  drawBox();
+  if (show_profile) {
+	profile_overlay();
+  }
+
+  swap_start = now_seconds();
+  glutSwapBuffers();
+  end = now_seconds();
+
+  profile_frame.time = start - profile_start;
+  profile_frame.swap = end - swap_start;
+  profile_frame.frame = end - start;
+  profile_record(&profile_frame);
 
-        model = glGenLists(1);
-        glNewList(model, GL_COMPILE);
-        glBegin(GL_TRIANGLES);
-	for (i = 0; i < triangle_cnt; i++) {
-		base = i*18;
-		drawTriangle(vertices[base], vertices[base + 1], vertices[base + 2],
-			     vertices[base + 6], vertices[base + 7], vertices[base + 8],
-			     vertices[base + 12], vertices[base + 13], vertices[base + 14]);
+  stats_frames++;
+  stats_frame_time += end - start;
+}
+
+/* OpenGL state shared by the window and headless mode */
+static void
+init_gl(void)
+{
+	const char *version = NULL;
+	int major = 0, minor = 0;
+
+	/* Buffer objects need OpenGL 1.5, older versions draw from client memory */
+	version = (const char *)glGetString(GL_VERSION);
+	if (version && sscanf(version, "%d.%d", &major, &minor) == 2) {
+		use_vbo = major > 1 || (major == 1 && minor >= 5);
 	}
-	glEnd();
-        glEndList();
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
 
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 	glEnable(GL_DEPTH_TEST);
 	glShadeModel(GL_SMOOTH);
 
-        glClearColor(135.0 / 255, 206.0 / 255.0, 250.0 / 255.0, 0.0);
+        glClearColor(clear_color[0], clear_color[1], clear_color[2], 0.0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glColor3f(120.0 / 255.0 , 120.0 / 255.0, 120.0 / 255.0);
+	glColor3fv(model_color);
 
         glEnable(GL_NORMALIZE);
 	glEnable(GL_COLOR_MATERIAL);
@@ -352,13 +1128,602 @@ init(char *filename)
 	glFlush();
 }
 
+void
+init(char *filename)
+{
+	pthread_t thread;
+
+	load_file = filename;
+	if (pthread_create(&thread, NULL, load_thread, NULL) != 0) {
+		fprintf(stderr, "Unable to start loading the stl file\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+	glutTimerFunc(LOAD_POLL_INTERVAL, load_poll, 0);
+
+	init_gl();
+}
+
+/*
+ * Headless mode renders thumbnails of any number of files without a
+ * display, with the camera of the window and drawBox. Files are loaded on
+ * thumb_thread_cnt threads, each reusing its stl object, while the main
+ * thread renders the files loaded so far. At most one model per loader
+ * thread is in memory at a time.
+ */
+typedef struct {
+	const char *name;
+	/* Trackball rotations in degrees, about y first and then about x */
+	float x_angle;
+	float y_angle;
+} view_t;
+
+static const view_t thumb_views[] = {
+	{"front", 0, 0},
+	{"back", 0, 180},
+	{"left", 0, -90},
+	{"right", 0, 90},
+	{"top", -90, 0},
+	{"bottom", 90, 0},
+	{"iso", -35.264, 45},
+};
+
+typedef struct {
+	stl_t *stl;
+	int file;
+	stl_error_t err;
+	int ready;
+} thumb_slot_t;
+
+static char **thumb_files = NULL;
+static int thumb_file_cnt = 0;
+static int thumb_next_file = 0;
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thumb_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned int png_crc_table[256];
+
+static void
+png_crc_init(void)
+{
+	unsigned int crc = 0;
+	int i = 0, k = 0;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++) {
+			crc = (crc & 1) ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+		}
+		png_crc_table[i] = crc;
+	}
+}
+
+static unsigned int
+png_crc(unsigned int crc, const GLubyte *data, size_t len)
+{
+	size_t i = 0;
+
+	for (i = 0; i < len; i++) {
+		crc = png_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+static void
+png_put32(GLubyte *p, unsigned int value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void
+png_chunk(FILE *fp, const char *type, const GLubyte *data, size_t len)
+{
+	GLubyte head[8], crc[4];
+
+	png_put32(head, len);
+	memcpy(head + 4, type, 4);
+	png_put32(crc, png_crc(png_crc(0xffffffff, head + 4, 4), data, len) ^ 0xffffffff);
+
+	fwrite(head, 1, sizeof(head), fp);
+	fwrite(data, 1, len, fp);
+	fwrite(crc, 1, sizeof(crc), fp);
+}
+
+/* Bytes of the scanlines of an image and of the zlib stream holding them */
+static size_t
+png_raw_size(int size)
+{
+	return (size_t)size * (3 * (size_t)size + 1);
+}
+
+static size_t
+png_stream_size(int size)
+{
+	size_t raw = png_raw_size(size);
+
+	return 2 + raw + 5 * ((raw + PNG_STORED_BLOCK - 1) / PNG_STORED_BLOCK) + 4;
+}
+
+/*
+ * Write an RGB image as PNG. The image data is stored in uncompressed
+ * deflate blocks, which needs no zlib and costs nothing to produce. raw
+ * and stream are work buffers of png_raw_size and png_stream_size bytes.
+ */
+static int
+write_png(const char *path, const GLubyte *pixels, int size, GLubyte *raw,
+	  GLubyte *stream)
+{
+	size_t raw_len = png_raw_size(size), len = 0, pos = 0, block = 0;
+	unsigned int a = 1, b = 0;
+	GLubyte header[13];
+	FILE *fp = NULL;
+	int y = 0;
+
+	/* GL rows are bottom up, each PNG row starts with filter type 0 */
+	for (y = 0; y < size; y++) {
+		raw[y * (3 * (size_t)size + 1)] = 0;
+		memcpy(&raw[y * (3 * (size_t)size + 1) + 1],
+		       &pixels[3 * (size_t)size * (size - 1 - y)], 3 * (size_t)size);
+	}
+
+	stream[len++] = 0x78;
+	stream[len++] = 0x01;
+	for (pos = 0; pos < raw_len; pos += block) {
+		block = MIN(raw_len - pos, PNG_STORED_BLOCK);
+		stream[len++] = pos + block == raw_len;
+		stream[len++] = block & 0xff;
+		stream[len++] = block >> 8;
+		stream[len++] = ~block & 0xff;
+		stream[len++] = (~block >> 8) & 0xff;
+		memcpy(&stream[len], &raw[pos], block);
+		len += block;
+	}
+
+	for (pos = 0; pos < raw_len; pos++) {
+		a = (a + raw[pos]) % 65521;
+		b = (b + a) % 65521;
+	}
+	png_put32(&stream[len], (b << 16) | a);
+	len += 4;
+
+	png_put32(header, size);
+	png_put32(header + 4, size);
+	header[8] = 8;
+	header[9] = 2;
+	header[10] = 0;
+	header[11] = 0;
+	header[12] = 0;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp);
+	png_chunk(fp, "IHDR", header, sizeof(header));
+	png_chunk(fp, "IDAT", stream, len);
+	png_chunk(fp, "IEND", NULL, 0);
+
+	return (ferror(fp) | fclose(fp)) ? -1 : 0;
+}
+
+static int
+write_ppm(const char *path, const GLubyte *pixels, int size)
+{
+	FILE *fp = fopen(path, "wb");
+	int y = 0;
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	fprintf(fp, "P6\n%d %d\n255\n", size, size);
+	for (y = size - 1; y >= 0; y--) {
+		fwrite(&pixels[3 * (size_t)size * y], 3, size, fp);
+	}
+
+	return (ferror(fp) | fclose(fp)) ? -1 : 0;
+}
+
+static void *
+thumb_load_thread(void *arg)
+{
+	thumb_slot_t *slot = (thumb_slot_t *)arg;
+	stl_error_t err;
+	int file = 0;
+
+	while ((file = __atomic_fetch_add(&thumb_next_file, 1, __ATOMIC_RELAXED)) <
+	       thumb_file_cnt) {
+		stl_reset(slot->stl);
+		err = stl_load(slot->stl, thumb_files[file]);
+
+		/* Hand the model to the renderer and wait until it is drawn */
+		pthread_mutex_lock(&thumb_lock);
+		slot->file = file;
+		slot->err = err;
+		slot->ready = 1;
+		pthread_cond_broadcast(&thumb_cond);
+		while (slot->ready) {
+			pthread_cond_wait(&thumb_cond, &thumb_lock);
+		}
+		pthread_mutex_unlock(&thumb_lock);
+	}
+
+	return NULL;
+}
+
+#ifdef _Linux_
+/*
+ * An offscreen OpenGL context. Without a display server Mesa renders
+ * surfaceless, with its software rasterizer on machines without a GPU.
+ */
+static int
+headless_context(int size)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+		EGL_DEPTH_SIZE, 24,
+		EGL_NONE
+	};
+	EGLint surface_attribs[] = {EGL_WIDTH, size, EGL_HEIGHT, size, EGL_NONE};
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLConfig config;
+	EGLContext context;
+	EGLSurface surface;
+	EGLint cnt = 0;
+
+	if (get_platform_display) {
+		display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+					       EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (display == EGL_NO_DISPLAY) {
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) ||
+	    !eglChooseConfig(display, config_attribs, &config, 1, &cnt) || cnt < 1 ||
+	    !eglBindAPI(EGL_OPENGL_API)) {
+		return -1;
+	}
+
+	context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+	surface = eglCreatePbufferSurface(display, config, surface_attribs);
+	if (context == EGL_NO_CONTEXT || surface == EGL_NO_SURFACE ||
+	    !eglMakeCurrent(display, surface, surface, context)) {
+		return -1;
+	}
+
+	return 0;
+}
+#else
+static int
+headless_context(int size)
+{
+	return -1;
+}
+#endif
+
+/* dir/name_view.ext for file name.stl */
+static void
+thumb_path(char *path, size_t len, const char *dir, const char *file,
+	   const char *view, const char *ext)
+{
+	const char *name = strrchr(file, '/');
+	const char *dot = NULL;
+
+	name = name ? name + 1 : file;
+	dot = strrchr(name, '.');
+
+	snprintf(path, len, "%s/%.*s_%s.%s", dir,
+		 (int)(dot && dot != name ? dot - name : (int)strlen(name)), name,
+		 view, ext);
+}
+
+/*
+ * The camera and lights of setup_view and drawBox for the software
+ * rasterizer, for a window of size by size
+ */
+static void
+cpu_view(int size, stl_view_t *view)
+{
+	GLfloat *ortho = view->ortho;
+
+	model_matrix(view->modelview);
+	ortho_dimensions(&ortho[0], &ortho[1], &ortho[2], &ortho[3], &ortho[4], &ortho[5]);
+
+	view->viewport[0] = 0;
+	view->viewport[1] = 0;
+	view->viewport[2] = size;
+	view->viewport[3] = size;
+
+	view->light[0] = ortho[1];
+	view->light[1] = ortho[3];
+	view->light[2] = ortho[5];
+
+	memcpy(view->color, model_color, sizeof(view->color));
+	memcpy(view->background, clear_color, sizeof(view->background));
+	view->shading = STL_SHADE_SMOOTH;
+}
+
+/* Draw the model of slot from every view and write the images */
+static int
+thumb_render(stl_t *stl, const char *file, const char *dir, int size,
+	     const int *views, int view_cnt, int png, int cpu, GLubyte *pixels,
+	     GLubyte *raw, GLubyte *stream)
+{
+	static mesh_t mesh;
+	STLFloat *vertices = NULL;
+	stl_view_t view;
+	char path[4096];
+	float qx[4], qy[4];
+	float x_axis[3] = {1, 0, 0}, y_axis[3] = {0, 1, 0};
+	int i = 0, ret = 0;
+
+	if (!cpu && stl_vertices(stl, &vertices) != STL_ERR_NONE) {
+		return -1;
+	}
+
+	bounds[0] = -1;
+	bounds[1] = 1;
+	bounds[2] = -1;
+	bounds[3] = 1;
+	bounds[4] = -1;
+	bounds[5] = 1;
+	if (stl_facet_cnt(stl) > 0) {
+		bounds[0] = stl_min_x(stl);
+		bounds[1] = stl_max_x(stl);
+		bounds[2] = stl_min_y(stl);
+		bounds[3] = stl_max_y(stl);
+		bounds[4] = stl_min_z(stl);
+		bounds[5] = stl_max_z(stl);
+	}
+
+	/* One buffer object, respecified for every model */
+	mesh.vertex_cnt = stl_facet_cnt(stl) * 3;
+	mesh.vertices = vertices;
+	if (!cpu && use_vbo) {
+		if (mesh.vbo == 0) {
+			glGenBuffers(1, &mesh.vbo);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+		glBufferData(GL_ARRAY_BUFFER, mesh.vertex_cnt * VERTEX_STRIDE,
+			     vertices, GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		mesh.vertices = NULL;
+	}
+	meshes = &mesh;
+	mesh_cnt = 1;
+
+	for (i = 0; i < view_cnt; i++) {
+		axis_to_quat(x_axis, thumb_views[views[i]].x_angle * M_PI / 180, qx);
+		axis_to_quat(y_axis, thumb_views[views[i]].y_angle * M_PI / 180, qy);
+		add_quats(qx, qy, rot_cur_quat);
+
+		if (cpu) {
+			cpu_view(size, &view);
+			if (stl_render(stl, &view, size, size, pixels) != STL_ERR_NONE) {
+				fprintf(stderr, "Unable to render %s\n", file);
+				ret = -1;
+				continue;
+			}
+		} else {
+			setup_view(size, size);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			drawBox();
+			glReadPixels(0, 0, size, size, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+		}
+
+		thumb_path(path, sizeof(path), dir, file, thumb_views[views[i]].name,
+			   png ? "png" : "ppm");
+		if ((png ? write_png(path, pixels, size, raw, stream) :
+		     write_ppm(path, pixels, size)) != 0) {
+			fprintf(stderr, "Unable to write %s\n", path);
+			ret = -1;
+		}
+	}
+
+	mesh_cnt = 0;
+	meshes = NULL;
+
+	return ret;
+}
+
+/* Comma separated view names to indices into thumb_views */
+static int
+parse_views(char *list, int *views)
+{
+	char *name = NULL, *save = NULL;
+	int cnt = 0, i = 0;
+	int view_cnt = sizeof(thumb_views) / sizeof(thumb_views[0]);
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < view_cnt && strcmp(name, thumb_views[i].name) != 0; i++);
+
+		if (i == view_cnt || cnt == THUMB_MAX_VIEWS) {
+			return -1;
+		}
+		views[cnt++] = i;
+	}
+
+	return cnt;
+}
+
+static int
+headless(char *dir, int size, char *view_list, int png, int cpu, int thread_cnt,
+	 char **files, int file_cnt)
+{
+	int views[THUMB_MAX_VIEWS];
+	int view_cnt = parse_views(view_list, views);
+	thumb_slot_t *slots = NULL;
+	thumb_slot_t *slot = NULL;
+	pthread_t *threads = NULL;
+	GLubyte *pixels = NULL, *raw = NULL, *stream = NULL;
+	int done = 0, i = 0, ret = 0;
+
+	if (view_cnt <= 0) {
+		fprintf(stderr, "Unknown view in %s, the views are front, back, left, "
+			"right, top, bottom and iso\n", view_list);
+		return 1;
+	}
+
+	if (!cpu && headless_context(size) != 0) {
+		fprintf(stderr, "Unable to create an offscreen OpenGL context\n");
+		return 1;
+	}
+
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create %s\n", dir);
+		return 1;
+	}
+
+	if (thread_cnt <= 0) {
+		thread_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (thread_cnt <= 0 || thread_cnt > file_cnt) {
+		thread_cnt = file_cnt;
+	}
+
+	if (!cpu) {
+		init_gl();
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	}
+	png_crc_init();
+
+	slots = (thumb_slot_t *)calloc(thread_cnt, sizeof(*slots));
+	threads = (pthread_t *)calloc(thread_cnt, sizeof(*threads));
+	pixels = (GLubyte *)malloc(3 * (size_t)size * size);
+	raw = (GLubyte *)malloc(png_raw_size(size));
+	stream = (GLubyte *)malloc(png_stream_size(size));
+	if (slots == NULL || threads == NULL || pixels == NULL || raw == NULL ||
+	    stream == NULL) {
+		fprintf(stderr, "Unable to allocate memory for the thumbnails\n");
+		return 1;
+	}
+
+	thumb_files = files;
+	thumb_file_cnt = file_cnt;
+	for (i = 0; i < thread_cnt; i++) {
+		slots[i].stl = stl_alloc();
+		if (slots[i].stl == NULL ||
+		    pthread_create(&threads[i], NULL, thumb_load_thread, &slots[i]) != 0) {
+			fprintf(stderr, "Unable to start loading the stl files\n");
+			return 1;
+		}
+	}
+
+	for (done = 0; done < file_cnt; done++) {
+		pthread_mutex_lock(&thumb_lock);
+		for (slot = NULL; slot == NULL; ) {
+			for (i = 0; i < thread_cnt && !slots[i].ready; i++);
+			if (i < thread_cnt) {
+				slot = &slots[i];
+			} else {
+				pthread_cond_wait(&thumb_cond, &thumb_lock);
+			}
+		}
+		pthread_mutex_unlock(&thumb_lock);
+
+		if (slot->err != STL_ERR_NONE) {
+			fprintf(stderr, "Problem loading %s, check lineno %d\n",
+				files[slot->file], stl_error_lineno(slot->stl));
+			ret = 1;
+		} else if (thumb_render(slot->stl, files[slot->file], dir, size, views,
+					view_cnt, png, cpu, pixels, raw, stream) != 0) {
+			ret = 1;
+		}
+
+		pthread_mutex_lock(&thumb_lock);
+		slot->ready = 0;
+		pthread_cond_broadcast(&thumb_cond);
+		pthread_mutex_unlock(&thumb_lock);
+	}
+
+	for (i = 0; i < thread_cnt; i++) {
+		pthread_join(threads[i], NULL);
+		stl_free(slots[i].stl);
+	}
+
+	free(slots);
+	free(threads);
+	free(pixels);
+	free(raw);
+	free(stream);
+
+	return ret;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "%s [-p profile.csv] <stl file>\n", program);
+	fprintf(stderr, "%s -o dir [-s size] [-v view,...] [-f png|ppm] [-j threads] [-c] "
+		"<stl file> ...\n", program);
+	exit(1);
+}
+
 int
 main(int argc, char **argv)
 {
+  char *dir = NULL;
+  char *view_list = THUMB_DEFAULT_VIEWS;
+  int size = THUMB_DEFAULT_SIZE;
+  int png = 1;
+  int thread_cnt = 0;
+  int cpu = 0;
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "o:s:v:f:j:cp:")) != -1) {
+	switch (opt) {
+	case 'o':
+		dir = optarg;
+		break;
+	case 's':
+		size = atoi(optarg);
+		break;
+	case 'v':
+		view_list = optarg;
+		break;
+	case 'f':
+		png = strcmp(optarg, "ppm") != 0;
+		break;
+	case 'j':
+		thread_cnt = atoi(optarg);
+		break;
+	case 'c':
+		cpu = 1;
+		break;
+	case 'p':
+		profile_csv = optarg;
+		break;
+	default:
+		usage(argv[0]);
+	}
+  }
 
-  if (argc != 2) {
-	fprintf(stderr, "%s <stl file>\n", argv[0]);
-	exit(1);
+  if (dir) {
+	if (optind == argc || size <= 0) {
+		usage(argv[0]);
+	}
+	return headless(dir, size, view_list, png, cpu, thread_cnt, &argv[optind],
+			argc - optind);
+  }
+
+  if (argc - optind != 1) {
+	usage(argv[0]);
+  }
+  argv[1] = argv[optind];
+  argc = 2;
+
+  if (profile_csv) {
+	atexit(profile_dump);
   }
 
   glutInit(&argc, argv);
@@ -369,7 +1734,6 @@ main(int argc, char **argv)
   glutMouseFunc(mouse_click);
   glutDisplayFunc(display);
   glutReshapeFunc(reshape);
-  glutIdleFunc(idle_func);
   init(argv[1]);
   trackball(rot_cur_quat, 0.0, 0.0, 0.0, 0.0);
   glutMainLoop();
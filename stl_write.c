@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2012, Vishal Patil
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Writing stl files. Facets are encoded into a large buffer that goes out
+ * in one system call when full, the header of a binary file goes with the
+ * first buffer through writev. ASCII numbers are formatted by hand rather
+ * than with printf, which is several times slower than the encoding
+ * around it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "stl.h"
+
+#define STL_WRITE_BUFFER_SIZE (1024 * 1024)
+/* Longest facet record, ASCII with every number at its longest */
+#define STL_WRITE_MAX_RECORD 512
+#define STL_WRITE_HEADER_SIZE 80
+#define STL_WRITE_FACETS_OFFSET 84
+#define STL_WRITE_NAME_SIZE 64
+/* Significant digits of an ASCII number, enough to read back the same float */
+#define STL_WRITE_DIGITS 9
+
+struct stl_writer_s {
+        int fd;
+        stl_file_type_t type;
+        char *buffer;
+        size_t len;
+        STLuint32 facet_cnt;
+        stl_error_t err;
+        STLuint8 header[STL_WRITE_FACETS_OFFSET];
+        int header_written;
+        char name[STL_WRITE_NAME_SIZE];
+        char *path;
+        /* Written in place of path, renamed over it once complete */
+        char *temp;
+};
+
+#define STL_APPEND(str, literal) \
+        (memcpy((str), (literal), sizeof(literal) - 1), (str) + sizeof(literal) - 1)
+
+static const double stl_pow10_table[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* 10^n for 0 <= n <= 66, exact up to 10^22 */
+static double
+stl_pow10(int n)
+{
+        double p = 1;
+
+        for (; n > 22; n -= 22) {
+                p *= 1e22;
+        }
+
+        return p * stl_pow10_table[n];
+}
+
+/* The STL_WRITE_DIGITS digit mantissa of x > 0 scaled by 10^-exp */
+static unsigned long long
+stl_mantissa(double x, int exp)
+{
+        int scale = STL_WRITE_DIGITS - 1 - exp;
+
+        return (unsigned long long)llround(scale >= 0 ? x * stl_pow10(scale) :
+                                                       x / stl_pow10(-scale));
+}
+
+/*
+ * Format value as d.ddddddddde+xx with trailing zeros dropped. The
+ * decimal exponent is estimated from the binary one, which is either
+ * right or one too small, and the mantissa rounded in double precision
+ * is close enough to the exact one for the float to read back unchanged.
+ */
+static char *
+stl_format_float(char *str, STLFloat value)
+{
+        static const unsigned long long lowest = 100000000ull;
+        char digits[STL_WRITE_DIGITS];
+        unsigned long long mantissa = 0;
+        double x = value;
+        int exp = 0, len = 0, i = 0;
+
+        if (isnan(x)) {
+                return STL_APPEND(str, "nan");
+        }
+
+        if (isinf(x)) {
+                return x < 0 ? STL_APPEND(str, "-inf") : STL_APPEND(str, "inf");
+        }
+
+        if (signbit(x)) {
+                *str++ = '-';
+                x = -x;
+        }
+
+        if (x == 0) {
+                *str++ = '0';
+                return str;
+        }
+
+        frexp(x, &exp);
+        exp = (int)floor((exp - 1) * 0.30102999566398120);
+
+        mantissa = stl_mantissa(x, exp);
+        if (mantissa >= 10 * lowest) {
+                mantissa = stl_mantissa(x, ++exp);
+        }
+        /* Rounding up to the next power of ten */
+        if (mantissa >= 10 * lowest) {
+                mantissa /= 10;
+                exp++;
+        }
+
+        for (i = STL_WRITE_DIGITS - 1; i >= 0; i--) {
+                digits[i] = '0' + mantissa % 10;
+                mantissa /= 10;
+        }
+
+        for (len = STL_WRITE_DIGITS; len > 1 && digits[len - 1] == '0'; len--);
+
+        *str++ = digits[0];
+        if (len > 1) {
+                *str++ = '.';
+                memcpy(str, digits + 1, len - 1);
+                str += len - 1;
+        }
+
+        *str++ = 'e';
+        *str++ = exp < 0 ? '-' : '+';
+        exp = exp < 0 ? -exp : exp;
+        if (exp >= 100) {
+                *str++ = '0' + exp / 100;
+        }
+        *str++ = '0' + exp / 10 % 10;
+        *str++ = '0' + exp % 10;
+
+        return str;
+}
+
+static char *
+stl_format_vector(char *str, const STLFloat *v)
+{
+        str = stl_format_float(str, v[0]);
+        *str++ = ' ';
+        str = stl_format_float(str, v[1]);
+        *str++ = ' ';
+        str = stl_format_float(str, v[2]);
+        *str++ = '\n';
+
+        return str;
+}
+
+/* Write out the buffer, preceded by the header of a binary file the first time */
+static void
+stl_writer_flush(stl_writer_t *writer)
+{
+        struct iovec iov[2];
+        struct iovec *vec = iov;
+        ssize_t bytes = 0;
+        int cnt = 0;
+
+        if (writer->err != STL_ERR_NONE) {
+                return;
+        }
+
+        if (writer->type == STL_FILE_TYPE_BIN && !writer->header_written) {
+                iov[cnt].iov_base = writer->header;
+                iov[cnt++].iov_len = sizeof(writer->header);
+                writer->header_written = 1;
+        }
+
+        iov[cnt].iov_base = writer->buffer;
+        iov[cnt++].iov_len = writer->len;
+
+        while (cnt > 0) {
+                bytes = writev(writer->fd, vec, cnt);
+                if (bytes < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (bytes <= 0) {
+                        writer->err = STL_ERR_LOAD;
+                        return;
+                }
+
+                for (; cnt > 0 && (size_t)bytes >= vec->iov_len; vec++, cnt--) {
+                        bytes -= vec->iov_len;
+                }
+                if (cnt > 0) {
+                        vec->iov_base = (char *)vec->iov_base + bytes;
+                        vec->iov_len -= bytes;
+                }
+        }
+
+        writer->len = 0;
+}
+
+/* The name of an ASCII solid is that of the file without its directory and suffix */
+static void
+stl_writer_name(stl_writer_t *writer, const char *filename)
+{
+        const char *base = strrchr(filename, '/');
+        size_t len = 0;
+
+        base = base ? base + 1 : filename;
+        len = strcspn(base, ". \t");
+        if (len >= sizeof(writer->name)) {
+                len = sizeof(writer->name) - 1;
+        }
+
+        memcpy(writer->name, base, len);
+        writer->name[len] = '\0';
+}
+
+stl_writer_t *
+stl_writer_open(const char *filename, stl_file_type_t type, stl_error_t *err)
+{
+        stl_writer_t *writer = NULL;
+        char *str = NULL;
+
+        *err = STL_ERR_NONE;
+
+        if (type != STL_FILE_TYPE_TXT && type != STL_FILE_TYPE_BIN) {
+                *err = STL_ERR_INVALID;
+                return NULL;
+        }
+
+        writer = (stl_writer_t *)calloc(1, sizeof(*writer));
+        if (writer == NULL ||
+            (writer->buffer = (char *)malloc(STL_WRITE_BUFFER_SIZE)) == NULL ||
+            (writer->path = strdup(filename)) == NULL ||
+            (writer->temp = (char *)malloc(strlen(filename) + 8)) == NULL) {
+                *err = STL_ERR_MEM;
+                goto err;
+        }
+
+        /*
+         * Never truncate filename itself, it may be the file being read
+         * or mapped, and a failed write must leave it as it was.
+         */
+        sprintf(writer->temp, "%s.XXXXXX", filename);
+        writer->type = type;
+        writer->fd = mkstemp(writer->temp);
+        if (writer->fd == -1) {
+                *err = STL_ERR_FOPEN;
+                goto err;
+        }
+        fchmod(writer->fd, 0644);
+
+        stl_writer_name(writer, filename);
+
+        /* Binary headers must not start with "solid" */
+        if (type == STL_FILE_TYPE_BIN) {
+                snprintf((char *)writer->header, STL_WRITE_HEADER_SIZE,
+                         "binary stl %s", writer->name);
+        } else {
+                str = STL_APPEND(writer->buffer, "solid ");
+                memcpy(str, writer->name, strlen(writer->name));
+                str += strlen(writer->name);
+                *str++ = '\n';
+                writer->len = str - writer->buffer;
+        }
+
+        return writer;
+
+err:
+        if (writer) {
+                free(writer->buffer);
+                free(writer->path);
+                free(writer->temp);
+                free(writer);
+        }
+        return NULL;
+}
+
+/* Append a facet, vertices holds the three positions one after the other */
+static void
+stl_writer_facet(stl_writer_t *writer, const STLFloat normal[3],
+                 const STLFloat vertices[9])
+{
+        char *str = NULL;
+
+        if (writer->len + STL_WRITE_MAX_RECORD > STL_WRITE_BUFFER_SIZE) {
+                stl_writer_flush(writer);
+        }
+
+        str = writer->buffer + writer->len;
+
+        if (writer->type == STL_FILE_TYPE_BIN) {
+                memcpy(str, normal, 3 * sizeof(STLFloat));
+                memcpy(str + 3 * sizeof(STLFloat), vertices, 9 * sizeof(STLFloat));
+                memset(str + 12 * sizeof(STLFloat), 0,
+                       STL_BIN_FACET_SIZE - 12 * sizeof(STLFloat));
+                writer->len += STL_BIN_FACET_SIZE;
+        } else {
+                str = STL_APPEND(str, "  facet normal ");
+                str = stl_format_vector(str, normal);
+                str = STL_APPEND(str, "    outer loop\n      vertex ");
+                str = stl_format_vector(str, &vertices[0]);
+                str = STL_APPEND(str, "      vertex ");
+                str = stl_format_vector(str, &vertices[3]);
+                str = STL_APPEND(str, "      vertex ");
+                str = stl_format_vector(str, &vertices[6]);
+                str = STL_APPEND(str, "    endloop\n  endfacet\n");
+                writer->len = str - writer->buffer;
+        }
+
+        writer->facet_cnt++;
+}
+
+stl_error_t
+stl_writer_write(stl_writer_t *writer, const STLFloat *vertices, STLuint facet_cnt)
+{
+        STLFloat positions[9];
+        STLuint i = 0;
+        int idx = 0;
+
+        for (i = 0; i < facet_cnt && writer->err == STL_ERR_NONE; i++, vertices += 18) {
+                for (idx = 0; idx < 3; idx++) {
+                        memcpy(&positions[3 * idx], &vertices[6 * idx],
+                               3 * sizeof(STLFloat));
+                }
+
+                stl_writer_facet(writer, &vertices[3], positions);
+        }
+
+        return writer->err;
+}
+
+stl_error_t
+stl_writer_close(stl_writer_t *writer)
+{
+        stl_error_t err = STL_ERR_NONE;
+        int patch = writer->header_written;
+        char *str = NULL;
+
+        if (writer->type == STL_FILE_TYPE_TXT) {
+                if (writer->len + STL_WRITE_MAX_RECORD > STL_WRITE_BUFFER_SIZE) {
+                        stl_writer_flush(writer);
+                }
+
+                str = STL_APPEND(writer->buffer + writer->len, "endsolid ");
+                memcpy(str, writer->name, strlen(writer->name));
+                str += strlen(writer->name);
+                *str++ = '\n';
+                writer->len = str - writer->buffer;
+        }
+
+        memcpy(writer->header + STL_WRITE_HEADER_SIZE, &writer->facet_cnt,
+               sizeof(writer->facet_cnt));
+        stl_writer_flush(writer);
+
+        /* The header went out with the first buffer, before the count was known */
+        if (writer->type == STL_FILE_TYPE_BIN && patch && writer->err == STL_ERR_NONE &&
+            pwrite(writer->fd, &writer->facet_cnt, sizeof(writer->facet_cnt),
+                   STL_WRITE_HEADER_SIZE) != sizeof(writer->facet_cnt)) {
+                writer->err = STL_ERR_LOAD;
+        }
+
+        if (close(writer->fd) != 0 && writer->err == STL_ERR_NONE) {
+                writer->err = STL_ERR_LOAD;
+        }
+
+        if (writer->err == STL_ERR_NONE && rename(writer->temp, writer->path) != 0) {
+                writer->err = STL_ERR_LOAD;
+        }
+
+        if (writer->err != STL_ERR_NONE) {
+                unlink(writer->temp);
+        }
+
+        err = writer->err;
+        free(writer->buffer);
+        free(writer->path);
+        free(writer->temp);
+        free(writer);
+
+        return err;
+}
+
+void
+stl_writer_abort(stl_writer_t *writer)
+{
+        close(writer->fd);
+        unlink(writer->temp);
+
+        free(writer->buffer);
+        free(writer->path);
+        free(writer->temp);
+        free(writer);
+}